@@ -75,6 +75,7 @@ void bcf_call_destroy(bcf_callaux_t *bca)
     free(bca->ref_mq); free(bca->alt_mq); free(bca->ref_bq); free(bca->alt_bq);
     free(bca->fwd_mqs); free(bca->rev_mqs);
     bca->nqual = 0;
+    kpa_buf_destroy(&bca->baq);
     free(bca->bases); free(bca->inscns); free(bca);
 }
 
@@ -143,6 +144,7 @@ void bcf_callaux_clean(bcf_callaux_t *bca, bcf_call_t *call)
  * ref_base is the 4-bit representation of the reference base. It is negative if we are looking at an indel.
  * bca is the settings to perform calls across all samples
  * r is the returned value of the call
+ * Returns the number of reads used, or -1 on failure to allocate memory.
  */
 int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t *bca, bcf_callret1_t *r)
 {
@@ -239,7 +241,8 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
     }
     r->ori_depth = ori_depth;
     // glfgen
-    errmod_cal(bca->e, n, 5, bca->bases, r->p); // calculate PL of each genotype
+    if (errmod_cal(bca->e, n, 5, bca->bases, r->p) < 0) // calculate PL of each genotype
+        return -1;
     return n;
 }
 
@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdint.h>
 #include <htslib/vcf.h>
 #include "errmod.h"
+#include "kprobaln.h"
 
 /**
  *  A simplified version of Mann-Whitney U-test is calculated
@@ -65,6 +66,7 @@ typedef struct __bcf_callaux_t {
     double min_frac; // for collecting indel candidates
     float max_frac; // for collecting indel candidates
     int per_sample_flt; // indel filtering strategy
+    int max_realign; // most reads of each indel type to realign, or 0 for all
     int *ref_pos, *alt_pos, npos, *ref_mq, *alt_mq, *ref_bq, *alt_bq, *fwd_mqs, *rev_mqs, nqual; // for bias tests
     // for internal uses
     int max_bases;
@@ -75,6 +77,7 @@ typedef struct __bcf_callaux_t {
     uint16_t *bases;        // 5bit: unused, 6:quality, 1:is_rev, 4:2-bit base or indel allele (index to bcf_callaux_t.indel_types)
     errmod_t *e;
     void *rghash;
+    kpa_buf_t baq;          // qualities and DP matrices reused by bcf_call_gap_prep()
 } bcf_callaux_t;
 
 typedef struct {
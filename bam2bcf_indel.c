@@ -152,6 +152,8 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
     int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
     int N, K, l_run, ref_type, n_alt;
     char *inscns = 0, *ref2, *query, **ref_sample;
+    uint8_t *qq;            // qualities of the read being realigned
+    uint8_t *skip = NULL;   // reads left out of the realignment
     khash_t(rg) *hash = (khash_t(rg)*)rghash;
     if (ref == 0 || bca == 0) return -1;
     // mark filtered reads
@@ -350,8 +352,39 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         }
         free(inscns_aux);
     }
-    // compute the likelihood given each type of indel for each read
+    if (bca->max_realign > 0) { // pick the reads to realign if there are too many
+        int *n_type = calloc(n_types, sizeof(int)), *i_type = calloc(n_types, sizeof(int));
+        int *read_type = malloc(N * sizeof(int));
+        skip = calloc(N, 1);
+        for (s = K = 0; s < n; ++s) {
+            for (i = 0; i < n_plp[s]; ++i, ++K) {
+                for (t = 0; t < n_types; ++t)
+                    if (types[t] == plp[s][i].indel) break;
+                read_type[K] = t;
+                if (t < n_types) ++n_type[t]; // else from a filtered read group
+            }
+        }
+        // keep max_realign of each type, spread evenly through the pileup
+        for (K = 0; K < N; ++K) {
+            t = read_type[K];
+            if (t == n_types || n_type[t] <= bca->max_realign) continue;
+            skip[K] = (int64_t)(i_type[t] + 1) * bca->max_realign / n_type[t]
+                   == (int64_t)i_type[t] * bca->max_realign / n_type[t];
+            ++i_type[t];
+        }
+        free(n_type); free(i_type); free(read_type);
+    }
+    // compute the likelihood given each type of indel for each read; the
+    // qualities and the alignment matrices are kept in bca->baq, which
+    // grows as needed and is reused from site to site
     max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
+    if ((qq = kpa_buf_aux(&bca->baq, right - left + max_rd_len + max_ins + 2)) == NULL) {
+        free(skip);
+        for (i = 0; i < n; ++i) free(ref_sample[i]);
+        free(ref_sample);
+        free(types); free(inscns);
+        return -1;
+    }
     ref2  = calloc(max_ref2, 1);
     query = calloc(right - left + max_rd_len + max_ins + 2, 1);
     score1 = calloc(N * n_types, sizeof(int));
@@ -386,6 +419,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                 uint8_t *seq = bam_get_seq(p->b);
                 uint32_t *cigar = bam_get_cigar(p->b);
                 if (p->b->core.flag&4) continue; // unmapped reads
+                if (skip && skip[K]) continue; // left out by --max-realign
                 // FIXME: the following loop should be better moved outside; nonetheless, realignment should be much slower anyway.
                 for (kk = 0; kk < p->b->core.n_cigar; ++kk)
                     if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
@@ -403,8 +437,6 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                     query[l - qbeg] = seq_nt16_int[bam_seqi(seq, l)];
                 { // do realignment; this is the bottleneck
                     const uint8_t *qual = bam_get_qual(p->b), *bq;
-                    uint8_t *qq;
-                    qq = calloc(qend - qbeg, 1);
                     bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
                     if (bq) ++bq; // skip type
                     for (l = qbeg; l < qend; ++l) {
@@ -412,19 +444,18 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                         if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
                         if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
                     }
-                    sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                    (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
+                    sc = kpa_glocal_buf(&bca->baq, (uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
+                                        (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
                     l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
                     if (l > 255) l = 255;
                     score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
                     if (sc > 5) {
-                        sc = kpa_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                        (uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
+                        sc = kpa_glocal_buf(&bca->baq, (uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
+                                            (uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
                         l = (int)(100. * sc / (qend - qbeg) + .499);
                         if (l > 255) l = 255;
                         score2[K*n_types + t] = sc<<8 | l;
                     }
-                    free(qq);
                 }
 /*
                 for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
@@ -447,6 +478,10 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             for (i = 0; i < n_plp[s]; ++i, ++K) {
                 bam_pileup1_t *p = plp[s] + i;
                 int *sct = &score1[K*n_types], indelQ1, indelQ2, seqQ, indelQ;
+                if (skip && skip[K]) { // not realigned, so no evidence either way
+                    p->aux = ref_type<<16;
+                    continue;
+                }
                 for (t = 0; t < n_types; ++t) sc[t] = sct[t]<<6 | t;
                 for (t = 1; t < n_types; ++t) // insertion sort
                     for (j = t; j > 0 && sc[j] < sc[j-1]; --j)
@@ -524,7 +559,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             }
         }
     }
-    free(score1); free(score2);
+    free(score1); free(score2); free(skip);
     // free
     for (i = 0; i < n; ++i) free(ref_sample[i]);
     free(ref_sample);
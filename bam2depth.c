@@ -37,21 +37,37 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdio.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "htslib/sam.h"
 #include "samtools.h"
 #include "sam_opts.h"
+#include "tsv_out.h"
+#include "bam_sweep.h"
+#include "htslib/ksort.h"
+
+KSORT_INIT_GENERIC(int)
+
+// The pileup's own limit on reads per position, when -d is not given
+#define DEPTH_MAX_DEFAULT 8000
 
 typedef struct {     // auxiliary data structure
     samFile *fp;     // the file handle
     bam_hdr_t *hdr;  // the file header
     hts_itr_t *iter; // NULL if a region not specified
+    hts_idx_t *idx;  // index loaded for fp, with -@
     int min_mapQ, min_len; // mapQ filter; length filter
+    void *bed;       // cursor over the BED regions, if any
+    int bed_tid;     // reference the cursor is on
 } aux_t;
 
 void *bed_read(const char *fn); // read a BED or position list file
 void bed_destroy(void *_h);     // destroy the BED data structure
-int bed_overlap(const void *_h, const char *chr, int beg, int end); // test if chr:beg-end overlaps
-int bed_query(const void *_h, const char *chr, int pos, int *beg, int *end);
+const uint64_t *bed_regions(const void *_h, const char *chr, int *n); // sorted start<<32|end of chr
+void *bed_cursor_init(const void *_h); // start a cursor for moving along the references
+void bed_cursor_destroy(void *_c);
+int bed_cursor_set(void *_c, const char *chr); // move to chr
+int bed_cursor_overlap(void *_c, int beg, int end); // test if beg-end on the current chr overlaps
+int bed_cursor_next(void *_c, int pos, int *end); // first position from pos in a region, or -1
 
 // This function reads a BAM alignment from one BAM file.
 static int read_bam(void *data, bam1_t *b) // read level filters better go here to avoid pileup
@@ -65,6 +81,13 @@ static int read_bam(void *data, bam1_t *b) // read level filters better go here
         if ( b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP) ) continue;
         if ( (int)b->core.qual < aux->min_mapQ ) continue;
         if ( aux->min_len && bam_cigar2qlen(b->core.n_cigar, bam_get_cigar(b)) < aux->min_len ) continue;
+        if ( aux->bed ) { // reads outside the BED regions can't add to their depths
+            if ( b->core.tid != aux->bed_tid ) {
+                bed_cursor_set(aux->bed, aux->hdr->target_name[b->core.tid]);
+                aux->bed_tid = b->core.tid;
+            }
+            if ( !bed_cursor_overlap(aux->bed, b->core.pos, bam_endpos(b)) ) continue;
+        }
         break;
     }
     return ret;
@@ -72,6 +95,517 @@ static int read_bam(void *data, bam1_t *b) // read level filters better go here
 
 int read_file_list(const char *file_list,int *n,char **argv[]);
 
+typedef struct {     // what is printed, and how far it has got
+    const bam_hdr_t *h;
+    void *bed;
+    void *bed_cur;   // cursor over bed, on reference bed_tid
+    int bed_tid;
+    int n, all, reg, reg_tid, beg, end, max_depth, min_baseQ;
+    int last_tid, last_pos;
+    tsv_out_t w;
+    char *zeros;     // "\t0" for each file and the newline, for empty rows
+    size_t l_zeros;
+    struct summary_t *sum; // summarise windows or BED intervals instead
+    int *no_depth;
+} out_t;
+
+/*
+ * With --window or --bed-summary, depths are gathered into bins (fixed
+ * windows or BED intervals) and a summary of each bin is printed instead of
+ * its positions.  Every position is visited, as for -aa, and each bin keeps
+ * a histogram of the depths of its positions for each file until it is
+ * complete.  Depths too large for the histogram are kept in a list.  BED
+ * intervals may overlap, so several bins can be open at once; they are
+ * printed in order of their start.
+ */
+#define SUMMARY_HIST 1024
+
+typedef struct {
+    int64_t sum;
+    uint32_t hist[SUMMARY_HIST];
+    int n_over, m_over;
+    int *over;          // depths of SUMMARY_HIST or more
+} bin_depth_t;
+
+typedef struct {
+    int beg, end;       // reference span of the bin
+    int len, done;      // positions seen so far; whether the bin is complete
+    bin_depth_t *depth; // one for each file
+} bin_t;
+
+typedef struct summary_t {
+    int window;         // window size, or 0 for BED intervals
+    int binary;         // write binary records rather than text
+    int n_pct;
+    double *pct;        // percentiles to report after the mean
+    int tid;            // reference of the open bins
+    const uint64_t *reg; // BED intervals of tid
+    int n_reg, i_reg;
+    int n_bin, m_bin;
+    bin_t *bin;         // bins not yet printed
+} summary_t;
+
+static inline void put_le32(tsv_out_t *w, uint32_t x)
+{
+    char *p = tsv_out_reserve(w, 4);
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+    w->l += 4;
+}
+
+static inline void put_float(tsv_out_t *w, float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    put_le32(w, x);
+}
+
+// The binary format starts with the magic "SDB\1", the number of files, the
+// percentiles and the references; see the man page
+static void summary_header(out_t *o)
+{
+    summary_t *s = o->sum;
+    int i;
+
+    if (!s->binary) return;
+    tsv_putsn(&o->w, "SDB\1", 4);
+    put_le32(&o->w, o->n);
+    put_le32(&o->w, s->n_pct);
+    for (i = 0; i < s->n_pct; ++i) put_float(&o->w, s->pct[i]);
+    put_le32(&o->w, o->h->n_targets);
+    for (i = 0; i < o->h->n_targets; ++i) {
+        size_t l = strlen(o->h->target_name[i]) + 1;
+        put_le32(&o->w, l);
+        tsv_putsn(&o->w, o->h->target_name[i], l);
+        put_le32(&o->w, o->h->target_len[i]);
+    }
+}
+
+// Returns the k-th smallest (from 0) of the depths in d
+static int bin_depth_kth(bin_depth_t *d, int k)
+{
+    int i;
+    for (i = 0; i < SUMMARY_HIST; ++i) {
+        if (k < (int)d->hist[i]) return i;
+        k -= d->hist[i];
+    }
+    return ks_ksmall(int, d->n_over, d->over, k);
+}
+
+static void summary_print_bin(out_t *o, const bin_t *b)
+{
+    summary_t *s = o->sum;
+    int i, j, k;
+
+    if (s->binary) {
+        put_le32(&o->w, s->tid);
+        put_le32(&o->w, b->beg);
+        put_le32(&o->w, b->end);
+    } else {
+        tsv_puts(&o->w, o->h->target_name[s->tid]);
+        tsv_putc(&o->w, '\t');
+        tsv_putw(&o->w, b->beg);
+        tsv_putc(&o->w, '\t');
+        tsv_putw(&o->w, b->end);
+    }
+    for (i = 0; i < o->n; ++i) {
+        bin_depth_t *d = &b->depth[i];
+        if (s->binary) {
+            put_float(&o->w, (float)d->sum / b->len);
+        } else {
+            char *p = tsv_out_reserve(&o->w, 32);
+            o->w.l += snprintf(p, 32, "\t%.2f", (double)d->sum / b->len);
+        }
+        for (j = 0; j < s->n_pct; ++j) {
+            // Nearest rank
+            k = (int)(s->pct[j] / 100.0 * b->len + 0.999999) - 1;
+            if (k < 0) k = 0;
+            k = bin_depth_kth(d, k);
+            if (s->binary) {
+                put_le32(&o->w, k);
+            } else {
+                tsv_putc(&o->w, '\t');
+                tsv_putw(&o->w, k);
+            }
+        }
+    }
+    if (!s->binary) tsv_putc(&o->w, '\n');
+}
+
+// Prints and drops the completed bins at the start of the list
+static void summary_flush(out_t *o, int all)
+{
+    summary_t *s = o->sum;
+    int i, j;
+
+    for (i = 0; i < s->n_bin && (all || s->bin[i].done); ++i) {
+        if (s->bin[i].len) summary_print_bin(o, &s->bin[i]);
+        for (j = 0; j < o->n; ++j) free(s->bin[i].depth[j].over);
+        free(s->bin[i].depth);
+    }
+    memmove(s->bin, s->bin + i, (s->n_bin - i) * sizeof(bin_t));
+    s->n_bin -= i;
+}
+
+static void summary_open(out_t *o, int beg, int end)
+{
+    summary_t *s = o->sum;
+    bin_t *b;
+
+    if (end > (int)o->h->target_len[s->tid]) end = o->h->target_len[s->tid];
+    if (s->window) {
+        if (beg < o->beg) beg = o->beg;
+        if (end > o->end) end = o->end;
+    }
+    if (s->n_bin == s->m_bin) {
+        s->m_bin = s->m_bin? s->m_bin * 2 : 8;
+        s->bin = realloc(s->bin, s->m_bin * sizeof(bin_t));
+    }
+    b = &s->bin[s->n_bin++];
+    b->beg = beg;
+    b->end = end;
+    b->len = b->done = 0;
+    b->depth = calloc(o->n, sizeof(bin_depth_t));
+}
+
+static void summary_add(out_t *o, int tid, int pos, const int *depth)
+{
+    summary_t *s = o->sum;
+    int i, j;
+
+    if (pos >= (int)o->h->target_len[tid]) return; // not in any window
+    if (tid != s->tid) {
+        summary_flush(o, 1);
+        s->tid = tid;
+        s->i_reg = 0;
+        if (!s->window) s->reg = bed_regions(o->bed, o->h->target_name[tid], &s->n_reg);
+    }
+    for (i = 0; i < s->n_bin; ++i)
+        if (s->bin[i].end <= pos) s->bin[i].done = 1;
+    summary_flush(o, 0);
+
+    if (s->window) {
+        if (s->n_bin == 0)
+            summary_open(o, pos / s->window * s->window, pos / s->window * s->window + s->window);
+    } else {
+        for (; s->i_reg < s->n_reg && (int)(s->reg[s->i_reg] >> 32) <= pos; s->i_reg++)
+            if ((int)(uint32_t)s->reg[s->i_reg] > pos)
+                summary_open(o, s->reg[s->i_reg] >> 32, (uint32_t)s->reg[s->i_reg]);
+    }
+
+    for (i = 0; i < s->n_bin; ++i) {
+        bin_t *b = &s->bin[i];
+        if (b->done || pos < b->beg) continue;
+        for (j = 0; j < o->n; ++j) {
+            bin_depth_t *d = &b->depth[j];
+            d->sum += depth[j];
+            if (depth[j] < SUMMARY_HIST) { d->hist[depth[j]]++; continue; }
+            if (d->n_over == d->m_over) {
+                d->m_over = d->m_over? d->m_over * 2 : 64;
+                d->over = realloc(d->over, d->m_over * sizeof(int));
+            }
+            d->over[d->n_over++] = depth[j];
+        }
+        b->len++;
+    }
+}
+
+// Returns pos if it is in the BED regions, or else the start of the next one
+// (INT_MAX if there are no more)
+static int bed_skip(out_t *o, int tid, int pos)
+{
+    if (!o->bed) return pos;
+    if (tid != o->bed_tid) {
+        bed_cursor_set(o->bed_cur, o->h->target_name[tid]);
+        o->bed_tid = tid;
+    }
+    pos = bed_cursor_next(o->bed_cur, pos, NULL);
+    return pos < 0? INT_MAX : pos;
+}
+
+static void print_zero_line(out_t *o, int tid, int pos)
+{
+    if (o->sum) { summary_add(o, tid, pos, o->no_depth); return; }
+    tsv_puts(&o->w, o->h->target_name[tid]);
+    tsv_putc(&o->w, '\t');
+    tsv_putw(&o->w, pos+1);
+    tsv_putsn(&o->w, o->zeros, o->l_zeros);
+}
+
+// Prints the depths of tid:pos, and with -a any zero depth lines before it
+static void print_depth(out_t *o, int tid, int pos, const int *depth)
+{
+    const bam_hdr_t *h = o->h;
+    int i;
+
+    if (pos < o->beg || pos >= o->end) return; // out of range; skip
+    if (tid >= h->n_targets) return;     // diff number of @SQ lines per file?
+    if (bed_skip(o, tid, pos) != pos) return; // not in BED; skip
+    if (o->all) {
+        while (tid > o->last_tid) {
+            if (o->last_tid >= 0 && o->all > 1 && !o->reg) {
+                // Deal with remainder or entirety of last tid
+                while (++o->last_pos < h->target_len[o->last_tid]) {
+                    o->last_pos = bed_skip(o, o->last_tid, o->last_pos);
+                    if (o->last_pos >= h->target_len[o->last_tid]) break;
+                    print_zero_line(o, o->last_tid, o->last_pos);
+                }
+            }
+            o->last_tid++;
+            o->last_pos = -1;
+        }
+
+        // Deal with missing portion of current tid
+        if (o->last_pos < o->beg - 1) o->last_pos = o->beg - 1;
+        while (++o->last_pos < pos) {
+            if (o->last_pos < o->beg) continue; // out of range; skip
+            if ((o->last_pos = bed_skip(o, tid, o->last_pos)) >= pos) break;
+            print_zero_line(o, tid, o->last_pos);
+        }
+
+        o->last_tid = tid;
+        o->last_pos = pos;
+    }
+    if (o->sum) { summary_add(o, tid, pos, depth); return; }
+    tsv_puts(&o->w, h->target_name[tid]);
+    tsv_putc(&o->w, '\t');
+    tsv_putw(&o->w, pos+1);
+    for (i = 0; i < o->n; ++i) {
+        tsv_putc(&o->w, '\t');
+        tsv_putw(&o->w, depth[i]); // this the depth to output
+    }
+    tsv_putc(&o->w, '\n');
+}
+
+// With -a, prints the zero depth lines after the last covered position
+static void print_depth_end(out_t *o)
+{
+    const bam_hdr_t *h = o->h;
+
+    if (!o->all) return;
+    if (o->last_tid < 0) { // nothing was covered
+        o->last_tid = o->reg? o->reg_tid : 0;
+        if (o->reg) o->last_pos = o->beg - 1;
+    }
+    // Handle terminating region
+    while (o->last_tid < h->n_targets) {
+        while (++o->last_pos < h->target_len[o->last_tid]) {
+            o->last_pos = bed_skip(o, o->last_tid, o->last_pos);
+            if (o->last_pos >= h->target_len[o->last_tid] || o->last_pos >= o->end) break;
+            print_zero_line(o, o->last_tid, o->last_pos);
+        }
+        o->last_tid++;
+        o->last_pos = -1;
+        if (o->all < 2 || o->reg)
+            break;
+    }
+    if (o->sum) summary_flush(o, 1);
+}
+
+// Parses a comma separated list of percentiles
+static int parse_percentiles(const char *str, double **pct)
+{
+    int n = 0;
+    char *end;
+
+    *pct = NULL;
+    do {
+        double p = strtod(str, &end);
+        if (end == str || p < 0 || p > 100 || (*end && *end != ',')) {
+            free(*pct);
+            *pct = NULL;
+            return -1;
+        }
+        *pct = realloc(*pct, (n + 1) * sizeof(double));
+        (*pct)[n++] = p;
+        str = end + 1;
+    } while (*end);
+    return n;
+}
+
+static int depth_pileup(aux_t **data, out_t *o)
+{
+    int i, n = o->n, tid, pos, ret, *n_plp, *depth;
+    const bam_pileup1_t **plp;
+    bam_mplp_t mplp;
+
+    // the core multi-pileup loop
+    mplp = bam_mplp_init(n, read_bam, (void**)data); // initialization
+    if (0 < o->max_depth)
+        bam_mplp_set_maxcnt(mplp, o->max_depth);  // set maximum coverage depth
+    n_plp = calloc(n, sizeof(int)); // n_plp[i] is the number of covering reads from the i-th BAM
+    depth = calloc(n, sizeof(int));
+    plp = calloc(n, sizeof(bam_pileup1_t*)); // plp[i] points to the array of covering reads (internal in mplp)
+    while ((ret=bam_mplp_auto(mplp, &tid, &pos, n_plp, plp)) > 0) { // come to the next covered position
+        for (i = 0; i < n; ++i) { // base level filters have to go here
+            int j, m = 0;
+            for (j = 0; j < n_plp[i]; ++j) {
+                const bam_pileup1_t *p = plp[i] + j; // DON'T modfity plp[][] unless you really know
+                if (p->is_del || p->is_refskip) ++m; // having dels or refskips at tid:pos
+                else if (bam_get_qual(p->b)[p->qpos] < o->min_baseQ) ++m; // low base quality
+            }
+            depth[i] = n_plp[i] - m;
+        }
+        print_depth(o, tid, pos, depth);
+    }
+    free(n_plp); free(plp); free(depth);
+    bam_mplp_destroy(mplp);
+    return ret < 0? -1 : 0;
+}
+
+/*
+ * The fast engine works out depths straight from the CIGARs, without the
+ * pileup.  Each read adds +1 at the start and -1 past the end of each of
+ * its aligned runs to a difference array for its file, and a running sum
+ * over that gives the depth.  A further row, summed over all files, counts
+ * the reads spanning each position (including deletions and skips), as
+ * those are the positions the pileup would report.
+ *
+ * The arrays cover a window of the current reference from the first
+ * position not yet printed to the end of the longest read seen.  The
+ * inputs are merged in coordinate order, so everything before the start of
+ * the next read is final and can be printed and dropped from the window.
+ */
+#define FAST_FLUSH 65536   // positions printed before the window is shifted
+
+typedef struct {
+    int n;              // number of input files; row n is the spanning count
+    int tid, beg;       // reference and position of column 0 of the window
+    int len, max;       // columns used and allocated in each row
+    int *diff;          // n+1 rows of max columns
+    int *cur, *depth;   // running sums, and the depths of the current position
+} fast_depth_t;
+
+static void fast_reserve(fast_depth_t *w, int len)
+{
+    int r, max;
+    int *diff;
+
+    if (len > w->len) w->len = len;
+    if (len <= w->max) return;
+    max = w->max? w->max : FAST_FLUSH;
+    while (max < len) max *= 2;
+    diff = calloc((size_t)(w->n + 1) * max, sizeof(int));
+    for (r = 0; r <= w->n; ++r)
+        memcpy(diff + (size_t)r * max, w->diff + (size_t)r * w->max, w->max * sizeof(int));
+    free(w->diff);
+    w->diff = diff;
+    w->max = max;
+}
+
+static inline void fast_add(fast_depth_t *w, int row, int beg, int end)
+{
+    int *d = w->diff + (size_t)row * w->max;
+    d[beg - w->beg]++;
+    d[end - w->beg]--;
+}
+
+// Adds the aligned bases of b from file i to the window
+static void fast_push(fast_depth_t *w, int i, const bam1_t *b, int min_baseQ)
+{
+    const uint32_t *cigar = bam_get_cigar(b);
+    const uint8_t *qual = bam_get_qual(b);
+    int j, x = b->core.pos, y = 0, end = bam_endpos(b);
+    uint32_t k;
+
+    fast_reserve(w, end - w->beg + 1);
+    fast_add(w, w->n, x, end);
+    for (k = 0; k < b->core.n_cigar; ++k) {
+        int op = bam_cigar_op(cigar[k]), l = bam_cigar_oplen(cigar[k]);
+        int type = bam_cigar_type(op);
+        if ((type & 3) == 3) { // consumes query and reference
+            if (!min_baseQ || b->core.l_qseq == 0) {
+                fast_add(w, i, x, x + l);
+            } else {
+                // Add runs of bases passing the quality threshold
+                int run = -1;
+                for (j = 0; j < l; ++j) {
+                    if (qual[y + j] >= min_baseQ) { if (run < 0) run = j; }
+                    else if (run >= 0) { fast_add(w, i, x + run, x + j); run = -1; }
+                }
+                if (run >= 0) fast_add(w, i, x + run, x + l);
+            }
+        }
+        if (type & 1) y += l;
+        if (type & 2) x += l;
+    }
+}
+
+// Prints the window up to (but not including) position upto
+static void fast_flush(fast_depth_t *w, out_t *o, int upto)
+{
+    int r, k, m = upto - w->beg;
+    int max_depth = o->max_depth > 0? o->max_depth : DEPTH_MAX_DEFAULT;
+
+    if (m > w->len) m = w->len;
+    for (k = 0; k < m; ++k) {
+        for (r = 0; r <= w->n; ++r)
+            w->cur[r] += w->diff[(size_t)r * w->max + k];
+        if (w->cur[w->n] > 0) {
+            for (r = 0; r < w->n; ++r)
+                w->depth[r] = w->cur[r] > max_depth? max_depth : w->cur[r];
+            print_depth(o, w->tid, w->beg + k, w->depth);
+        }
+    }
+    for (r = 0; r <= w->n && m > 0; ++r) {
+        int *d = w->diff + (size_t)r * w->max;
+        memmove(d, d + m, (w->len - m) * sizeof(int));
+        memset(d + w->len - m, 0, m * sizeof(int));
+    }
+    w->len -= m;
+    // Nothing extends past the window, so gaps in coverage can be skipped
+    w->beg = w->len? w->beg + m : upto;
+}
+
+static int depth_fast(aux_t **data, out_t *o)
+{
+    fast_depth_t w;
+    bam1_t **b;
+    int i, j, n = o->n, ret = 0, *has;
+
+    memset(&w, 0, sizeof w);
+    w.n = n;
+    w.tid = -1;
+    w.cur = calloc(n + 1, sizeof(int));
+    w.depth = calloc(n, sizeof(int));
+    b = calloc(n, sizeof(bam1_t*));
+    has = calloc(n, sizeof(int));
+    for (i = 0; i < n; ++i) {
+        b[i] = bam_init1();
+        if ((has[i] = read_bam(data[i], b[i])) < -1) ret = -1;
+    }
+    while (ret == 0) {
+        // Take the next read from whichever file it comes from
+        for (i = 0, j = -1; i < n; ++i) {
+            if (has[i] < 0) continue;
+            if (j < 0 || b[i]->core.tid < b[j]->core.tid
+                || (b[i]->core.tid == b[j]->core.tid && b[i]->core.pos < b[j]->core.pos)) j = i;
+        }
+        if (j >= 0 && w.tid >= 0 && (b[j]->core.tid < w.tid
+                || (b[j]->core.tid == w.tid && b[j]->core.pos < w.beg))) {
+            print_error("depth", "the --fast mode requires coordinate sorted input");
+            ret = -1;
+            break;
+        }
+        if (j < 0 || b[j]->core.tid != w.tid) {
+            if (w.tid >= 0) fast_flush(&w, o, INT_MAX);
+            if (j < 0) break;
+            memset(w.cur, 0, (n + 1) * sizeof(int));
+            w.tid = b[j]->core.tid;
+            w.beg = b[j]->core.pos;
+        } else if (b[j]->core.pos - w.beg >= FAST_FLUSH) {
+            fast_flush(&w, o, b[j]->core.pos);
+        }
+        if (b[j]->core.n_cigar) fast_push(&w, j, b[j], o->min_baseQ);
+        if ((has[j] = read_bam(data[j], b[j])) < -1) ret = -1;
+    }
+
+    for (i = 0; i < n; ++i) bam_destroy1(b[i]);
+    free(b); free(has);
+    free(w.diff); free(w.cur); free(w.depth);
+    return ret;
+}
+
+
 static int usage() {
     fprintf(stderr, "\n");
     fprintf(stderr, "Usage: samtools depth [options] in1.bam [in2.bam [...]]\n");
@@ -82,9 +616,16 @@ static int usage() {
     fprintf(stderr, "   -f <list>           list of input BAM filenames, one per line [null]\n");
     fprintf(stderr, "   -l <int>            read length threshold (ignore reads shorter than <int>)\n");
     fprintf(stderr, "   -d/-m <int>         maximum coverage depth [8000]\n");  // the htslib's default
+    fprintf(stderr, "   --fast              count depth from the CIGARs, without building a pileup;\n");
+    fprintf(stderr, "                       depths over -d are clamped rather than reads dropped\n");
+    fprintf(stderr, "   --window <int>      print a summary of each window of <int> bases\n");
+    fprintf(stderr, "   --bed-summary       print a summary of each interval in the -b file\n");
+    fprintf(stderr, "   --percentiles <list> percentiles summarised after the mean [10,50,90]\n");
+    fprintf(stderr, "   --binary            write summaries in a binary format\n");
     fprintf(stderr, "   -q <int>            base quality threshold\n");
     fprintf(stderr, "   -Q <int>            mapping quality threshold\n");
     fprintf(stderr, "   -r <chr:from-to>    region\n");
+    fprintf(stderr, "   -@, --threads <int> number of additional threads, each taking a region of indexed input [0]\n");
 
     sam_global_opt_help(stderr, "-.--.");
 
@@ -92,32 +633,255 @@ static int usage() {
     fprintf(stderr, "The output is a simple tab-separated table with three columns: reference name,\n");
     fprintf(stderr, "position, and coverage depth.  Note that positions with zero coverage may be\n");
     fprintf(stderr, "omitted by default; see the -a option.\n");
+    fprintf(stderr, "Summaries have the reference name, start and end (as in BED), then for each\n");
+    fprintf(stderr, "input the mean depth and the depth at each percentile.\n");
     fprintf(stderr, "\n");
 
     return 1;
 }
 
+static void depth_close(aux_t *aux)
+{
+    if (aux == NULL) return;
+    bam_hdr_destroy(aux->hdr);
+    hts_itr_destroy(aux->iter);
+    if (aux->idx) hts_idx_destroy(aux->idx);   // before the handle it refers to
+    if (aux->fp) sam_close(aux->fp);
+    if (aux->bed) bed_cursor_destroy(aux->bed);
+    free(aux);
+}
+
+// Opens fn and reads its header, returning NULL on failure
+static aux_t *depth_open(const char *fn, const htsFormat *fmt, int rf, int min_mapQ, int min_len, void *bed)
+{
+    aux_t *aux = calloc(1, sizeof(aux_t));
+    aux->bed_tid = -1;
+    if (bed && (aux->bed = bed_cursor_init(bed)) == NULL) {
+        print_error_errno("depth", "Couldn't allocate memory");
+        goto fail;
+    }
+    aux->fp = sam_open_format(fn, "r", fmt); // open BAM
+    if (aux->fp == NULL) {
+        print_error_errno("depth", "Could not open \"%s\"", fn);
+        goto fail;
+    }
+    if (hts_set_opt(aux->fp, CRAM_OPT_REQUIRED_FIELDS, rf)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
+        goto fail;
+    }
+    if (hts_set_opt(aux->fp, CRAM_OPT_DECODE_MD, 0)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+        goto fail;
+    }
+    aux->min_mapQ = min_mapQ;                    // set the mapQ filter
+    aux->min_len  = min_len;                     // set the qlen filter
+    aux->hdr = sam_hdr_read(aux->fp);            // read the BAM header
+    if (aux->hdr == NULL) {
+        fprintf(stderr, "Couldn't read header for \"%s\"\n", fn);
+        goto fail;
+    }
+    return aux;
+
+ fail:
+    depth_close(aux);
+    return NULL;
+}
+
+/*
+ * With -@, the references (or the -r region) are split into chunks that
+ * are processed by separate threads, and the output of each chunk is
+ * written in order.  Each thread takes a set of file handles from a shared
+ * pool, opening a new set only if none is free.  Every handle loads its own
+ * index, as a CRAM index can only be used with the handle it was loaded
+ * for.  Chunks hold whole windows, and with --bed-summary each reference is
+ * a single chunk.
+ */
+#define DEPTH_CHUNK (1 << 20)
+
+typedef struct {
+    int tid, beg, end;
+} chunk_t;
+
+typedef struct {
+    char **fn;
+    const htsFormat *fmt;
+    int rf, min_mapQ, min_len, fast;
+    const out_t *o;     // settings shared by every chunk
+    chunk_t *chunk;
+    pthread_mutex_t lock;
+    int n_spare;
+    aux_t ***spare;     // sets of handles not in use
+} depth_par_t;
+
+static int depth_chunk(void *data, int i, kstring_t *str)
+{
+    depth_par_t *p = (depth_par_t*)data;
+    const chunk_t *c = &p->chunk[i];
+    out_t o = *p->o;
+    summary_t sum;
+    aux_t **aux = NULL;
+    int j, ret = 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->n_spare) aux = p->spare[--p->n_spare];
+    pthread_mutex_unlock(&p->lock);
+    if (aux == NULL) {
+        aux = calloc(o.n, sizeof(aux_t*));
+        for (j = 0; j < o.n; ++j) {
+            if ((aux[j] = depth_open(p->fn[j], p->fmt, p->rf, p->min_mapQ, p->min_len, p->o->bed)) == NULL
+                || (aux[j]->idx = sam_index_load(aux[j]->fp, p->fn[j])) == NULL) {
+                if (aux[j]) print_error("depth", "can't load index for \"%s\"", p->fn[j]);
+                while (j >= 0) depth_close(aux[j--]);
+                free(aux);
+                return 1;
+            }
+        }
+    }
+    for (j = 0; j < o.n; ++j)
+        if ((aux[j]->iter = sam_itr_queryi(aux[j]->idx, c->tid, c->beg, c->end)) == NULL) ret = -1;
+
+    o.beg = c->beg;
+    o.end = c->end;
+    o.reg = 1;
+    o.reg_tid = c->tid;
+    o.last_tid = o.last_pos = -1;
+    if (o.bed && (o.bed_cur = bed_cursor_init(o.bed)) == NULL) ret = -1;
+    o.bed_tid = -1;
+    if (o.sum) {
+        sum = *o.sum;
+        sum.tid = -1;
+        sum.n_bin = sum.m_bin = 0;
+        sum.bin = NULL;
+        o.sum = &sum;
+    }
+    tsv_out_init(&o.w, NULL);
+    if (ret == 0 && (p->fast? depth_fast(aux, &o) : depth_pileup(aux, &o)) < 0) ret = -1;
+    if (ret == 0) {
+        print_depth_end(&o);
+        str->s = o.w.buf; str->l = o.w.l; str->m = o.w.m;
+    } else {
+        print_error("depth", "failed to read %s:%d-%d", o.h->target_name[c->tid], c->beg + 1, c->end);
+        free(o.w.buf);
+    }
+    if (o.sum) free(sum.bin);
+    if (o.bed_cur) bed_cursor_destroy(o.bed_cur);
+
+    for (j = 0; j < o.n; ++j) {
+        hts_itr_destroy(aux[j]->iter);
+        aux[j]->iter = NULL;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->spare[p->n_spare++] = aux;
+    pthread_mutex_unlock(&p->lock);
+    return ret < 0? 1 : 0;
+}
+
+// Splits the references, or the region being reported, into chunks
+static chunk_t *depth_chunks(const out_t *o, hts_idx_t **idx, int window, int whole, int *n_chunks)
+{
+    chunk_t *chunk = NULL;
+    int tid, j, m = 0;
+    int64_t size = DEPTH_CHUNK;
+
+    if (window) size = (DEPTH_CHUNK + window - 1) / window * window;
+    *n_chunks = 0;
+    for (tid = o->reg? o->reg_tid : 0; tid < o->h->n_targets; ++tid) {
+        int64_t beg = 0, end = o->h->target_len[tid], next;
+        if (o->reg) {
+            if (beg < o->beg) beg = o->beg;
+            if (end > o->end) end = o->end;
+        }
+        if (o->bed && !bed_regions(o->bed, o->h->target_name[tid], &j)) goto next_tid;
+        if (!o->all) {
+            // Skip references the indices say have no mapped reads
+            for (j = 0; j < o->n; ++j) {
+                uint64_t mapped, unmapped;
+                if (hts_idx_get_stat(idx[j], tid, &mapped, &unmapped) < 0 || mapped > 0) break;
+            }
+            if (j == o->n) goto next_tid;
+        }
+        for (; beg < end; beg = next) {
+            next = whole? end : (beg / size + 1) * size;
+            if (next > end) next = end;
+            // Let the last chunk print anything past the end of the reference,
+            // as the serial code would
+            if (next == end) next = o->reg? o->end : INT_MAX;
+            if (*n_chunks == m) {
+                m = m? m * 2 : 256;
+                chunk = realloc(chunk, m * sizeof(chunk_t));
+            }
+            chunk[*n_chunks].tid = tid;
+            chunk[*n_chunks].beg = beg;
+            chunk[(*n_chunks)++].end = next;
+        }
+     next_tid:
+        if (o->reg) break;
+    }
+    return chunk;
+}
+
+static int depth_parallel(out_t *o, char **fn, hts_idx_t **idx, const htsFormat *fmt,
+                          int rf, int min_mapQ, int min_len, int fast, int window,
+                          int n_threads)
+{
+    depth_par_t p;
+    int i, ret, n_chunks;
+
+    memset(&p, 0, sizeof p);
+    p.fn = fn; p.fmt = fmt; p.rf = rf;
+    p.min_mapQ = min_mapQ; p.min_len = min_len; p.fast = fast;
+    p.o = o;
+    p.chunk = depth_chunks(o, idx, window, o->sum && !window, &n_chunks);
+    p.spare = calloc(n_threads, sizeof(aux_t**));
+    pthread_mutex_init(&p.lock, NULL);
+
+    // Anything already buffered, such as the binary header, goes first
+    tsv_out_flush(&o->w);
+    ret = sweep_run(n_chunks, n_threads, depth_chunk, &p, stdout);
+
+    for (i = 0; i < p.n_spare; ++i) {
+        int j;
+        for (j = 0; j < o->n; ++j) depth_close(p.spare[i][j]);
+        free(p.spare[i]);
+    }
+    free(p.spare);
+    free(p.chunk);
+    pthread_mutex_destroy(&p.lock);
+    return ret? -1 : 0;
+}
+
 int main_depth(int argc, char *argv[])
 {
-    int i, n, tid, beg, end, pos, *n_plp, baseQ = 0, mapQ = 0, min_len = 0;
+    int i, n, beg, end, baseQ = 0, mapQ = 0, min_len = 0, fast = 0, rf, n_threads = 0;
     int all = 0, status = EXIT_SUCCESS, nfiles, max_depth = -1;
-    const bam_pileup1_t **plp;
     char *reg = 0; // specified region
     void *bed = 0; // BED data structure
     char *file_list = NULL, **fn = NULL;
     bam_hdr_t *h = NULL; // BAM header of the 1st input
     aux_t **data;
-    bam_mplp_t mplp;
-    int last_pos = -1, last_tid = -1, ret;
+    hts_idx_t **idx;
+    out_t out;
+    summary_t sum;
+    int bed_summary = 0;
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0),
+        { "fast", no_argument, NULL, 1 },
+        { "window", required_argument, NULL, 2 },
+        { "bed-summary", no_argument, NULL, 3 },
+        { "percentiles", required_argument, NULL, 4 },
+        { "binary", no_argument, NULL, 5 },
+        { "threads", required_argument, NULL, '@' },
         { NULL, 0, NULL, 0 }
     };
 
+    memset(&out, 0, sizeof out);
+    memset(&sum, 0, sizeof sum);
+    sum.tid = -1;
+
     // parse the command line
-    while ((n = getopt_long(argc, argv, "r:b:q:Q:l:f:am:d:", lopts, NULL)) >= 0) {
+    while ((n = getopt_long(argc, argv, "r:b:q:Q:l:f:am:d:@:", lopts, NULL)) >= 0) {
         switch (n) {
             case 'l': min_len = atoi(optarg); break; // minimum query length
             case 'r': reg = strdup(optarg); break;   // parsing a region requires a BAM header
@@ -130,6 +894,23 @@ int main_depth(int argc, char *argv[])
             case 'f': file_list = optarg; break;
             case 'a': all++; break;
             case 'd': case 'm': max_depth = atoi(optarg); break; // maximum coverage depth
+            case 1: fast = 1; break;
+            case 2:
+                if ((sum.window = atoi(optarg)) <= 0) {
+                    print_error("depth", "invalid window size \"%s\"", optarg);
+                    return 1;
+                }
+                break;
+            case 3: bed_summary = 1; break;
+            case 4:
+                free(sum.pct);
+                if ((sum.n_pct = parse_percentiles(optarg, &sum.pct)) < 0) {
+                    print_error("depth", "invalid percentiles \"%s\"", optarg);
+                    return 1;
+                }
+                break;
+            case 5: sum.binary = 1; break;
+            case '@': n_threads = atoi(optarg); break;
             default:  if (parse_sam_global_opt(n, optarg, lopts, &ga) == 0) break;
                       /* else fall-through */
             case '?': return usage();
@@ -137,6 +918,18 @@ int main_depth(int argc, char *argv[])
     }
     if (optind == argc && !file_list)
         return usage();
+    if (bed_summary && (!bed || sum.window)) {
+        print_error("depth", "--bed-summary needs -b, and can't be used with --window");
+        return 1;
+    }
+    if (sum.binary && !bed_summary && !sum.window) {
+        print_error("depth", "--binary needs --window or --bed-summary");
+        return 1;
+    }
+    if (bed_summary || sum.window) {
+        if (sum.pct == NULL) sum.n_pct = parse_percentiles("10,50,90", &sum.pct);
+        all = 2; // every position counts towards its bin
+    }
 
     // initialize the auxiliary data structures
     if (file_list)
@@ -149,44 +942,29 @@ int main_depth(int argc, char *argv[])
     else
         n = argc - optind; // the number of BAMs on the command line
     data = calloc(n, sizeof(aux_t*)); // data[i] for the i-th input
+    idx = calloc(n, sizeof(hts_idx_t*));
     beg = 0; end = INT_MAX;  // set the default region
+    rf = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ;
+    if (baseQ) rf |= SAM_QUAL;
+    // A single -a prints each reference only up to its last covered position,
+    // which can't be known when the reference is split up
+    if (all == 1) n_threads = 0;
     for (i = 0; i < n; ++i) {
-        int rf;
-        data[i] = calloc(1, sizeof(aux_t));
-        data[i]->fp = sam_open_format(argv[optind+i], "r", &ga.in); // open BAM
-        if (data[i]->fp == NULL) {
-            print_error_errno("depth", "Could not open \"%s\"", argv[optind+i]);
-            status = EXIT_FAILURE;
-            goto depth_end;
-        }
-        rf = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ;
-        if (baseQ) rf |= SAM_QUAL;
-        if (hts_set_opt(data[i]->fp, CRAM_OPT_REQUIRED_FIELDS, rf)) {
-            fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
-            return 1;
-        }
-        if (hts_set_opt(data[i]->fp, CRAM_OPT_DECODE_MD, 0)) {
-            fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
-            return 1;
-        }
-        data[i]->min_mapQ = mapQ;                    // set the mapQ filter
-        data[i]->min_len  = min_len;                 // set the qlen filter
-        data[i]->hdr = sam_hdr_read(data[i]->fp);    // read the BAM header
-        if (data[i]->hdr == NULL) {
-            fprintf(stderr, "Couldn't read header for \"%s\"\n",
-                    argv[optind+i]);
+        data[i] = depth_open(argv[optind+i], &ga.in, rf, mapQ, min_len, bed);
+        if (data[i] == NULL) {
             status = EXIT_FAILURE;
             goto depth_end;
         }
-        if (reg) { // if a region is specified
-            hts_idx_t *idx = sam_index_load(data[i]->fp, argv[optind+i]);  // load the index
-            if (idx == NULL) {
+        if (reg || n_threads > 0) {
+            idx[i] = sam_index_load(data[i]->fp, argv[optind+i]);  // load the index
+            if (idx[i] == NULL) {
                 print_error("depth", "can't load index for \"%s\"", argv[optind+i]);
                 status = EXIT_FAILURE;
                 goto depth_end;
             }
-            data[i]->iter = sam_itr_querys(idx, data[i]->hdr, reg); // set the iterator
-            hts_idx_destroy(idx); // the index is not needed any more; free the memory
+        }
+        if (reg) { // if a region is specified
+            data[i]->iter = sam_itr_querys(idx[i], data[i]->hdr, reg); // set the iterator
             if (data[i]->iter == NULL) {
                 print_error("depth", "can't parse region \"%s\"", reg);
                 status = EXIT_FAILURE;
@@ -201,90 +979,53 @@ int main_depth(int argc, char *argv[])
         end = data[0]->iter->end;
     }
 
-    // the core multi-pileup loop
-    mplp = bam_mplp_init(n, read_bam, (void**)data); // initialization
-    if (0 < max_depth)
-        bam_mplp_set_maxcnt(mplp,max_depth);  // set maximum coverage depth
-    n_plp = calloc(n, sizeof(int)); // n_plp[i] is the number of covering reads from the i-th BAM
-    plp = calloc(n, sizeof(bam_pileup1_t*)); // plp[i] points to the array of covering reads (internal in mplp)
-    while ((ret=bam_mplp_auto(mplp, &tid, &pos, n_plp, plp)) > 0) { // come to the next covered position
-        if (pos < beg || pos >= end) continue; // out of range; skip
-        if (tid >= h->n_targets) continue;     // diff number of @SQ lines per file?
-        if (bed && bed_overlap(bed, h->target_name[tid], pos, pos + 1) == 0) continue; // not in BED; skip
-        if (all) {
-            while (tid > last_tid) {
-                if (last_tid >= 0 && all > 1 && !reg) {
-                    // Deal with remainder or entirety of last tid
-                    while (++last_pos < h->target_len[last_tid]) {
-                        if (bed && bed_overlap(bed, h->target_name[last_tid], last_pos, last_pos + 1) == 0)
-                            continue;
-                        fputs(h->target_name[last_tid], stdout); printf("\t%d", last_pos+1);
-                        for (i = 0; i < n; i++)
-                            putchar('\t'), putchar('0');
-                        putchar('\n');
-                    }
-                }
-                last_tid++;
-                last_pos = -1;
-            }
-
-            // Deal with missing portion of current tid
-            while (++last_pos < pos) {
-                if (last_pos < beg) continue; // out of range; skip
-                if (bed && bed_overlap(bed, h->target_name[tid], last_pos, last_pos + 1) == 0)
-                    continue;
-                fputs(h->target_name[tid], stdout); printf("\t%d", last_pos+1);
-                for (i = 0; i < n; i++)
-                    putchar('\t'), putchar('0');
-                putchar('\n');
-            }
-
-            last_tid = tid;
-            last_pos = pos;
-        }
-        fputs(h->target_name[tid], stdout); printf("\t%d", pos+1); // a customized printf() would be faster
-        for (i = 0; i < n; ++i) { // base level filters have to go here
-            int j, m = 0;
-            for (j = 0; j < n_plp[i]; ++j) {
-                const bam_pileup1_t *p = plp[i] + j; // DON'T modfity plp[][] unless you really know
-                if (p->is_del || p->is_refskip) ++m; // having dels or refskips at tid:pos
-                else if (bam_get_qual(p->b)[p->qpos] < baseQ) ++m; // low base quality
-            }
-            printf("\t%d", n_plp[i] - m); // this the depth to output
-        }
-        putchar('\n');
+    out.h = h;
+    out.bed = bed;
+    out.bed_tid = -1;
+    if (bed && (out.bed_cur = bed_cursor_init(bed)) == NULL) {
+        print_error_errno("depth", "Couldn't allocate memory");
+        status = EXIT_FAILURE;
+        goto depth_end;
     }
-    if (ret < 0) status = EXIT_FAILURE;
-    free(n_plp); free(plp);
-    bam_mplp_destroy(mplp);
-
-    if (all) {
-        // Handle terminating region
-        while (last_tid < h->n_targets) {
-            while (++last_pos < h->target_len[last_tid]) {
-                if (last_pos >= end) break;
-                if (bed && bed_overlap(bed, h->target_name[last_tid], last_pos, last_pos + 1) == 0)
-                    continue;
-                fputs(h->target_name[last_tid], stdout); printf("\t%d", last_pos+1);
-                for (i = 0; i < n; i++)
-                    putchar('\t'), putchar('0');
-                putchar('\n');
-            }
-            last_tid++;
-            last_pos = -1;
-            if (all < 2 || reg)
-                break;
-        }
+    out.n = n;
+    out.all = all;
+    out.reg = reg != NULL;
+    out.beg = beg;
+    out.end = end;
+    out.max_depth = max_depth;
+    out.min_baseQ = baseQ;
+    out.reg_tid = reg? data[0]->iter->tid : 0;
+    out.last_tid = out.last_pos = -1;
+    out.sum = bed_summary || sum.window? &sum : NULL;
+    out.no_depth = calloc(n, sizeof(int));
+    out.l_zeros = 2 * n + 1;
+    out.zeros = malloc(out.l_zeros);
+    for (i = 0; i < n; ++i) out.zeros[2*i] = '\t', out.zeros[2*i+1] = '0';
+    out.zeros[2*n] = '\n';
+    tsv_out_init(&out.w, stdout);
+    if (out.sum) summary_header(&out);
+    if (n_threads > 0) {
+        if (depth_parallel(&out, argv + optind, idx, &ga.in, rf, mapQ, min_len, fast, sum.window, n_threads + 1) < 0)
+            status = EXIT_FAILURE;
+    } else {
+        if ((fast? depth_fast(data, &out) : depth_pileup(data, &out)) < 0) status = EXIT_FAILURE;
+        print_depth_end(&out);
+    }
+    if (tsv_out_destroy(&out.w) < 0) {
+        print_error_errno("depth", "error writing to standard output");
+        status = EXIT_FAILURE;
     }
+    free(out.zeros);
+    free(out.no_depth);
+    if (out.bed_cur) bed_cursor_destroy(out.bed_cur);
+    free(sum.bin); free(sum.pct);
 
 depth_end:
-    for (i = 0; i < n && data[i]; ++i) {
-        bam_hdr_destroy(data[i]->hdr);
-        if (data[i]->fp) sam_close(data[i]->fp);
-        hts_itr_destroy(data[i]->iter);
-        free(data[i]);
+    for (i = 0; i < n; ++i) {
+        if (idx[i]) hts_idx_destroy(idx[i]);
+        depth_close(data[i]);
     }
-    free(data); free(reg);
+    free(data); free(idx); free(reg);
     if (bed) bed_destroy(bed);
     if ( file_list )
     {
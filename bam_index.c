@@ -29,95 +29,417 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/hts.h>
 #include <htslib/sam.h>
 #include <htslib/khash.h>
+#include <htslib/hfile.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #include "samtools.h"
+#include "bam_sweep.h"
+#include "bam_scan.h"
 
 #define BAM_LIDX_SHIFT    14
 
 static void index_usage(FILE *fp)
 {
     fprintf(fp,
-"Usage: samtools index [-bc] [-m INT] <in.bam> [out.index]\n"
+"Usage: samtools index [-bc] [-m INT] [-@ INT] <in.bam> [out.index]\n"
+"       samtools index -M [-bc] [-m INT] [-@ INT] <in1.bam> <in2.bam>...\n"
+"       samtools index --tee -o out.bam [-bc] [-m INT] [-@ INT] [in.bam [out.index]]\n"
 "Options:\n"
 "  -b       Generate BAI-format index for BAM files [default]\n"
 "  -c       Generate CSI-format index for BAM files\n"
-"  -m INT   Set minimum interval size for CSI indices to 2^INT [%d]\n", BAM_LIDX_SHIFT);
+"  -m INT   Set minimum interval size for CSI indices to 2^INT [%d]\n"
+"  -M       Interpret all filename arguments as files to be indexed\n"
+"  -@ INT   Number of additional threads to use for decompression [0]\n"
+"  --tee    Copy a BAM file [stdin] to the -o file unchanged, indexing it on\n"
+"           the way through\n"
+"  -o FILE  Where --tee writes the BAM file\n", BAM_LIDX_SHIFT);
+}
+
+/*
+ * Indexes a BGZF-compressed BAM file as sam_index_build2() does, but with
+ * its blocks inflated by n_threads threads, and if tee is not NULL also
+ * copies it there.  The index is named after idx_fn unless fnidx is given.
+ * Returns as sam_index_build2(), with -4 if writing to tee failed, or -3 if
+ * fn is not such a file and should be left to sam_index_build2().
+ */
+static int index_bam_mt(const char *fn, const char *idx_fn, const char *fnidx,
+                        int min_shift, int n_threads, hFILE *tee)
+{
+    bam_scan_reader_t *r;
+    bam_hdr_t *h;
+    hts_idx_t *idx;
+    bam1_t *b;
+    int i, n_lvls, idx_fmt, ret;
+
+    // A stream can't be opened twice, so only check files up front
+    if (tee == NULL) {
+        const htsFormat *fmt;
+        htsFile *fp;
+        int is_bam;
+        if ((fp = hts_open(fn, "r")) == NULL) return -2;
+        fmt = hts_get_format(fp);
+        is_bam = (fmt->format == bam && fmt->compression == bgzf);
+        hts_close(fp);
+        if (!is_bam) return -3;
+    }
+    if ((r = bam_scan_reader_open(fn, n_threads, tee, &h)) == NULL) return -3;
+
+    idx_fmt = min_shift > 0? HTS_FMT_CSI : HTS_FMT_BAI;
+    if (min_shift > 0) {
+        int64_t max_len = 0, s;
+        for (i = 0; i < h->n_targets; ++i)
+            if (max_len < h->target_len[i]) max_len = h->target_len[i];
+        max_len += 256;
+        for (n_lvls = 0, s = 1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
+    } else min_shift = 14, n_lvls = 5;
+    idx = hts_idx_init(h->n_targets, idx_fmt, bam_scan_reader_tell(r), min_shift, n_lvls);
+    bam_hdr_destroy(h);
+
+    b = bam_init1();
+    while ((ret = bam_scan_reader_read(r, b)) >= 0)
+        if (hts_idx_push(idx, b->core.tid, b->core.pos, bam_endpos(b), bam_scan_reader_tell(r),
+                         !(b->core.flag & BAM_FUNMAP)) < 0) break; // unsorted
+    bam_destroy1(b);
+
+    if (ret == -1) {
+        hts_idx_finish(idx, bam_scan_reader_tell(r));
+        if (fnidx) hts_idx_save_as(idx, idx_fn, fnidx, idx_fmt);
+        else hts_idx_save(idx, idx_fn, idx_fmt);
+        ret = 0;
+    } else ret = -1;
+    hts_idx_destroy(idx);
+    if (bam_scan_reader_close(r) < 0 && tee) ret = -4;
+    return ret;
+}
+
+static int index_error(int ret, const char *fn)
+{
+    if (ret == -2)
+        print_error_errno("index", "failed to open \"%s\"", fn);
+    else if (ret == -3)
+        print_error("index", "\"%s\" is in a format that cannot be usefully indexed", fn);
+    else if (ret == -4)
+        print_error_errno("index", "failed to write the copy of \"%s\"", fn);
+    else
+        print_error("index", "\"%s\" is corrupted or unsorted", fn);
+    return EXIT_FAILURE;
+}
+
+static int build_index(const char *fn, const char *fnidx, int min_shift, int n_threads)
+{
+    int ret = n_threads > 1? index_bam_mt(fn, fn, fnidx, min_shift, n_threads, NULL) : -3;
+    if (ret == -3) ret = sam_index_build2(fn, fnidx, min_shift);
+    return ret? index_error(ret, fn) : 0;
+}
+
+static int tee_index(const char *fn, const char *out_fn, const char *fnidx,
+                     int min_shift, int n_threads)
+{
+    hFILE *out;
+    int ret;
+
+    if ((out = hopen(out_fn, "w")) == NULL) {
+        print_error_errno("index", "failed to create \"%s\"", out_fn);
+        return EXIT_FAILURE;
+    }
+    ret = index_bam_mt(fn, out_fn, fnidx, min_shift, n_threads, out);
+    if (hclose(out) != 0 && ret == 0) ret = -4;
+    return ret? index_error(ret, fn) : 0;
 }
 
 int bam_index(int argc, char *argv[])
 {
     int csi = 0;
     int min_shift = BAM_LIDX_SHIFT;
-    int c, ret;
+    int multiple = 0, tee = 0, n_threads = 0;
+    char *out_fn = NULL;
+    int c, i, ret = 0;
 
-    while ((c = getopt(argc, argv, "bcm:")) >= 0)
+    static const struct option lopts[] = {
+        {"tee", no_argument, NULL, 1},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "bcm:Mo:@:", lopts, NULL)) >= 0)
         switch (c) {
         case 'b': csi = 0; break;
         case 'c': csi = 1; break;
         case 'm': csi = 1; min_shift = atoi(optarg); break;
+        case 'M': multiple = 1; break;
+        case 'o': out_fn = optarg; break;
+        case '@': n_threads = atoi(optarg); break;
+        case 1: tee = 1; break;
         default:
             index_usage(stderr);
             return 1;
         }
 
+    if (tee) {
+        const char *fnidx = optind + 1 < argc? argv[optind+1] : NULL;
+        if (out_fn == NULL || multiple) {
+            print_error("index", "--tee needs one output file given with -o, and can't be used with -M");
+            return 1;
+        }
+        if (strcmp(out_fn, "-") == 0 && fnidx == NULL) {
+            print_error("index", "an index file name must be given when --tee writes to stdout");
+            return 1;
+        }
+        return tee_index(optind < argc? argv[optind] : "-", out_fn, fnidx,
+                         csi? min_shift : 0, n_threads + 1);
+    }
+
     if (optind == argc) {
         index_usage(stdout);
         return 1;
     }
 
-    ret = sam_index_build2(argv[optind], argv[optind+1], csi? min_shift : 0);
-    if (ret != 0) {
-        if (ret == -2)
-            print_error_errno("index", "failed to open \"%s\"", argv[optind]);
-        else if (ret == -3)
-            print_error("index", "\"%s\" is in a format that cannot be usefully indexed", argv[optind]);
-        else
-            print_error("index", "\"%s\" is corrupted or unsorted", argv[optind]);
-        return EXIT_FAILURE;
+    if (!multiple)
+        return build_index(argv[optind], argv[optind+1], csi? min_shift : 0, n_threads + 1);
+
+    for (i = optind; i < argc; ++i)
+        if (build_index(argv[i], NULL, csi? min_shift : 0, n_threads + 1) != 0) ret = EXIT_FAILURE;
+    return ret;
+}
+
+typedef struct {
+    char **fn;
+    int format, sum;
+    int fast;           // count CRAM single-reference containers without decoding
+    // Totals for --sum, and the header of the first file they were taken from
+    pthread_mutex_t lock;
+    bam_hdr_t *sum_hdr;
+    uint64_t *sum_mapped, *sum_unmapped, sum_no_coor;
+} idxstats_sweep_t;
+
+// Fills in mapped[], unmapped[] and *no_coor for fn.  For CRAM the counts
+// come from the containers listed in the .crai, as bam_scan_cram_counts()
+// gives them; otherwise from the index.
+static int idxstats_counts(const char *fn, samFile *fp, const bam_hdr_t *header, int fast,
+                           uint64_t *mapped, uint64_t *unmapped, uint64_t *no_coor)
+{
+    hts_idx_t *idx;
+    int tid;
+
+    if (hts_get_format(fp)->format == cram) {
+        if (bam_scan_cram_counts(fn, header->n_targets, mapped, unmapped, no_coor, fast) < 0) {
+            fprintf(stderr, "[bam_idxstats] fail to read the CRAM index for \"%s\".\n", fn);
+            return -1;
+        }
+        return 0;
     }
 
+    idx = sam_index_load(fp, fn);
+    if (idx == NULL) { fprintf(stderr, "[bam_idxstats] fail to load the index for \"%s\".\n", fn); return -1; }
+    for (tid = 0; tid < header->n_targets; ++tid)
+        hts_idx_get_stat(idx, tid, &mapped[tid], &unmapped[tid]);
+    *no_coor = hts_idx_get_n_no_coor(idx);
+    hts_idx_destroy(idx);
     return 0;
 }
 
-int bam_idxstats(int argc, char *argv[])
+static int same_targets(const bam_hdr_t *a, const bam_hdr_t *b)
 {
-    hts_idx_t* idx;
-    bam_hdr_t* header;
-    samFile* fp;
+    int tid;
+    if (a->n_targets != b->n_targets) return 0;
+    for (tid = 0; tid < a->n_targets; ++tid)
+        if (a->target_len[tid] != b->target_len[tid]
+            || strcmp(a->target_name[tid], b->target_name[tid]) != 0) return 0;
+    return 1;
+}
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: samtools idxstats <in.bam>\n");
-        return 1;
+static int idxstats_add(idxstats_sweep_t *is, const char *fn, bam_hdr_t **header,
+                        const uint64_t *mapped, const uint64_t *unmapped, uint64_t no_coor)
+{
+    int tid, ret = 0;
+
+    pthread_mutex_lock(&is->lock);
+    if (is->sum_hdr == NULL) {
+        is->sum_mapped = (uint64_t*)calloc((*header)->n_targets + 1, sizeof(uint64_t));
+        is->sum_unmapped = (uint64_t*)calloc((*header)->n_targets + 1, sizeof(uint64_t));
+        if (is->sum_mapped == NULL || is->sum_unmapped == NULL) {
+            fprintf(stderr, "[bam_idxstats] out of memory.\n");
+            free(is->sum_mapped); is->sum_mapped = NULL;
+            free(is->sum_unmapped); is->sum_unmapped = NULL;
+            ret = 1;
+        } else {
+            is->sum_hdr = *header;
+            *header = NULL;
+        }
+    } else if (!same_targets(is->sum_hdr, *header)) {
+        fprintf(stderr, "[bam_idxstats] references of \"%s\" differ from the other files.\n", fn);
+        ret = 1;
     }
-    fp = sam_open(argv[1], "r");
-    if (fp == NULL) { fprintf(stderr, "[%s] fail to open BAM.\n", __func__); return 1; }
+    if (ret == 0) {
+        for (tid = 0; tid < is->sum_hdr->n_targets; ++tid) {
+            is->sum_mapped[tid] += mapped[tid];
+            is->sum_unmapped[tid] += unmapped[tid];
+        }
+        is->sum_no_coor += no_coor;
+    }
+    pthread_mutex_unlock(&is->lock);
+    return ret;
+}
+
+static void idxstats_report(int format, const char *fn, const bam_hdr_t *header,
+                            const uint64_t *mapped, const uint64_t *unmapped,
+                            uint64_t no_coor, kstring_t *out)
+{
+    int tid;
+
+    if (format == SWEEP_JSON) {
+        kputs(",\"references\":[", out);
+        for (tid = 0; tid < header->n_targets; ++tid) {
+            kputs(tid? ",{\"name\":" : "{\"name\":", out);
+            kputs_json(header->target_name[tid], out);
+            ksprintf(out, ",\"length\":%u,\"mapped\":%" PRIu64 ",\"unmapped\":%" PRIu64 "}",
+                     header->target_len[tid], mapped[tid], unmapped[tid]);
+        }
+        ksprintf(out, "],\"unplaced_unmapped\":%" PRIu64, no_coor);
+        return;
+    }
+
+    for (tid = 0; tid < header->n_targets; ++tid) {
+        if (format == SWEEP_TSV) { kputs(fn, out); kputc('\t', out); }
+        // Print out contig name and length
+        ksprintf(out, "%s\t%d", header->target_name[tid], header->target_len[tid]);
+        ksprintf(out, "\t%" PRIu64 "\t%" PRIu64 "\n", mapped[tid], unmapped[tid]);
+    }
+    // Dump information about unmapped reads
+    if (format == SWEEP_TSV) { kputs(fn, out); kputc('\t', out); }
+    ksprintf(out, "*\t0\t0\t%" PRIu64 "\n", no_coor);
+}
+
+static int idxstats_file(void *data, int i, kstring_t *out)
+{
+    idxstats_sweep_t *is = (idxstats_sweep_t*)data;
+    const char *fn = is->fn[i];
+    bam_hdr_t* header = NULL;
+    samFile* fp;
+    uint64_t *mapped = NULL, *unmapped = NULL, no_coor = 0;
+    int ret = 1;
+
+    fp = sam_open(fn, "r");
+    if (fp == NULL) { fprintf(stderr, "[bam_idxstats] fail to open \"%s\".\n", fn); goto report; }
     header = sam_hdr_read(fp);
     if (header == NULL) {
-        fprintf(stderr, "[%s] failed to read header for '%s'.\n",
-                __func__, argv[1]);
+        fprintf(stderr, "[bam_idxstats] failed to read header for '%s'.\n", fn);
+        goto report;
+    }
+    // One spare entry, as calloc(0) may return NULL
+    mapped = (uint64_t*)calloc(header->n_targets + 1, sizeof(uint64_t));
+    unmapped = (uint64_t*)calloc(header->n_targets + 1, sizeof(uint64_t));
+    if (mapped == NULL || unmapped == NULL) {
+        fprintf(stderr, "[bam_idxstats] out of memory.\n");
+        goto report;
+    }
+    if (idxstats_counts(fn, fp, header, is->fast, mapped, unmapped, &no_coor) < 0) goto report;
+    ret = 0;
+
+ report:
+    if (is->sum) {
+        // Only failures are reported per file
+        if (ret == 0) ret = idxstats_add(is, fn, &header, mapped, unmapped, no_coor);
+    } else if (is->format == SWEEP_JSON) {
+        kputs("{\"file\":", out);
+        kputs_json(fn, out);
+        ksprintf(out, ",\"status\":\"%s\"", ret? "error" : "ok");
+        if (ret == 0) idxstats_report(is->format, fn, header, mapped, unmapped, no_coor, out);
+        kputs("}\n", out);
+    } else if (ret == 0) {
+        idxstats_report(is->format, fn, header, mapped, unmapped, no_coor, out);
+    }
+
+    free(mapped);
+    free(unmapped);
+    if (header) bam_hdr_destroy(header);
+    if (fp) sam_close(fp);
+    return ret;
+}
+
+static void idxstats_usage(FILE *fp)
+{
+    fprintf(fp,
+"Usage: samtools idxstats [options] <in.bam> [...]\n"
+"Options:\n"
+"  -b FILE    List of input files, one per line\n"
+"  -s, --sum  Print a single table of counts summed over all input files,\n"
+"             which must have the same references\n"
+"  -O FORMAT  Output format, tsv or json [tsv for more than one file,\n"
+"             which adds the file name as the first column]\n"
+"  --fast     For CRAM, count the reads of single-reference containers as\n"
+"             mapped without decoding their flags\n"
+"  -@, --threads INT\n"
+"             Number of additional threads, to read several files at once [0]\n");
+}
+
+int bam_idxstats(int argc, char *argv[])
+{
+    idxstats_sweep_t is;
+    kstring_t str = { 0, 0, NULL };
+    char *fofn = NULL;
+    int c, ret, n_files, n_threads = 0;
+
+    static const struct option lopts[] = {
+        {"threads", required_argument, NULL, '@'},
+        {"output-fmt", required_argument, NULL, 'O'},
+        {"sum", no_argument, NULL, 's'},
+        {"fast", no_argument, NULL, 1},
+        {NULL, 0, NULL, 0}
+    };
+
+    memset(&is, 0, sizeof is);
+    is.format = -1;
+    while ((c = getopt_long(argc, argv, "b:sO:@:", lopts, NULL)) >= 0) {
+        switch (c) {
+        case 'b': fofn = optarg; break;
+        case 's': is.sum = 1; break;
+        case 1: is.fast = 1; break;
+        case '@': n_threads = atoi(optarg); break;
+        case 'O':
+            if ((is.format = sweep_parse_format(optarg)) >= 0) break;
+            print_error("idxstats", "unknown output format \"%s\"", optarg);
+            /* else fall-through */
+        default:
+            idxstats_usage(stderr);
+            return 1;
+        }
+    }
+
+    if (argc == optind && fofn == NULL) {
+        idxstats_usage(stderr);
         return 1;
     }
-    idx = sam_index_load(fp, argv[1]);
-    if (idx == NULL) { fprintf(stderr, "[%s] fail to load the index.\n", __func__); return 1; }
+    if ((is.fn = sweep_inputs(fofn, argc - optind, argv + optind, &n_files)) == NULL)
+        return 1;
+    // The summed table has no file column
+    if (is.sum && is.format == SWEEP_TSV) is.format = SWEEP_TEXT;
+    if (is.format < 0) is.format = n_files > 1 && !is.sum? SWEEP_TSV : SWEEP_TEXT;
+    if (is.format == SWEEP_TSV) fputs("#file\tname\tlength\tmapped\tunmapped\n", stdout);
 
-    int i;
-    for (i = 0; i < header->n_targets; ++i) {
-        // Print out contig name and length
-        printf("%s\t%d", header->target_name[i], header->target_len[i]);
-        // Now fetch info about it from the meta bin
-        uint64_t u, v;
-        hts_idx_get_stat(idx, i, &u, &v);
-        printf("\t%" PRIu64 "\t%" PRIu64 "\n", u, v);
+    pthread_mutex_init(&is.lock, NULL);
+    ret = sweep_run(n_files, n_threads + 1, idxstats_file, &is, stdout);
+    if (is.sum && is.sum_hdr) {
+        if (is.format == SWEEP_JSON) {
+            ksprintf(&str, "{\"files\":%d,\"status\":\"%s\"", n_files, ret? "error" : "ok");
+            idxstats_report(is.format, NULL, is.sum_hdr, is.sum_mapped, is.sum_unmapped, is.sum_no_coor, &str);
+            kputs("}\n", &str);
+        } else {
+            idxstats_report(is.format, NULL, is.sum_hdr, is.sum_mapped, is.sum_unmapped, is.sum_no_coor, &str);
+        }
+        fputs(str.s, stdout);
+        free(str.s);
+        bam_hdr_destroy(is.sum_hdr);
+        free(is.sum_mapped);
+        free(is.sum_unmapped);
     }
-    // Dump information about unmapped reads
-    printf("*\t0\t0\t%" PRIu64 "\n", hts_idx_get_n_no_coor(idx));
-    bam_hdr_destroy(header);
-    hts_idx_destroy(idx);
-    sam_close(fp);
-    return 0;
+    pthread_mutex_destroy(&is.lock);
+    sweep_free_inputs(is.fn, n_files);
+    return ret? 1 : 0;
 }
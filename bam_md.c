@@ -30,12 +30,12 @@ DEALINGS IN THE SOFTWARE.  */
 #include <ctype.h>
 #include <limits.h>
 #include <math.h>
-#include "htslib/faidx.h"
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "kprobaln.h"
 #include "sam_opts.h"
 #include "samtools.h"
+#include "ref_cache.h"
 
 #define USE_EQUAL 1
 #define DROP_TAG  2
@@ -46,7 +46,7 @@ DEALINGS IN THE SOFTWARE.  */
 
 int bam_aux_drop_other(bam1_t *b, uint8_t *s);
 
-void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm)
+void bam_fillmd1_core(bam1_t *b, const char *ref, int ref_len, int flag, int max_nm)
 {
     uint8_t *seq = bam_get_seq(b);
     uint32_t *cigar = bam_get_cigar(b);
@@ -156,12 +156,12 @@ void bam_fillmd1_core(bam1_t *b, char *ref, int ref_len, int flag, int max_nm)
     free(str->s); free(str);
 }
 
-void bam_fillmd1(bam1_t *b, char *ref, int flag)
+void bam_fillmd1(bam1_t *b, const char *ref, int flag)
 {
     bam_fillmd1_core(b, ref, INT_MAX, flag, 0);
 }
 
-int bam_cap_mapQ(bam1_t *b, char *ref, int ref_len, int thres)
+int bam_cap_mapQ(bam1_t *b, const char *ref, int ref_len, int thres)
 {
     uint8_t *seq = bam_get_seq(b), *qual = bam_get_qual(b);
     uint32_t *cigar = bam_get_cigar(b);
@@ -212,7 +212,11 @@ int bam_cap_mapQ(bam1_t *b, char *ref, int ref_len, int thres)
     return (int)(t + .499);
 }
 
-int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag)
+/*
+ * Computes BAQ for b, keeping all the working arrays in buf so that
+ * repeated calls allocate nothing once it has grown large enough.
+ */
+int bam_prob_realn_buf(bam1_t *b, const char *ref, int ref_len, int flag, kpa_buf_t *buf)
 {
     int k, i, bw, x, y, yb, ye, xb, xe, apply_baq = flag&1, extend_baq = flag>>1&1, redo_baq = flag&4;
     uint32_t *cigar = bam_get_cigar(b);
@@ -271,20 +275,31 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag)
     if (xe - xb - c->l_qseq > bw)
         xb += (xe - xb - c->l_qseq - bw) / 2, xe -= (xe - xb - c->l_qseq - bw) / 2;
     { // glocal
-        uint8_t *s, *r, *q, *seq = bam_get_seq(b), *bq;
+        uint8_t *s, *r, *q, *seq = bam_get_seq(b), *bq, *left, *rght;
         int *state;
-        bq = calloc(c->l_qseq + 1, 1);
+        // state[], then bq[], s[], q[], left[], rght[] and r[] in one block
+        state = kpa_buf_aux(buf, c->l_qseq * (sizeof(int) + 5) + 1 + (xe - xb));
+        if (state == NULL) return -1;
+        bq = (uint8_t*)(state + c->l_qseq);
+        s = bq + c->l_qseq + 1;
+        q = s + c->l_qseq;
+        left = q + c->l_qseq;
+        rght = left + c->l_qseq;
+        r = rght + c->l_qseq;
         memcpy(bq, qual, c->l_qseq);
-        s = calloc(c->l_qseq, 1);
+        bq[c->l_qseq] = 0;
         for (i = 0; i < c->l_qseq; ++i) s[i] = seq_nt16_int[bam_seqi(seq, i)];
-        r = calloc(xe - xb, 1);
         for (i = xb; i < xe; ++i) {
             if (i >= ref_len || ref[i] == '\0') { xe = i; break; }
             r[i-xb] = seq_nt16_int[seq_nt16_table[(int)ref[i]]];
         }
-        state = calloc(c->l_qseq, sizeof(int));
-        q = calloc(c->l_qseq, 1);
-        kpa_glocal(r, xe-xb, s, c->l_qseq, qual, &conf, state, q);
+        // kpa_glocal_buf() leaves state[] and q[] alone if the reference
+        // span is empty, and they are reused from the last read
+        if (xe - xb <= 0) {
+            memset(state, 0, c->l_qseq * sizeof(int));
+            memset(q, 0, c->l_qseq);
+        }
+        if (kpa_glocal_buf(buf, r, xe-xb, s, c->l_qseq, qual, &conf, state, q) < 0) return -1;
         if (!extend_baq) { // in this block, bq[] is capped by base quality qual[]
             for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
                 int op = cigar[k]&0xf, l = cigar[k]>>4;
@@ -299,8 +314,6 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag)
             }
             for (i = 0; i < c->l_qseq; ++i) bq[i] = qual[i] - bq[i] + 64; // finalize BQ
         } else { // in this block, bq[] is BAQ that can be larger than qual[] (different from the above!)
-            uint8_t *left, *rght;
-            left = calloc(c->l_qseq, 1); rght = calloc(c->l_qseq, 1);
             for (k = 0, x = c->pos, y = 0; k < c->n_cigar; ++k) {
                 int op = cigar[k]&0xf, l = cigar[k]>>4;
                 if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
@@ -317,17 +330,23 @@ int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag)
                 else if (op == BAM_CDEL) x += l;
             }
             for (i = 0; i < c->l_qseq; ++i) bq[i] = 64 + (qual[i] <= bq[i]? 0 : qual[i] - bq[i]); // finalize BQ
-            free(left); free(rght);
         }
         if (apply_baq) {
             for (i = 0; i < c->l_qseq; ++i) qual[i] -= bq[i] - 64; // modify qual
             bam_aux_append(b, "ZQ", 'Z', c->l_qseq + 1, bq);
         } else bam_aux_append(b, "BQ", 'Z', c->l_qseq + 1, bq);
-        free(bq); free(s); free(r); free(q); free(state);
     }
     return 0;
 }
 
+int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag)
+{
+    kpa_buf_t buf = { 0, 0, NULL, NULL };
+    int ret = bam_prob_realn_buf(b, ref, ref_len, flag, &buf);
+    kpa_buf_destroy(&buf);
+    return ret;
+}
+
 int bam_prob_realn(bam1_t *b, const char *ref)
 {
     return bam_prob_realn_core(b, ref, INT_MAX, 1);
@@ -354,8 +373,10 @@ int bam_fillmd(int argc, char *argv[])
     int c, flt_flag, tid = -2, ret, len, is_bam_out, is_uncompressed, max_nm, is_realn, capQ, baq_flag;
     samFile *fp = NULL, *fpout = NULL;
     bam_hdr_t *header = NULL;
-    faidx_t *fai = NULL;
-    char *ref = NULL, mode_w[8], *ref_file;
+    ref_cache_t *refs = NULL;
+    kpa_buf_t baq = { 0, 0, NULL, NULL };
+    const char *ref = NULL;
+    char mode_w[8], *ref_file;
     bam1_t *b = NULL;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
 
@@ -416,9 +437,9 @@ int bam_fillmd(int argc, char *argv[])
     }
 
     ref_file = argc > optind + 1 ? argv[optind+1] : ga.reference;
-    fai = fai_load(ref_file);
+    refs = ref_cache_open(ref_file);
 
-    if (!fai) {
+    if (!refs) {
         print_error_errno("calmd", "Failed to open reference file '%s'", ref_file);
         goto fail;
     }
@@ -431,8 +452,8 @@ int bam_fillmd(int argc, char *argv[])
     while ((ret = sam_read1(fp, header, b)) >= 0) {
         if (b->core.tid >= 0) {
             if (tid != b->core.tid) {
-                free(ref);
-                ref = fai_fetch(fai, header->target_name[b->core.tid], &len);
+                if (ref) ref_cache_put(refs, header->target_name[tid]);
+                ref = ref_cache_get(refs, header->target_name[b->core.tid], &len);
                 tid = b->core.tid;
                 if (ref == 0) { // FIXME: Should this always be fatal?
                     fprintf(stderr, "[bam_fillmd] fail to find sequence '%s' in the reference.\n",
@@ -440,7 +461,7 @@ int bam_fillmd(int argc, char *argv[])
                     if (is_realn || capQ > 10) goto fail; // Would otherwise crash
                 }
             }
-            if (is_realn) bam_prob_realn_core(b, ref, len, baq_flag);
+            if (is_realn) bam_prob_realn_buf(b, ref, len, baq_flag, &baq);
             if (capQ > 10) {
                 int q = bam_cap_mapQ(b, ref, len, capQ);
                 if (b->core.qual > q) b->core.qual = q;
@@ -457,10 +478,11 @@ int bam_fillmd(int argc, char *argv[])
         goto fail;
     }
     bam_destroy1(b);
+    if (ref) ref_cache_put(refs, header->target_name[tid]);
     bam_hdr_destroy(header);
 
-    free(ref);
-    fai_destroy(fai);
+    ref_cache_close(refs);
+    kpa_buf_destroy(&baq);
     sam_close(fp);
     if (sam_close(fpout) < 0) {
         fprintf(stderr, "[bam_fillmd] error when closing output file\n");
@@ -469,10 +491,11 @@ int bam_fillmd(int argc, char *argv[])
     return 0;
 
  fail:
-    free(ref);
+    if (ref) ref_cache_put(refs, header->target_name[tid]);
     if (b) bam_destroy1(b);
     if (header) bam_hdr_destroy(header);
-    if (fai) fai_destroy(fai);
+    ref_cache_close(refs);
+    kpa_buf_destroy(&baq);
     if (fp) sam_close(fp);
     if (fpout) sam_close(fpout);
     return 1;
@@ -35,64 +35,69 @@ DEALINGS IN THE SOFTWARE.  */
 #include <errno.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <htslib/sam.h>
-#include <htslib/faidx.h>
 #include <htslib/kstring.h>
 #include <htslib/khash_str2int.h>
 #include "sam_header.h"
 #include "samtools.h"
 #include "sam_opts.h"
+#include "tsv_out.h"
+#include "bam_sweep.h"
+#include "ref_cache.h"
+#include "kprobaln.h"
 
-static inline int printw(int c, FILE *fp)
+/*
+ * The pileup text of each file is built straight into the output buffer,
+ * after reserving room for the longest it could be, rather than through
+ * tsv_putc() a character at a time.  Bases are looked up by strand in a
+ * table, after comparing their 4-bit codes with the reference's.
+ */
+static const char mplp_base_char[2][16] = {
+    { '=','A','C','M','G','R','S','V','T','W','Y','H','K','D','B','N' },
+    { '=','a','c','m','g','r','s','v','t','w','y','h','k','d','b','n' }
+};
+
+// The Phred+33 character for a quality, as far as '~'
+static inline int mplp_qual_char(int q)
 {
-    char buf[16];
-    int l, x;
-    if (c == 0) return fputc('0', fp);
-    for (l = 0, x = c < 0? -c : c; x > 0; x /= 10) buf[l++] = x%10 + '0';
-    if (c < 0) buf[l++] = '-';
-    buf[l] = 0;
-    for (x = 0; x < l/2; ++x) {
-        int y = buf[x]; buf[x] = buf[l-1-x]; buf[l-1-x] = y;
-    }
-    fputs(buf, fp);
-    return 0;
+    return q < 93? q + 33 : 126;
 }
 
-static inline void pileup_seq(FILE *fp, const bam_pileup1_t *p, int pos, int ref_len, const char *ref)
+// The most characters pileup_seq() writes for p
+#define MPLP_SEQ_MAX(p) (15 + abs((p)->indel))
+
+/*
+ * Writes the bases of p at s, returning the end.  ref16 is the 4-bit code
+ * of the reference base, or 0 (the code of '=') if there is no reference.
+ */
+static inline char *pileup_seq(char *s, const bam_pileup1_t *p, int pos, int ref_len, const char *ref, int ref16)
 {
-    int j;
+    int j, rev = bam_is_rev(p->b);
     if (p->is_head) {
-        putc('^', fp);
-        putc(p->b->core.qual > 93? 126 : p->b->core.qual + 33, fp);
+        *s++ = '^';
+        *s++ = mplp_qual_char(p->b->core.qual);
     }
     if (!p->is_del) {
-        int c = p->qpos < p->b->core.l_qseq
-            ? seq_nt16_str[bam_seqi(bam_get_seq(p->b), p->qpos)]
-            : 'N';
-        if (ref) {
-            int rb = pos < ref_len? ref[pos] : 'N';
-            if (c == '=' || seq_nt16_table[c] == seq_nt16_table[rb]) c = bam_is_rev(p->b)? ',' : '.';
-            else c = bam_is_rev(p->b)? tolower(c) : toupper(c);
-        } else {
-            if (c == '=') c = bam_is_rev(p->b)? ',' : '.';
-            else c = bam_is_rev(p->b)? tolower(c) : toupper(c);
-        }
-        putc(c, fp);
-    } else putc(p->is_refskip? (bam_is_rev(p->b)? '<' : '>') : '*', fp);
+        int c = p->qpos < p->b->core.l_qseq? bam_seqi(bam_get_seq(p->b), p->qpos) : 15;
+        *s++ = c == 0 || c == ref16? (rev? ',' : '.') : mplp_base_char[rev][c];
+    } else *s++ = p->is_refskip? (rev? '<' : '>') : '*';
     if (p->indel > 0) {
-        putc('+', fp); printw(p->indel, fp);
-        for (j = 1; j <= p->indel; ++j) {
-            int c = seq_nt16_str[bam_seqi(bam_get_seq(p->b), p->qpos + j)];
-            putc(bam_is_rev(p->b)? tolower(c) : toupper(c), fp);
-        }
+        const uint8_t *seq = bam_get_seq(p->b);
+        *s++ = '+';
+        s = tsv_fmtul(s, p->indel);
+        for (j = 1; j <= p->indel; ++j)
+            *s++ = mplp_base_char[rev][bam_seqi(seq, p->qpos + j)];
     } else if (p->indel < 0) {
-        printw(p->indel, fp);
+        *s++ = '-';
+        s = tsv_fmtul(s, -p->indel);
         for (j = 1; j <= -p->indel; ++j) {
             int c = (ref && (int)pos+j < ref_len)? ref[pos+j] : 'N';
-            putc(bam_is_rev(p->b)? tolower(c) : toupper(c), fp);
+            *s++ = rev? tolower(c) : toupper(c);
         }
     }
-    if (p->is_tail) putc('$', fp);
+    if (p->is_tail) *s++ = '$';
+    return s;
 }
 
 #include <assert.h>
@@ -112,38 +117,81 @@ static inline void pileup_seq(FILE *fp, const bam_pileup1_t *p, int pos, int ref
 #define MPLP_PRINT_MAPQ (1<<10)
 #define MPLP_PER_SAMPLE (1<<11)
 #define MPLP_SMART_OVERLAPS (1<<12)
+#define MPLP_COUNT      (1<<13)
 
 void *bed_read(const char *fn);
 void bed_destroy(void *_h);
-int bed_overlap(const void *_h, const char *chr, int beg, int end);
+void *bed_cursor_init(const void *_h);
+void bed_cursor_destroy(void *_c);
+int bed_cursor_set(void *_c, const char *chr);
+int bed_cursor_overlap(void *_c, int beg, int end);
+int bed_cursor_next(void *_c, int pos, int *end);
+const uint64_t *bed_regions(const void *_h, const char *chr, int *n);
 
 typedef struct {
     int min_mq, flag, min_baseQ, capQ_thres, max_depth, max_indel_depth, fmt_flag;
     int rflag_require, rflag_filter;
-    int openQ, extQ, tandemQ, min_support; // for indels
+    int openQ, extQ, tandemQ, min_support, max_realign; // for indels
     double min_frac; // for indels
     char *reg, *pl_list, *fai_fname, *output_fname;
-    faidx_t *fai;
+    ref_cache_t *refs;
     void *bed, *rghash;
+    int n_threads, n_readers;
     int argc;
     char **argv;
     sam_global_args ga;
 } mplp_conf_t;
 
 typedef struct {
-    char *ref[2];
+    const char *ref[2];
     int ref_id[2];
     int ref_len[2];
+    ref_cache_t *refs;  // where they are held from, or NULL
 } mplp_ref_t;
 
-#define MPLP_REF_INIT {{NULL,NULL},{-1,-1},{0,0}}
+#define MPLP_REF_INIT {{NULL,NULL},{-1,-1},{0,0},NULL}
+
+/*
+ * The sample of a read, remembered so that its read group is looked up
+ * once rather than at every position it covers.  Reads are known by the
+ * id bam_plp gives each one it takes in, which goes up from read to read.
+ */
+typedef struct {
+    const bam1_t *b;
+    uint64_t id;
+    int smid;
+} mplp_smid_t;
+
+/*
+ * With -l, reads are fetched through the index, where the inputs have one,
+ * over spans covering the listed regions, so that the gaps between sparse
+ * sites are skipped rather than read.  Regions less than MPLP_JUMP_GAP
+ * apart share a span, as reading through a short gap costs less than a
+ * seek.  A read overlapping two spans is returned by both iterators, so
+ * those starting before the end of the last span are skipped.
+ */
+#define MPLP_JUMP_GAP (1 << 14)
+
+typedef struct {
+    int tid, beg, end;
+} mplp_span_t;
 
 typedef struct {
     samFile *fp;
     hts_itr_t *iter;
+    const hts_idx_t *idx;       // for moving iter on to span, if reading spans
+    hts_idx_t *own_idx;         // loaded for fp, if a worker of -@ opened it
+    const mplp_span_t *span;    // spans to read once iter is done
+    int n_span;
+    int skip_tid, skip_end;     // the end of the span last read
     bam_hdr_t *h;
     mplp_ref_t *ref;
     const mplp_conf_t *conf;
+    void *bed;      // cursor over conf->bed, on reference bed_tid
+    int bed_tid;
+    kpa_buf_t baq;
+    int m_smid;         // size of smid, a power of 2
+    mplp_smid_t *smid;  // indexed by id
 } mplp_aux_t;
 
 typedef struct {
@@ -152,19 +200,17 @@ typedef struct {
     bam_pileup1_t **plp;
 } mplp_pileup_t;
 
-static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
-    mplp_ref_t *r = ma->ref;
+static int mplp_get_ref(mplp_ref_t *r, const bam_hdr_t *h, int tid, const char **ref, int *ref_len) {
 
     //printf("get ref %d {%d/%p, %d/%p}\n", tid, r->ref_id[0], r->ref[0], r->ref_id[1], r->ref[1]);
 
-    if (!r || !ma->conf->fai) {
+    if (!r || !r->refs) {
         *ref = NULL;
         return 0;
     }
 
-    // Do we need to reference count this so multiple mplp_aux_t can
-    // track which references are in use?
-    // For now we just cache the last two. Sufficient?
+    // The sequences are shared through r->refs, which counts their users;
+    // the last two are held here to save looking them up for every read.
     if (tid == r->ref_id[0]) {
         *ref = r->ref[0];
         *ref_len = r->ref_len[0];
@@ -176,7 +222,7 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
         tmp = r->ref_id[0];  r->ref_id[0]  = r->ref_id[1];  r->ref_id[1]  = tmp;
         tmp = r->ref_len[0]; r->ref_len[0] = r->ref_len[1]; r->ref_len[1] = tmp;
 
-        char *tc;
+        const char *tc;
         tc = r->ref[0]; r->ref[0] = r->ref[1]; r->ref[1] = tc;
         *ref = r->ref[0];
         *ref_len = r->ref_len[0];
@@ -184,17 +230,15 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
     }
 
     // New, so migrate to old and load new
-    free(r->ref[1]);
+    if (r->ref[1]) ref_cache_put(r->refs, h->target_name[r->ref_id[1]]);
     r->ref[1]     = r->ref[0];
     r->ref_id[1]  = r->ref_id[0];
     r->ref_len[1] = r->ref_len[0];
 
     r->ref_id[0] = tid;
-    r->ref[0] = faidx_fetch_seq(ma->conf->fai,
-                                ma->h->target_name[r->ref_id[0]],
-                                0,
-                                INT_MAX,
-                                &r->ref_len[0]);
+    r->ref[0] = ref_cache_get(r->refs,
+                              h->target_name[r->ref_id[0]],
+                              &r->ref_len[0]);
 
     if (!r->ref[0]) {
         r->ref[0] = NULL;
@@ -209,18 +253,99 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
     return 1;
 }
 
+// Releases the sequences held by r and closes its handle on the cache
+static void mplp_ref_destroy(mplp_ref_t *r, const bam_hdr_t *h)
+{
+    int i;
+    for (i = 0; i < 2; ++i)
+        if (r->ref[i]) ref_cache_put(r->refs, h->target_name[r->ref_id[i]]);
+    if (r->refs) ref_cache_close(r->refs);
+}
+
+// Moves ma's iterator on to its next span
+static int mplp_next_span(mplp_aux_t *ma)
+{
+    const mplp_span_t *sp = ma->span++;
+
+    --ma->n_span;
+    if (ma->iter) {
+        ma->skip_tid = ma->iter->tid;
+        ma->skip_end = ma->iter->end;
+        hts_itr_destroy(ma->iter);
+    }
+    if ((ma->iter = sam_itr_queryi(ma->idx, sp->tid, sp->beg, sp->end)) == NULL) {
+        fprintf(stderr, "[%s] failed to query %s:%d-%d\n", __func__,
+                ma->h->target_name[sp->tid], sp->beg + 1, sp->end);
+        return -1;
+    }
+    return 0;
+}
+
+// Has ma read just the n spans in span, using idx
+static int mplp_set_spans(mplp_aux_t *ma, const hts_idx_t *idx, const mplp_span_t *span, int n)
+{
+    if (ma->iter) hts_itr_destroy(ma->iter);
+    ma->iter = NULL;
+    ma->idx = idx;
+    ma->span = span;
+    ma->n_span = n;
+    ma->skip_tid = -1;
+    if (n > 0) return mplp_next_span(ma);
+    ma->iter = sam_itr_queryi(idx, HTS_IDX_NONE, 0, 0);
+    return ma->iter? 0 : -1;
+}
+
+/*
+ * Appends the spans covering the regions of -l within [beg, end) of tid,
+ * using cur, a cursor over them already set to tid.  Returns the number
+ * added.
+ */
+static int mplp_add_spans(void *cur, int tid, int beg, int end, mplp_span_t **span, int *n, int *m)
+{
+    int n0 = *n, pos = beg, b, e;
+
+    while (pos < end && (b = bed_cursor_next(cur, pos, &e)) >= 0 && b < end) {
+        if (e > end) e = end;
+        if (*n > n0 && b - (*span)[*n - 1].end < MPLP_JUMP_GAP) {
+            (*span)[*n - 1].end = e;
+        } else {
+            if (*n == *m) {
+                *m = *m? *m * 2 : 256;
+                *span = realloc(*span, *m * sizeof(mplp_span_t));
+            }
+            (*span)[*n].tid = tid;
+            (*span)[*n].beg = b;
+            (*span)[(*n)++].end = e;
+        }
+        pos = e;
+    }
+    return *n - n0;
+}
+
 static int mplp_func(void *data, bam1_t *b)
 {
     extern int bam_realn(bam1_t *b, const char *ref);
-    extern int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag);
-    extern int bam_cap_mapQ(bam1_t *b, char *ref, int ref_len, int thres);
-    char *ref;
+    extern int bam_prob_realn_buf(bam1_t *b, const char *ref, int ref_len, int flag, kpa_buf_t *buf);
+    extern int bam_cap_mapQ(bam1_t *b, const char *ref, int ref_len, int thres);
+    const char *ref;
     mplp_aux_t *ma = (mplp_aux_t*)data;
     int ret, skip = 0, ref_len;
     do {
         int has_ref;
         ret = ma->iter? sam_itr_next(ma->fp, ma->iter, b) : sam_read1(ma->fp, ma->h, b);
+        if (ret == -1 && ma->n_span > 0) {
+            if (mplp_next_span(ma) < 0) {
+                ret = -2;
+                break;
+            }
+            skip = 1;
+            continue;
+        }
         if (ret < 0) break;
+        if (b->core.tid == ma->skip_tid && b->core.pos < ma->skip_end) { // read already
+            skip = 1;
+            continue;
+        }
         // The 'B' cigar operation is not part of the specification, considering as obsolete.
         //  bam_remove_B(b);
         if (b->core.tid < 0 || (b->core.flag&BAM_FUNMAP)) { // exclude unmapped reads
@@ -229,8 +354,12 @@ static int mplp_func(void *data, bam1_t *b)
         }
         if (ma->conf->rflag_require && !(ma->conf->rflag_require&b->core.flag)) { skip = 1; continue; }
         if (ma->conf->rflag_filter && ma->conf->rflag_filter&b->core.flag) { skip = 1; continue; }
-        if (ma->conf->bed) { // test overlap
-            skip = !bed_overlap(ma->conf->bed, ma->h->target_name[b->core.tid], b->core.pos, bam_endpos(b));
+        if (ma->bed) { // test overlap
+            if (b->core.tid != ma->bed_tid) {
+                bed_cursor_set(ma->bed, ma->h->target_name[b->core.tid]);
+                ma->bed_tid = b->core.tid;
+            }
+            skip = !bed_cursor_overlap(ma->bed, b->core.pos, bam_endpos(b));
             if (skip) continue;
         }
         if (ma->conf->rghash) { // exclude read groups
@@ -245,8 +374,8 @@ static int mplp_func(void *data, bam1_t *b)
                 qual[i] = qual[i] > 31? qual[i] - 31 : 0;
         }
 
-        if (ma->conf->fai && b->core.tid >= 0) {
-            has_ref = mplp_get_ref(ma, b->core.tid, &ref, &ref_len);
+        if (ma->ref->refs && b->core.tid >= 0) {
+            has_ref = mplp_get_ref(ma->ref, ma->h, b->core.tid, &ref, &ref_len);
             if (has_ref && ref_len <= b->core.pos) { // exclude reads outside of the reference sequence
                 fprintf(stderr,"[%s] Skipping because %d is outside of %d [ref:%d]\n",
                         __func__, b->core.pos, ref_len, b->core.tid);
@@ -258,7 +387,7 @@ static int mplp_func(void *data, bam1_t *b)
         }
 
         skip = 0;
-        if (has_ref && (ma->conf->flag&MPLP_REALN)) bam_prob_realn_core(b, ref, ref_len, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
+        if (has_ref && (ma->conf->flag&MPLP_REALN)) bam_prob_realn_buf(b, ref, ref_len, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3, &ma->baq);
         if (has_ref && ma->conf->capQ_thres > 10) {
             int q = bam_cap_mapQ(b, ref, ref_len, ma->conf->capQ_thres);
             if (q < 0) skip = 1;
@@ -270,23 +399,201 @@ static int mplp_func(void *data, bam1_t *b)
     return ret;
 }
 
-static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
+/*
+ * With --read-threads, the inputs are shared out between reader threads,
+ * which run mplp_func() on them ahead of the pileup, so that decoding,
+ * filtering, BAQ and -C are done in parallel across files.  Each input has
+ * two arrays of reads: the reader fills one while the pileup takes from
+ * the other, and they are swapped when the pileup has taken all of its
+ * own.  Readers wait when their inputs' arrays are full, which bounds the
+ * memory used, and read next from whichever input has fewest queued.
+ */
+#define MPLP_PREFETCH 64
+
+typedef struct mplp_prefetch_t mplp_prefetch_t;
+
+typedef struct {
+    mplp_prefetch_t *pf;
+    mplp_aux_t *ma;
+    bam1_t **in, **out;     // MPLP_PREFETCH reads each
+    int n_in;               // filled by the reader
+    int n_out, i_out;       // being taken by the pileup, which alone uses these
+    int done, ret;          // whether mplp_func has returned ret < 0
+} mplp_queue_t;
+
+typedef struct {
+    mplp_prefetch_t *pf;
+    int first;              // reads inputs first, first + n_readers, ...
+    pthread_t tid;
+} mplp_reader_t;
+
+struct mplp_prefetch_t {
+    pthread_mutex_t lock;
+    pthread_cond_t added;   // a read, or the end of an input, was queued
+    pthread_cond_t taken;   // an input's queued reads were taken
+    int n, n_readers, n_started, stop;
+    mplp_queue_t *q;
+    void **qp;              // pointers to q[], for bam_mplp_init()
+    mplp_reader_t *r;
+};
+
+static void *mplp_reader(void *arg)
+{
+    mplp_reader_t *r = (mplp_reader_t*)arg;
+    mplp_prefetch_t *pf = r->pf;
+    bam1_t *b = bam_init1(), tmp;
+    int i, ret, n_left;
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        mplp_queue_t *q = NULL;
+        for (i = r->first, n_left = 0; i < pf->n; i += pf->n_readers) {
+            mplp_queue_t *x = &pf->q[i];
+            if (x->done) continue;
+            ++n_left;
+            if (x->n_in < MPLP_PREFETCH && (q == NULL || x->n_in < q->n_in)) q = x;
+        }
+        if (pf->stop || n_left == 0) break;
+        if (q == NULL) {
+            pthread_cond_wait(&pf->taken, &pf->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pf->lock);
+        ret = mplp_func(q->ma, b);
+        pthread_mutex_lock(&pf->lock);
+        if (ret >= 0) { // swap b into the queue, and take its spare record
+            tmp = *q->in[q->n_in]; *q->in[q->n_in++] = *b; *b = tmp;
+        } else {
+            q->done = 1;
+            q->ret = ret;
+        }
+        pthread_cond_signal(&pf->added);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    bam_destroy1(b);
+    return NULL;
+}
+
+// The bam_plp_auto_f for a prefetched input
+static int mplp_fetch(void *data, bam1_t *b)
+{
+    mplp_queue_t *q = (mplp_queue_t*)data;
+    mplp_prefetch_t *pf = q->pf;
+    bam1_t **t, tmp;
+
+    if (q->i_out == q->n_out) {
+        int ret = 0;
+        pthread_mutex_lock(&pf->lock);
+        while (q->n_in == 0 && !q->done)
+            pthread_cond_wait(&pf->added, &pf->lock);
+        t = q->out; q->out = q->in; q->in = t;
+        q->n_out = q->n_in; q->i_out = 0;
+        q->n_in = 0;
+        if (q->n_out == 0) ret = q->ret;
+        pthread_cond_broadcast(&pf->taken);
+        pthread_mutex_unlock(&pf->lock);
+        if (q->n_out == 0) return ret;
+    }
+    tmp = *b; *b = *q->out[q->i_out]; *q->out[q->i_out++] = tmp;
+    return 0;
+}
+
+static void mplp_prefetch_stop(mplp_prefetch_t *pf);
+
+// Starts up to n_readers threads reading the n inputs in data
+static mplp_prefetch_t *mplp_prefetch_start(mplp_aux_t **data, int n, int n_readers)
+{
+    mplp_prefetch_t *pf = calloc(1, sizeof(mplp_prefetch_t));
+    int i, j;
+
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->added, NULL);
+    pthread_cond_init(&pf->taken, NULL);
+    pf->n = n;
+    pf->n_readers = n_readers < n? n_readers : n;
+    pf->q = calloc(n, sizeof(mplp_queue_t));
+    pf->qp = calloc(n, sizeof(void*));
+    pf->r = calloc(pf->n_readers, sizeof(mplp_reader_t));
+    for (i = 0; i < n; ++i) {
+        mplp_queue_t *q = &pf->q[i];
+        q->pf = pf;
+        q->ma = data[i];
+        q->in = malloc(MPLP_PREFETCH * sizeof(bam1_t*));
+        q->out = malloc(MPLP_PREFETCH * sizeof(bam1_t*));
+        for (j = 0; j < MPLP_PREFETCH; ++j) {
+            q->in[j] = bam_init1();
+            q->out[j] = bam_init1();
+        }
+        pf->qp[i] = q;
+    }
+    for (i = 0; i < pf->n_readers; ++i) {
+        pf->r[i].pf = pf;
+        pf->r[i].first = i;
+        if (pthread_create(&pf->r[i].tid, NULL, mplp_reader, &pf->r[i]) != 0) {
+            fprintf(stderr, "[%s] failed to start a reader thread\n", __func__);
+            mplp_prefetch_stop(pf);
+            exit(EXIT_FAILURE);
+        }
+        ++pf->n_started;
+    }
+    return pf;
+}
+
+static void mplp_prefetch_stop(mplp_prefetch_t *pf)
+{
+    int i, j;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->taken);
+    pthread_mutex_unlock(&pf->lock);
+    for (i = 0; i < pf->n_started; ++i) pthread_join(pf->r[i].tid, NULL);
+    for (i = 0; i < pf->n; ++i) {
+        for (j = 0; j < MPLP_PREFETCH; ++j) {
+            bam_destroy1(pf->q[i].in[j]);
+            bam_destroy1(pf->q[i].out[j]);
+        }
+        free(pf->q[i].in); free(pf->q[i].out);
+    }
+    free(pf->q); free(pf->qp); free(pf->r);
+    pthread_cond_destroy(&pf->taken);
+    pthread_cond_destroy(&pf->added);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf);
+}
+
+static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf, mplp_aux_t **data,
                        int n, char *const*fn, int *n_plp, const bam_pileup1_t **plp, int ignore_rg)
 {
     int i, j;
     memset(m->n_plp, 0, m->n * sizeof(int));
     for (i = 0; i < n; ++i) {
+        mplp_aux_t *ma = data[i];
+        if (ma->m_smid < n_plp[i] * 2) { // keep collisions rare
+            ma->m_smid = n_plp[i] * 2;
+            kroundup32(ma->m_smid);
+            free(ma->smid);
+            ma->smid = calloc(ma->m_smid, sizeof(mplp_smid_t));
+            if (ma->smid == NULL) {
+                fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+                exit(EXIT_FAILURE);
+            }
+        }
         for (j = 0; j < n_plp[i]; ++j) {
             const bam_pileup1_t *p = plp[i] + j;
-            uint8_t *q;
-            int id = -1;
-            q = ignore_rg? NULL : bam_aux_get(p->b, "RG");
-            if (q) id = bam_smpl_rg2smid(sm, fn[i], (char*)q+1, buf);
-            if (id < 0) id = bam_smpl_rg2smid(sm, fn[i], 0, buf);
-            if (id < 0 || id >= m->n) {
-                assert(q); // otherwise a bug
-                fprintf(stderr, "[%s] Read group %s used in file %s but absent from the header or an alignment missing read group.\n", __func__, (char*)q+1, fn[i]);
-                exit(EXIT_FAILURE);
+            mplp_smid_t *c = &ma->smid[p->b->id & (ma->m_smid - 1)];
+            int id = c->smid;
+            if (c->b != p->b || c->id != p->b->id) { // not seen before
+                uint8_t *q = ignore_rg? NULL : bam_aux_get(p->b, "RG");
+                id = -1;
+                if (q) id = bam_smpl_rg2smid(sm, fn[i], (char*)q+1, buf);
+                if (id < 0) id = bam_smpl_rg2smid(sm, fn[i], 0, buf);
+                if (id < 0 || id >= m->n) {
+                    assert(q); // otherwise a bug
+                    fprintf(stderr, "[%s] Read group %s used in file %s but absent from the header or an alignment missing read group.\n", __func__, (char*)q+1, fn[i]);
+                    exit(EXIT_FAILURE);
+                }
+                c->b = p->b; c->id = p->b->id; c->smid = id;
             }
             if (m->n_plp[id] == m->m_plp[id]) {
                 m->m_plp[id] = m->m_plp[id]? m->m_plp[id]<<1 : 8;
@@ -297,6 +604,774 @@ static void group_smpl(mplp_pileup_t *m, bam_sample_t *sm, kstring_t *buf,
     }
 }
 
+/*
+ * What every pileup of the inputs shares: the settings, the header of the
+ * first file and the samples found in all of them.
+ */
+typedef struct {
+    const mplp_conf_t *conf;
+    int n;              // number of files specified in fn
+    char **fn;
+    bam_hdr_t *h;       // header of first file in input list
+    bam_sample_t *sm;
+    void *rghash;
+    bcf_hdr_t *bcf_hdr; // NULL unless calling genotype likelihoods
+    int max_depth, max_indel_depth;
+} mplp_setup_t;
+
+/*
+ * A set of readers with the state needed to pile them up and call from
+ * them.  Pileup text goes to out, and records to bcf_fp or, if that is
+ * NULL, onto rec for the caller to write.
+ */
+typedef struct {
+    const mplp_setup_t *s;
+    mplp_aux_t **data;
+    mplp_ref_t ref;
+    int *n_plp;
+    const bam_pileup1_t **plp;
+    void *bed_cur;      // cursor over conf->bed, on reference bed_tid
+    int bed_tid;
+    int m_keep;
+    const bam_pileup1_t **keep; // the pileup entries passing -Q
+    mplp_pileup_t gplp;
+    kstring_t buf;
+    bcf_callaux_t *bca;
+    bcf_callret1_t *bcr;
+    bcf_call_t bc;
+    bcf1_t *bcf_rec;
+    tsv_out_t *out;
+    htsFile *bcf_fp;
+    int n_rec, m_rec;
+    bcf1_t **rec;
+    int n_span, m_span;
+    mplp_span_t *span;  // the spans of -l read for the current chunk of -@
+} mplp_worker_t;
+
+static void mplp_worker_init(mplp_worker_t *w, const mplp_setup_t *s)
+{
+    mplp_ref_t ref = MPLP_REF_INIT;
+
+    memset(w, 0, sizeof(mplp_worker_t));
+    w->s = s;
+    w->data = calloc(s->n, sizeof(mplp_aux_t*));
+    w->plp = calloc(s->n, sizeof(bam_pileup1_t*));
+    w->n_plp = calloc(s->n, sizeof(int));
+    w->ref = ref;
+    if (s->conf->refs) w->ref.refs = ref_cache_dup(s->conf->refs);
+    w->bed_tid = -1;
+    if (s->conf->bed && (w->bed_cur = bed_cursor_init(s->conf->bed)) == NULL) {
+        fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Opens the i-th input for w, returning its header
+static bam_hdr_t *mplp_open(mplp_worker_t *w, int i)
+{
+    const mplp_conf_t *conf = w->s->conf;
+    const char *fn = w->s->fn[i];
+    mplp_aux_t *ma;
+    bam_hdr_t *h;
+
+    ma = w->data[i] = calloc(1, sizeof(mplp_aux_t));
+    ma->fp = sam_open_format(fn, "rb", &conf->ga.in);
+    if ( !ma->fp )
+    {
+        fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, fn, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (hts_set_opt(ma->fp, CRAM_OPT_DECODE_MD, 0)) {
+        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+        exit(EXIT_FAILURE);
+    }
+    if (conf->fai_fname && hts_set_fai_filename(ma->fp, conf->fai_fname) != 0) {
+        fprintf(stderr, "[%s] failed to process %s: %s\n",
+                __func__, conf->fai_fname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ma->conf = conf;
+    ma->ref = &w->ref;
+    if (conf->n_readers > 0) { // read in another thread, so needs its own
+        mplp_ref_t ref = MPLP_REF_INIT;
+        ma->ref = malloc(sizeof(mplp_ref_t));
+        *ma->ref = ref;
+        if (conf->refs) ma->ref->refs = ref_cache_dup(conf->refs);
+    }
+    ma->bed_tid = -1;
+    if (conf->bed && (ma->bed = bed_cursor_init(conf->bed)) == NULL) {
+        fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+    h = sam_hdr_read(ma->fp);
+    if ( !h ) {
+        fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn);
+        exit(EXIT_FAILURE);
+    }
+    return h;
+}
+
+// Allocates the per-sample state, once all the samples are known
+static void mplp_caller_init(mplp_worker_t *w)
+{
+    const mplp_setup_t *s = w->s;
+    const mplp_conf_t *conf = s->conf;
+    int i, n_smpl = s->sm->n;
+
+    w->gplp.n = n_smpl;
+    w->gplp.n_plp = calloc(n_smpl, sizeof(int));
+    w->gplp.m_plp = calloc(n_smpl, sizeof(int));
+    w->gplp.plp = calloc(n_smpl, sizeof(bam_pileup1_t*));
+    if (s->bcf_hdr == NULL) return;
+
+    // Initialise the calling algorithm
+    w->bca = bcf_call_init(-1., conf->min_baseQ);
+    w->bcr = calloc(n_smpl, sizeof(bcf_callret1_t));
+    w->bca->rghash = s->rghash;
+    w->bca->openQ = conf->openQ, w->bca->extQ = conf->extQ, w->bca->tandemQ = conf->tandemQ;
+    w->bca->min_frac = conf->min_frac;
+    w->bca->min_support = conf->min_support;
+    w->bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
+    w->bca->max_realign = conf->max_realign;
+
+    w->bc.bcf_hdr = s->bcf_hdr;
+    w->bc.n = n_smpl;
+    w->bc.PL = malloc(15 * n_smpl * sizeof(*w->bc.PL));
+    if (conf->fmt_flag)
+    {
+        assert( sizeof(float)==sizeof(int32_t) );
+        w->bc.DP4 = malloc(n_smpl * sizeof(int32_t) * 4);
+        w->bc.fmt_arr = malloc(n_smpl * sizeof(float)); // all fmt_flag fields
+        if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR|B2B_INFO_AD|B2B_INFO_ADF|B2B_INFO_ADR|B2B_FMT_AD|B2B_FMT_ADF|B2B_FMT_ADR) )
+        {
+            // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
+            w->bc.ADR = (int32_t*) malloc((n_smpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+            w->bc.ADF = (int32_t*) malloc((n_smpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+            for (i=0; i<n_smpl; i++)
+            {
+                w->bcr[i].ADR = w->bc.ADR + (i+1)*B2B_MAX_ALLELES;
+                w->bcr[i].ADF = w->bc.ADF + (i+1)*B2B_MAX_ALLELES;
+            }
+        }
+    }
+    w->bcf_rec = bcf_init1();
+}
+
+// Closes the readers and frees w's state
+static void mplp_worker_destroy(mplp_worker_t *w)
+{
+    int i;
+
+    free(w->bc.tmp.s);
+    if (w->bcf_rec) bcf_destroy1(w->bcf_rec);
+    if (w->bca) {
+        bcf_call_destroy(w->bca);
+        free(w->bc.PL);
+        free(w->bc.DP4);
+        free(w->bc.ADR);
+        free(w->bc.ADF);
+        free(w->bc.fmt_arr);
+        free(w->bcr);
+    }
+    for (i = 0; i < w->n_rec; ++i) bcf_destroy1(w->rec[i]);
+    free(w->rec);
+    free(w->buf.s);
+    free(w->keep);
+    free(w->span);
+    for (i = 0; i < w->gplp.n; ++i) free(w->gplp.plp[i]);
+    free(w->gplp.plp); free(w->gplp.n_plp); free(w->gplp.m_plp);
+    if (w->bed_cur) bed_cursor_destroy(w->bed_cur);
+    for (i = 0; i < w->s->n; ++i) {
+        if (w->data[i] == NULL) continue;
+        if (w->data[i]->iter) hts_itr_destroy(w->data[i]->iter);
+        // A CRAM index refers to its handle, so goes first
+        if (w->data[i]->own_idx) hts_idx_destroy(w->data[i]->own_idx);
+        sam_close(w->data[i]->fp);
+        if (w->data[i]->bed) bed_cursor_destroy(w->data[i]->bed);
+        if (w->data[i]->ref != &w->ref) {
+            mplp_ref_destroy(w->data[i]->ref, w->s->h);
+            free(w->data[i]->ref);
+        }
+        kpa_buf_destroy(&w->data[i]->baq);
+        free(w->data[i]->smid);
+        free(w->data[i]);
+    }
+    free(w->data); free(w->plp); free(w->n_plp);
+    mplp_ref_destroy(&w->ref, w->s->h);
+}
+
+// Writes out the record just made, or keeps it if there is no bcf_fp
+static void mplp_put_rec(mplp_worker_t *w)
+{
+    if (w->bcf_fp) {
+        bcf_write1(w->bcf_fp, w->s->bcf_hdr, w->bcf_rec);
+        return;
+    }
+    if (w->n_rec == w->m_rec) {
+        w->m_rec = w->m_rec? w->m_rec<<1 : 256;
+        w->rec = realloc(w->rec, w->m_rec * sizeof(bcf1_t*));
+    }
+    w->rec[w->n_rec++] = w->bcf_rec;
+    w->bcf_rec = bcf_init1();
+}
+
+/*
+ * With --allele-counts, each input has a column of six counts in place of
+ * its bases and qualities: A, C, G and T, deletions across the position,
+ * and insertions after it.  Bases are filtered by -Q as for the depth
+ * column of the pileup text.
+ */
+static void mplp_put_counts(tsv_out_t *out, int n, const int *n_plp, const bam_pileup1_t **plp, int min_baseQ)
+{
+    int i, j, k, cnt[6];
+
+    for (i = 0; i < n; ++i) {
+        memset(cnt, 0, sizeof cnt);
+        for (j = 0; j < n_plp[i]; ++j) {
+            const bam_pileup1_t *p = plp[i] + j;
+            int q = p->qpos < p->b->core.l_qseq? bam_get_qual(p->b)[p->qpos] : 0;
+            if (q < min_baseQ || p->is_refskip) continue;
+            if (p->is_del) ++cnt[4];
+            else if ((k = seq_nt16_int[bam_seqi(bam_get_seq(p->b), p->qpos)]) < 4) ++cnt[k];
+            if (p->indel > 0) ++cnt[5];
+        }
+        tsv_putc(out, '\t');
+        for (k = 0; k < 6; ++k) {
+            if (k) tsv_putc(out, ',');
+            tsv_putw(out, cnt[k]);
+        }
+    }
+}
+
+/* computes the genotype likelihoods of each sample at the current position */
+static int mplp_glfgen(const mplp_pileup_t *gplp, int ref16, bcf_callaux_t *bca, bcf_callret1_t *bcr)
+{
+    int i;
+    for (i = 0; i < gplp->n; ++i) {
+        if (bcf_call_glfgen(gplp->n_plp[i], gplp->plp[i], ref16, bca, bcr + i) < 0) {
+            fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Piles up whatever w's readers return, reporting the positions in
+ * [beg0, end0).  Returns as for bam_mplp_auto(), or -1 if the genotype
+ * likelihoods can't be computed.
+ */
+static int mplp_pileup(mplp_worker_t *w, int beg0, int end0)
+{
+    const mplp_setup_t *s = w->s;
+    const mplp_conf_t *conf = s->conf;
+    int i, tid, pos, ref_len, ref16, n = s->n, *n_plp = w->n_plp, ret;
+    const bam_pileup1_t **plp = w->plp;
+    mplp_pileup_t *gplp = &w->gplp;
+    bcf_callaux_t *bca = w->bca;
+    bcf_callret1_t *bcr = w->bcr;
+    tsv_out_t *out = w->out;
+    bam_mplp_t iter;
+    mplp_prefetch_t *pf = NULL;
+    const char *ref;
+
+    for (i = 0; i < n; ++i) // a new pileup numbers its reads afresh
+        if (w->data[i]->smid) memset(w->data[i]->smid, 0, w->data[i]->m_smid * sizeof(mplp_smid_t));
+    if (conf->n_readers > 0) {
+        pf = mplp_prefetch_start(w->data, n, conf->n_readers);
+        iter = bam_mplp_init(n, mplp_fetch, pf->qp);
+    } else iter = bam_mplp_init(n, mplp_func, (void**)w->data);
+    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(iter);
+    bam_mplp_set_maxcnt(iter, s->max_depth);
+    // begin pileup
+    while ( (ret=bam_mplp_auto(iter, &tid, &pos, n_plp, plp)) > 0) {
+        if (pos < beg0 || pos >= end0) continue; // out of the region requested
+        if (w->bed_cur && tid >= 0) {
+            if (tid != w->bed_tid) bed_cursor_set(w->bed_cur, s->h->target_name[tid]), w->bed_tid = tid;
+            if (!bed_cursor_overlap(w->bed_cur, pos, pos+1)) continue;
+        }
+        mplp_get_ref(&w->ref, s->h, tid, &ref, &ref_len);
+        //printf("tid=%d len=%d ref=%p/%s\n", tid, ref_len, ref, ref);
+        if (conf->flag & MPLP_BCF) {
+            int total_depth, _ref0, ref16;
+            for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
+            group_smpl(gplp, s->sm, &w->buf, w->data, n, s->fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
+            _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
+            ref16 = seq_nt16_table[_ref0];
+            bcf_callaux_clean(bca, &w->bc);
+            if (mplp_glfgen(gplp, ref16, bca, bcr) < 0) { ret = -1; break; }
+            w->bc.tid = tid; w->bc.pos = pos;
+            bcf_call_combine(gplp->n, bcr, bca, ref16, &w->bc);
+            bcf_clear1(w->bcf_rec);
+            bcf_call2bcf(&w->bc, w->bcf_rec, bcr, conf->fmt_flag, 0, 0);
+            mplp_put_rec(w);
+            // call indels; todo: subsampling with total_depth>max_indel_depth instead of ignoring?
+            if (!(conf->flag&MPLP_NO_INDEL) && total_depth < s->max_indel_depth && bcf_call_gap_prep(gplp->n, gplp->n_plp, gplp->plp, pos, bca, ref, s->rghash) >= 0)
+            {
+                bcf_callaux_clean(bca, &w->bc);
+                if (mplp_glfgen(gplp, -1, bca, bcr) < 0) { ret = -1; break; }
+                if (bcf_call_combine(gplp->n, bcr, bca, -1, &w->bc) >= 0) {
+                    bcf_clear1(w->bcf_rec);
+                    bcf_call2bcf(&w->bc, w->bcf_rec, bcr, conf->fmt_flag, bca, ref);
+                    mplp_put_rec(w);
+                }
+            }
+        } else if (conf->flag & MPLP_COUNT) {
+            tsv_puts(out, s->h->target_name[tid]);
+            tsv_putc(out, '\t');
+            tsv_putw(out, pos + 1);
+            tsv_putc(out, '\t');
+            tsv_putc(out, (ref && pos < ref_len)? ref[pos] : 'N');
+            mplp_put_counts(out, n, n_plp, plp, conf->min_baseQ);
+            tsv_putc(out, '\n');
+        } else {
+            tsv_puts(out, s->h->target_name[tid]);
+            tsv_putc(out, '\t');
+            tsv_putw(out, pos + 1);
+            tsv_putc(out, '\t');
+            tsv_putc(out, (ref && pos < ref_len)? ref[pos] : 'N');
+            ref16 = ref? seq_nt16_table[pos < ref_len? (int)ref[pos] : 'N'] : 0;
+            for (i = 0; i < n; ++i) {
+                const bam_pileup1_t **keep;
+                size_t len;
+                char *str;
+                int j, cnt;
+                if (n_plp[i] > w->m_keep) {
+                    w->m_keep = n_plp[i];
+                    kroundup32(w->m_keep);
+                    w->keep = realloc(w->keep, w->m_keep * sizeof(bam_pileup1_t*));
+                }
+                keep = w->keep;
+                for (j = cnt = 0, len = 3; j < n_plp[i]; ++j) {
+                    const bam_pileup1_t *p = plp[i] + j;
+                    int c = p->qpos < p->b->core.l_qseq
+                             ? bam_get_qual(p->b)[p->qpos]
+                             : 0;
+                    if (c >= conf->min_baseQ) {
+                        keep[cnt++] = p;
+                        len += MPLP_SEQ_MAX(p) + 2;
+                    }
+                }
+                tsv_putc(out, '\t');
+                tsv_putw(out, cnt);
+                tsv_putc(out, '\t');
+                if (n_plp[i] == 0) {
+                    tsv_puts(out, "*\t*");
+                    if (conf->flag & MPLP_PRINT_MAPQ) tsv_puts(out, "\t*");
+                    if (conf->flag & MPLP_PRINT_POS) tsv_puts(out, "\t*");
+                    continue;
+                }
+                // Bases, qualities and mapping qualities, then positions
+                str = tsv_out_reserve(out, len);
+                for (j = 0; j < cnt; ++j)
+                    str = pileup_seq(str, keep[j], pos, ref_len, ref, ref16);
+                *str++ = '\t';
+                for (j = 0; j < cnt; ++j)
+                    *str++ = mplp_qual_char(keep[j]->qpos < keep[j]->b->core.l_qseq? bam_get_qual(keep[j]->b)[keep[j]->qpos] : 0);
+                if (conf->flag & MPLP_PRINT_MAPQ) {
+                    *str++ = '\t';
+                    for (j = 0; j < cnt; ++j) *str++ = mplp_qual_char(keep[j]->b->core.qual);
+                }
+                out->l = str - out->buf;
+                if (conf->flag & MPLP_PRINT_POS) {
+                    tsv_putc(out, '\t');
+                    for (j = 0; j < cnt; ++j) {
+                        if (j) tsv_putc(out, ',');
+                        tsv_putw(out, keep[j]->qpos + 1);
+                    }
+                }
+            }
+            tsv_putc(out, '\n');
+        }
+    }
+    bam_mplp_destroy(iter);
+    if (pf) mplp_prefetch_stop(pf);
+    return ret;
+}
+
+/*
+ * With -@, the references (or the -r region) are split into chunks that
+ * are piled up by separate threads, and the output of each chunk is
+ * written in order.  Each thread takes a set of readers and calling state
+ * from a shared pool, opening a new set only if none is free.  A new set
+ * loads its own indices, as a CRAM index can only be used with the handle
+ * it was loaded on.  Chunks are smaller than for depth as the output held
+ * for each is much larger.
+ *
+ * Which reads the pileup drops beyond the -d limit depends on the reads
+ * already in its buffer, and so on how far back it started.  A chunk
+ * therefore starts only at a position where no file is deeper than the
+ * limit from before the first read overlapping it, so that no read there
+ * can be dropped (see mplp_can_split()), and reads from that first read
+ * on.  The reads at each position it reports, around indels as anywhere
+ * else, are then those of the serial pileup.  A chunk with no such
+ * position among the first MPLP_SPLIT_TRIES it looks at is left to the
+ * chunk before.
+ */
+#define MPLP_CHUNK (1 << 16)
+#define MPLP_SPLIT_TRIES 16
+#define MPLP_UNKNOWN (-2)
+
+// The chunk length for n files, which SAMTOOLS_MPILEUP_CHUNK may set so
+// that small test files are split into several chunks
+static int64_t mplp_chunk_size(int n)
+{
+    const char *env = getenv("SAMTOOLS_MPILEUP_CHUNK");
+    char *end;
+    long long size;
+    if (env && *env) {
+        size = strtoll(env, &end, 10);
+        if (*end == '\0' && size > 0) return size;
+    }
+    // Keep the output of a chunk about the same size however many files
+    size = MPLP_CHUNK / n;
+    return size < 4096? 4096 : size;
+}
+
+typedef struct {
+    int tid, beg, end;
+    int i_span, n_span; // the spans of tid to read with -l
+    int start, rbeg;    // where it starts and reads from, or MPLP_UNKNOWN
+    int n_rec;
+    bcf1_t **rec;       // records awaiting writing
+} mplp_chunk_t;
+
+typedef struct {
+    const mplp_setup_t *s;
+    hts_idx_t **idx;        // loaded on the caller's readers
+    int beg0;               // the start of the -r region
+    int n_chunks;
+    mplp_chunk_t *chunk;
+    mplp_span_t *span;
+    tsv_out_t *out;
+    htsFile *bcf_fp;
+    pthread_mutex_t lock;
+    int n_spare;
+    mplp_worker_t **spare;
+} mplp_par_t;
+
+// Pushes v onto the min-heap h[0..n-1]
+static void mplp_heap_push(int *h, int n, int v)
+{
+    int k;
+    while (n > 0 && h[k = (n - 1) / 2] > v) h[n] = h[k], n = k;
+    h[n] = v;
+}
+
+// Removes the least value from the min-heap h[0..n-1]
+static void mplp_heap_pop(int *h, int n)
+{
+    int i = 0, k, v = h[--n];
+    while ((k = 2 * i + 1) < n) {
+        if (k + 1 < n && h[k + 1] < h[k]) ++k;
+        if (v <= h[k]) break;
+        h[i] = h[k]; i = k;
+    }
+    h[i] = v;
+}
+
+// The position of the first read of fp overlapping [beg, end) of tid, end
+// if there is none, or -1 on error
+static int mplp_first_pos(samFile *fp, const hts_idx_t *idx, int tid, int beg, int end, bam1_t *b)
+{
+    hts_itr_t *itr = sam_itr_queryi(idx, tid, beg, end);
+    int pos = end, ret;
+    if (itr == NULL) return -1;
+    if ((ret = sam_itr_next(fp, itr, b)) >= 0) pos = b->core.pos;
+    else if (ret < -1) pos = -1;
+    hts_itr_destroy(itr);
+    return pos;
+}
+
+/*
+ * Whether a chunk may start at pos of tid.  Its first read is the first
+ * one, in any file, ending at pos or after; all reads ending after that
+ * one starts are in the buffer of the serial pileup when it reaches them.
+ * If each file has at most -d reads over every read start from there to
+ * pos, counting every read whatever its flags, neither pileup drops any
+ * of them, and from pos on they hold the same reads.  Sets *rbeg to where
+ * the chunk must read from.  Returns 1 if so, 0 if not and -1 on error.
+ */
+static int mplp_can_split(mplp_par_t *p, mplp_worker_t *w, int tid, int pos, int *rbeg)
+{
+    const mplp_setup_t *s = p->s;
+    bam1_t *b = bam_init1();
+    hts_itr_t *itr;
+    int i, beg, first = pos, ret = 1, r, n_end, m_end = 0, *end = NULL;
+
+    for (i = 0; i < s->n; ++i) {
+        const hts_idx_t *idx = w->data[i]->own_idx? w->data[i]->own_idx : p->idx[i];
+        if ((beg = mplp_first_pos(w->data[i]->fp, idx, tid, pos - 1, pos, b)) < 0) goto fail;
+        if (beg < first) first = beg;
+    }
+    for (i = 0; i < s->n && ret > 0; ++i) {
+        mplp_aux_t *ma = w->data[i];
+        const hts_idx_t *idx = ma->own_idx? ma->own_idx : p->idx[i];
+        // The reads ending before first cannot be dropped if none from
+        // the first ending at first or after are
+        beg = first > 0? mplp_first_pos(ma->fp, idx, tid, first - 1, first, b) : 0;
+        if (beg < 0) goto fail;
+        if ((itr = sam_itr_queryi(idx, tid, beg > 0? beg - 1 : 0, pos + 1)) == NULL) goto fail;
+        n_end = 0;
+        while ((r = sam_itr_next(ma->fp, itr, b)) >= 0) {
+            // the ends of the reads covering this one's start
+            while (n_end && end[0] < b->core.pos) mplp_heap_pop(end, n_end--);
+            if (n_end == m_end) {
+                m_end = m_end? m_end * 2 : 256;
+                end = realloc(end, m_end * sizeof(int));
+            }
+            mplp_heap_push(end, n_end++, bam_endpos(b));
+            if (b->core.pos >= beg && n_end >= s->max_depth) { ret = 0; break; }
+        }
+        hts_itr_destroy(itr);
+        if (r < -1) goto fail;
+    }
+    *rbeg = first > p->beg0? first - 1 : p->beg0;
+    free(end);
+    bam_destroy1(b);
+    return ret;
+
+ fail:
+    free(end);
+    bam_destroy1(b);
+    return -1;
+}
+
+// Finds where chunk i starts and reads from, setting *start to -1 if it
+// is left to the chunk before.  Each chunk is looked at once and the
+// result shared, as the chunk before needs it too.
+static void mplp_chunk_start(mplp_par_t *p, mplp_worker_t *w, int i, int *start, int *rbeg)
+{
+    mplp_chunk_t *c = &p->chunk[i];
+    int64_t pos, step, end = c->end;
+    int ret = 0;
+
+    pthread_mutex_lock(&p->lock);
+    *start = c->start; *rbeg = c->rbeg;
+    pthread_mutex_unlock(&p->lock);
+    if (*start != MPLP_UNKNOWN) return;
+
+    if (end > p->s->h->target_len[c->tid]) end = p->s->h->target_len[c->tid];
+    step = (end - c->beg + MPLP_SPLIT_TRIES - 1) / MPLP_SPLIT_TRIES;
+    if (step < 1) step = 1;
+    for (pos = c->beg; pos < c->end && pos < c->beg + MPLP_SPLIT_TRIES * step; pos += step)
+        if ((ret = mplp_can_split(p, w, c->tid, pos, rbeg)) != 0) break;
+    if (ret < 0) {
+        fprintf(stderr, "[%s] failed to read %s:%d-%d\n", __func__,
+                p->s->h->target_name[c->tid], c->beg + 1, c->end);
+        exit(EXIT_FAILURE);
+    }
+    *start = ret? pos : -1;
+
+    pthread_mutex_lock(&p->lock);
+    c->start = *start; c->rbeg = *rbeg;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Sets w->span to the n spans of span within [beg, end)
+static void mplp_clip_spans(mplp_worker_t *w, const mplp_span_t *span, int n, int beg, int end)
+{
+    int i;
+
+    w->n_span = 0;
+    for (i = 0; i < n; ++i) {
+        if (span[i].end <= beg || span[i].beg >= end) continue;
+        if (w->n_span == w->m_span) {
+            w->m_span = w->m_span? w->m_span * 2 : 16;
+            w->span = realloc(w->span, w->m_span * sizeof(mplp_span_t));
+        }
+        w->span[w->n_span] = span[i];
+        if (span[i].beg < beg) w->span[w->n_span].beg = beg;
+        if (span[i].end > end) w->span[w->n_span].end = end;
+        ++w->n_span;
+    }
+}
+
+static int mplp_chunk(void *data, int i, kstring_t *str)
+{
+    mplp_par_t *p = (mplp_par_t*)data;
+    const mplp_setup_t *s = p->s;
+    mplp_chunk_t *c = &p->chunk[i];
+    mplp_worker_t *w = NULL;
+    tsv_out_t out;
+    int j, beg, end, rbeg, ret = 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->n_spare) w = p->spare[--p->n_spare];
+    pthread_mutex_unlock(&p->lock);
+    if (w == NULL) {
+        w = malloc(sizeof(mplp_worker_t));
+        mplp_worker_init(w, s);
+        for (j = 0; j < s->n; ++j) {
+            bam_hdr_destroy(mplp_open(w, j));
+            w->data[j]->h = s->h;
+            if ((w->data[j]->own_idx = sam_index_load(w->data[j]->fp, s->fn[j])) == NULL) {
+                fprintf(stderr, "[%s] fail to load index for %s\n", __func__, s->fn[j]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        mplp_caller_init(w);
+    }
+
+    // The first chunk of a reference starts where the serial pileup does,
+    // and each runs on to where the next one of its reference starts
+    if (i > 0 && p->chunk[i - 1].tid == c->tid) mplp_chunk_start(p, w, i, &beg, &rbeg);
+    else beg = rbeg = c->beg;
+    end = c->end;
+    for (j = i + 1; beg >= 0 && j < p->n_chunks && p->chunk[j].tid == c->tid; ++j) {
+        int k;
+        mplp_chunk_start(p, w, j, &end, &k);
+        if (end >= 0) break;
+        end = p->chunk[j].end;
+    }
+    if (beg >= 0 && s->conf->bed) {
+        mplp_clip_spans(w, p->span + c->i_span, c->n_span, rbeg, end);
+        if (w->n_span == 0) beg = -1;
+    }
+    if (beg < 0) goto done;
+
+    for (j = 0; j < s->n; ++j) {
+        mplp_aux_t *ma = w->data[j];
+        const hts_idx_t *idx = ma->own_idx? ma->own_idx : p->idx[j];
+        if (s->conf->bed) {
+            if (mplp_set_spans(ma, idx, w->span, w->n_span) < 0)
+                exit(EXIT_FAILURE);
+            continue;
+        }
+        if (ma->iter) hts_itr_destroy(ma->iter);
+        if ((ma->iter = sam_itr_queryi(idx, c->tid, rbeg, end)) == NULL) {
+            fprintf(stderr, "[%s] failed to query %s:%d-%d in %s\n", __func__,
+                    s->h->target_name[c->tid], rbeg + 1, end, s->fn[j]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (s->bcf_hdr == NULL) {
+        tsv_out_init(&out, NULL);
+        w->out = &out;
+    }
+    ret = mplp_pileup(w, beg, end);
+    if (s->bcf_hdr == NULL) {
+        str->s = out.buf; str->l = out.l; str->m = out.m;
+        w->out = NULL;
+    }
+    c->rec = w->rec; c->n_rec = w->n_rec;
+    w->rec = NULL; w->n_rec = w->m_rec = 0;
+
+ done:
+    pthread_mutex_lock(&p->lock);
+    p->spare[p->n_spare++] = w;
+    pthread_mutex_unlock(&p->lock);
+    return ret < 0? 1 : 0;
+}
+
+static int mplp_chunk_write(void *data, int i, kstring_t *str)
+{
+    mplp_par_t *p = (mplp_par_t*)data;
+    mplp_chunk_t *c = &p->chunk[i];
+    int j, ret = 0;
+
+    if (str->l) tsv_putsn(p->out, str->s, str->l);
+    for (j = 0; j < c->n_rec; ++j) {
+        if (bcf_write1(p->bcf_fp, p->s->bcf_hdr, c->rec[j]) < 0) ret = 1;
+        bcf_destroy1(c->rec[j]);
+    }
+    free(c->rec);
+    c->rec = NULL;
+    return ret;
+}
+
+/*
+ * Splits the references, or the region [beg0, end0) of reg_tid, into
+ * chunks.  With -l, chunks without any of its regions are left out, and
+ * the spans of each reference, as the serial pileup reads them, are put
+ * in *span.
+ */
+static mplp_chunk_t *mplp_chunks(const mplp_setup_t *s, int reg_tid, int beg0, int end0,
+                                 int *n_chunks, mplp_span_t **span)
+{
+    const mplp_conf_t *conf = s->conf;
+    mplp_chunk_t *chunk = NULL;
+    void *cur = NULL;
+    int tid, m = 0, n_span = 0, m_span = 0, i_span = 0, k = 0, b, e;
+    int64_t size = mplp_chunk_size(s->n);
+
+    *n_chunks = 0;
+    *span = NULL;
+    if (conf->bed && (cur = bed_cursor_init(conf->bed)) == NULL) {
+        fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+    for (tid = conf->reg? reg_tid : 0; tid < s->h->n_targets; ++tid) {
+        int64_t beg = 0, end = s->h->target_len[tid], next;
+        if (beg < beg0) beg = beg0;
+        if (end > end0) end = end0;
+        if (cur) {
+            if (bed_cursor_set(cur, s->h->target_name[tid]) == 0) goto next_tid;
+            i_span = n_span;
+            k = mplp_add_spans(cur, tid, beg0, end0, span, &n_span, &m_span);
+            if (k == 0) goto next_tid;
+            bed_cursor_set(cur, s->h->target_name[tid]);
+        }
+        for (; beg < end; beg = next) {
+            next = (beg / size + 1) * size;
+            if (next > end) next = end;
+            // Let the last chunk report anything past the end of the
+            // reference, as the serial code would
+            if (next == end) next = end0;
+            if (cur && ((b = bed_cursor_next(cur, beg, &e)) < 0 || b >= next)) continue;
+            if (*n_chunks == m) {
+                m = m? m * 2 : 256;
+                chunk = realloc(chunk, m * sizeof(mplp_chunk_t));
+            }
+            memset(&chunk[*n_chunks], 0, sizeof(mplp_chunk_t));
+            chunk[*n_chunks].tid = tid;
+            chunk[*n_chunks].beg = beg;
+            chunk[*n_chunks].i_span = i_span;
+            chunk[*n_chunks].n_span = k;
+            chunk[*n_chunks].start = MPLP_UNKNOWN;
+            chunk[(*n_chunks)++].end = next;
+        }
+     next_tid:
+        if (conf->reg) break;
+    }
+    if (cur) bed_cursor_destroy(cur);
+    return chunk;
+}
+
+// Runs the pileup on the threads, starting with w's already open readers
+static int mplp_parallel(mplp_worker_t *w, hts_idx_t **idx, int reg_tid, int beg0, int end0,
+                         tsv_out_t *out, htsFile *bcf_fp)
+{
+    mplp_par_t p;
+    int i, ret, n_chunks, n_threads = w->s->conf->n_threads + 1;
+
+    memset(&p, 0, sizeof p);
+    p.s = w->s;
+    p.idx = idx;
+    p.beg0 = beg0;
+    p.out = out;
+    p.bcf_fp = bcf_fp;
+    p.chunk = mplp_chunks(w->s, reg_tid, beg0, end0, &n_chunks, &p.span);
+    p.n_chunks = n_chunks;
+    p.spare = calloc(n_threads, sizeof(mplp_worker_t*));
+    p.spare[p.n_spare++] = w;
+    pthread_mutex_init(&p.lock, NULL);
+
+    ret = sweep_run_ordered(n_chunks, n_threads, mplp_chunk, mplp_chunk_write, &p);
+
+    for (i = 0; i < p.n_spare; ++i) {
+        if (p.spare[i] == w) continue;
+        mplp_worker_destroy(p.spare[i]);
+        free(p.spare[i]);
+    }
+    free(p.spare);
+    free(p.chunk);
+    free(p.span);
+    pthread_mutex_destroy(&p.lock);
+    return ret? -1 : 0;
+}
+
 /*
  * Performs pileup
  * @param conf configuration for this pileup
@@ -307,105 +1382,74 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 {
     extern void *bcf_call_add_rg(void *rghash, const char *hdtext, const char *list);
     extern void bcf_call_del_rghash(void *rghash);
-    mplp_aux_t **data;
-    int i, tid, pos, *n_plp, beg0 = 0, end0 = INT_MAX, ref_len, max_depth, max_indel_depth;
-    const bam_pileup1_t **plp;
-    mplp_ref_t mp_ref = MPLP_REF_INIT;
-    bam_mplp_t iter;
-    bam_hdr_t *h = NULL; /* header of first file in input list */
-    char *ref;
-    void *rghash = NULL;
+    mplp_setup_t s;
+    mplp_worker_t w;
+    hts_idx_t **idx = NULL;
+    mplp_span_t *span = NULL;
+    int i, beg0 = 0, end0 = INT_MAX, reg_tid = -1, ret;
     FILE *pileup_fp = NULL;
-
-    bcf_callaux_t *bca = NULL;
-    bcf_callret1_t *bcr = NULL;
-    bcf_call_t bc;
+    tsv_out_t pileup_out;
     htsFile *bcf_fp = NULL;
-    bcf_hdr_t *bcf_hdr = NULL;
-
-    bam_sample_t *sm = NULL;
-    kstring_t buf;
-    mplp_pileup_t gplp;
-
-    memset(&gplp, 0, sizeof(mplp_pileup_t));
-    memset(&buf, 0, sizeof(kstring_t));
-    memset(&bc, 0, sizeof(bcf_call_t));
-    data = calloc(n, sizeof(mplp_aux_t*));
-    plp = calloc(n, sizeof(bam_pileup1_t*));
-    n_plp = calloc(n, sizeof(int));
-    sm = bam_smpl_init();
 
     if (n == 0) {
         fprintf(stderr,"[%s] no input file/data given\n", __func__);
         exit(EXIT_FAILURE);
     }
 
+    memset(&s, 0, sizeof(mplp_setup_t));
+    s.conf = conf;
+    s.n = n;
+    s.fn = fn;
+    s.sm = bam_smpl_init();
+    mplp_worker_init(&w, &s);
+    if (conf->n_threads > 0 || conf->bed) idx = calloc(n, sizeof(hts_idx_t*));
+
     // read the header of each file in the list and initialize data
     for (i = 0; i < n; ++i) {
-        bam_hdr_t *h_tmp;
-        data[i] = calloc(1, sizeof(mplp_aux_t));
-        data[i]->fp = sam_open_format(fn[i], "rb", &conf->ga.in);
-        if ( !data[i]->fp )
-        {
-            fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, fn[i], strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        if (hts_set_opt(data[i]->fp, CRAM_OPT_DECODE_MD, 0)) {
-            fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
-            exit(EXIT_FAILURE);
-        }
-        if (conf->fai_fname && hts_set_fai_filename(data[i]->fp, conf->fai_fname) != 0) {
-            fprintf(stderr, "[%s] failed to process %s: %s\n",
-                    __func__, conf->fai_fname, strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        data[i]->conf = conf;
-        data[i]->ref = &mp_ref;
-        h_tmp = sam_hdr_read(data[i]->fp);
-        if ( !h_tmp ) {
-            fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, fn[i]);
-            exit(EXIT_FAILURE);
-        }
-        bam_smpl_add(sm, fn[i], (conf->flag&MPLP_IGNORE_RG)? 0 : h_tmp->text);
+        bam_hdr_t *h_tmp = mplp_open(&w, i);
+        bam_smpl_add(s.sm, fn[i], (conf->flag&MPLP_IGNORE_RG)? 0 : h_tmp->text);
         // Collect read group IDs with PL (platform) listed in pl_list (note: fragile, strstr search)
-        rghash = bcf_call_add_rg(rghash, h_tmp->text, conf->pl_list);
-        if (conf->reg) {
-            hts_idx_t *idx = sam_index_load(data[i]->fp, fn[i]);
-            if (idx == NULL) {
+        s.rghash = bcf_call_add_rg(s.rghash, h_tmp->text, conf->pl_list);
+        if (conf->reg || idx) {
+            hts_idx_t *fidx = sam_index_load(w.data[i]->fp, fn[i]);
+            if (fidx == NULL && !conf->reg && conf->n_threads == 0) {
+                // Not needed, but -l reads every file whole without them
+                int j;
+                for (j = 0; j < i; ++j) hts_idx_destroy(idx[j]);
+                free(idx);
+                idx = NULL;
+            } else if (fidx == NULL) {
                 fprintf(stderr, "[%s] fail to load index for %s\n", __func__, fn[i]);
                 exit(EXIT_FAILURE);
             }
-            if ( (data[i]->iter=sam_itr_querys(idx, h_tmp, conf->reg)) == 0) {
+            if (conf->reg && (w.data[i]->iter=sam_itr_querys(fidx, h_tmp, conf->reg)) == 0) {
                 fprintf(stderr, "[E::%s] fail to parse region '%s' with %s\n", __func__, conf->reg, fn[i]);
                 exit(EXIT_FAILURE);
             }
-            if (i == 0) beg0 = data[i]->iter->beg, end0 = data[i]->iter->end;
-            hts_idx_destroy(idx);
+            if (conf->reg && i == 0) {
+                reg_tid = w.data[i]->iter->tid;
+                beg0 = w.data[i]->iter->beg, end0 = w.data[i]->iter->end;
+            }
+            if (idx) idx[i] = fidx;
+            else hts_idx_destroy(fidx);
         }
-        else
-            data[i]->iter = NULL;
 
-        if (i == 0) h = data[i]->h = h_tmp; // save the header of the first file
+        if (i == 0) s.h = h_tmp; // save the header of the first file
         else {
             // FIXME: check consistency between h and h_tmp
             bam_hdr_destroy(h_tmp);
-
-            // we store only the first file's header; it's (alleged to be)
-            // compatible with the i-th file's target_name lookup needs
-            data[i]->h = h;
         }
+        // we store only the first file's header; it's (alleged to be)
+        // compatible with the i-th file's target_name lookup needs
+        w.data[i]->h = s.h;
     }
-    // allocate data storage proportionate to number of samples being studied sm->n
-    gplp.n = sm->n;
-    gplp.n_plp = calloc(sm->n, sizeof(int));
-    gplp.m_plp = calloc(sm->n, sizeof(int));
-    gplp.plp = calloc(sm->n, sizeof(bam_pileup1_t*));
 
-    fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, sm->n, n);
+    fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, s.sm->n, n);
     // write the VCF header
     if (conf->flag & MPLP_BCF)
     {
         const char *mode;
+        bcf_hdr_t *bcf_hdr;
         if ( conf->flag & MPLP_VCF )
             mode = (conf->flag&MPLP_NO_COMP)? "wu" : "wz";   // uncompressed VCF or compressed VCF
         else
@@ -418,7 +1462,7 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         }
 
         // BCF header creation
-        bcf_hdr = bcf_hdr_init("w");
+        bcf_hdr = s.bcf_hdr = bcf_hdr_init("w");
         kstring_t str = {0,0,NULL};
 
         ksprintf(&str, "##samtoolsVersion=%s+htslib-%s\n",samtools_version(),hts_version());
@@ -439,10 +1483,10 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
 
         // Translate BAM @SQ tags to BCF ##contig tags
         // todo: use/write new BAM header manipulation routines, fill also UR, M5
-        for (i=0; i<h->n_targets; i++)
+        for (i=0; i<s.h->n_targets; i++)
         {
             str.l = 0;
-            ksprintf(&str, "##contig=<ID=%s,length=%d>", h->target_name[i], h->target_len[i]);
+            ksprintf(&str, "##contig=<ID=%s,length=%d>", s.h->target_name[i], s.h->target_len[i]);
             bcf_hdr_append(bcf_hdr, str.s);
         }
         free(str.s);
@@ -492,41 +1536,11 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
         if ( conf->fmt_flag&B2B_INFO_ADR )
             bcf_hdr_append(bcf_hdr,"##INFO=<ID=ADR,Number=R,Type=Integer,Description=\"Total allelic depths on the reverse strand\">");
 
-        for (i=0; i<sm->n; i++)
-            bcf_hdr_add_sample(bcf_hdr, sm->smpl[i]);
+        for (i=0; i<s.sm->n; i++)
+            bcf_hdr_add_sample(bcf_hdr, s.sm->smpl[i]);
         bcf_hdr_add_sample(bcf_hdr, NULL);
         bcf_hdr_write(bcf_fp, bcf_hdr);
         // End of BCF header creation
-
-        // Initialise the calling algorithm
-        bca = bcf_call_init(-1., conf->min_baseQ);
-        bcr = calloc(sm->n, sizeof(bcf_callret1_t));
-        bca->rghash = rghash;
-        bca->openQ = conf->openQ, bca->extQ = conf->extQ, bca->tandemQ = conf->tandemQ;
-        bca->min_frac = conf->min_frac;
-        bca->min_support = conf->min_support;
-        bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
-
-        bc.bcf_hdr = bcf_hdr;
-        bc.n = sm->n;
-        bc.PL = malloc(15 * sm->n * sizeof(*bc.PL));
-        if (conf->fmt_flag)
-        {
-            assert( sizeof(float)==sizeof(int32_t) );
-            bc.DP4 = malloc(sm->n * sizeof(int32_t) * 4);
-            bc.fmt_arr = malloc(sm->n * sizeof(float)); // all fmt_flag fields
-            if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR|B2B_INFO_AD|B2B_INFO_ADF|B2B_INFO_ADR|B2B_FMT_AD|B2B_FMT_ADF|B2B_FMT_ADR) )
-            {
-                // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
-                bc.ADR = (int32_t*) malloc((sm->n+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-                bc.ADF = (int32_t*) malloc((sm->n+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-                for (i=0; i<sm->n; i++)
-                {
-                    bcr[i].ADR = bc.ADR + (i+1)*B2B_MAX_ALLELES;
-                    bcr[i].ADF = bc.ADF + (i+1)*B2B_MAX_ALLELES;
-                }
-            }
-        }
     }
     else {
         pileup_fp = conf->output_fname? fopen(conf->output_fname, "w") : stdout;
@@ -535,149 +1549,61 @@ static int mpileup(mplp_conf_t *conf, int n, char **fn)
             fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname, strerror(errno));
             exit(EXIT_FAILURE);
         }
+        tsv_out_init(&pileup_out, pileup_fp);
     }
 
-    // init pileup
-    iter = bam_mplp_init(n, mplp_func, (void**)data);
-    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(iter);
-    max_depth = conf->max_depth;
-    if (max_depth * sm->n > 1<<20)
+    s.max_depth = conf->max_depth;
+    if (s.max_depth * s.sm->n > 1<<20)
         fprintf(stderr, "(%s) Max depth is above 1M. Potential memory hog!\n", __func__);
-    if (max_depth * sm->n < 8000) {
-        max_depth = 8000 / sm->n;
-        fprintf(stderr, "<%s> Set max per-file depth to %d\n", __func__, max_depth);
+    if (s.max_depth * s.sm->n < 8000) {
+        s.max_depth = 8000 / s.sm->n;
+        fprintf(stderr, "<%s> Set max per-file depth to %d\n", __func__, s.max_depth);
     }
-    max_indel_depth = conf->max_indel_depth * sm->n;
-    bam_mplp_set_maxcnt(iter, max_depth);
-    bcf1_t *bcf_rec = bcf_init1();
-    int ret;
-    // begin pileup
-    while ( (ret=bam_mplp_auto(iter, &tid, &pos, n_plp, plp)) > 0) {
-        if (conf->reg && (pos < beg0 || pos >= end0)) continue; // out of the region requested
-        if (conf->bed && tid >= 0 && !bed_overlap(conf->bed, h->target_name[tid], pos, pos+1)) continue;
-        mplp_get_ref(data[0], tid, &ref, &ref_len);
-        //printf("tid=%d len=%d ref=%p/%s\n", tid, ref_len, ref, ref);
-        if (conf->flag & MPLP_BCF) {
-            int total_depth, _ref0, ref16;
-            for (i = total_depth = 0; i < n; ++i) total_depth += n_plp[i];
-            group_smpl(&gplp, sm, &buf, n, fn, n_plp, plp, conf->flag & MPLP_IGNORE_RG);
-            _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
-            ref16 = seq_nt16_table[_ref0];
-            bcf_callaux_clean(bca, &bc);
-            for (i = 0; i < gplp.n; ++i)
-                bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], ref16, bca, bcr + i);
-            bc.tid = tid; bc.pos = pos;
-            bcf_call_combine(gplp.n, bcr, bca, ref16, &bc);
-            bcf_clear1(bcf_rec);
-            bcf_call2bcf(&bc, bcf_rec, bcr, conf->fmt_flag, 0, 0);
-            bcf_write1(bcf_fp, bcf_hdr, bcf_rec);
-            // call indels; todo: subsampling with total_depth>max_indel_depth instead of ignoring?
-            if (!(conf->flag&MPLP_NO_INDEL) && total_depth < max_indel_depth && bcf_call_gap_prep(gplp.n, gplp.n_plp, gplp.plp, pos, bca, ref, rghash) >= 0)
-            {
-                bcf_callaux_clean(bca, &bc);
-                for (i = 0; i < gplp.n; ++i)
-                    bcf_call_glfgen(gplp.n_plp[i], gplp.plp[i], -1, bca, bcr + i);
-                if (bcf_call_combine(gplp.n, bcr, bca, -1, &bc) >= 0) {
-                    bcf_clear1(bcf_rec);
-                    bcf_call2bcf(&bc, bcf_rec, bcr, conf->fmt_flag, bca, ref);
-                    bcf_write1(bcf_fp, bcf_hdr, bcf_rec);
-                }
+    s.max_indel_depth = conf->max_indel_depth * s.sm->n;
+    mplp_caller_init(&w);
+
+    if (conf->n_threads > 0) {
+        ret = mplp_parallel(&w, idx, reg_tid, beg0, end0, &pileup_out, bcf_fp);
+    } else {
+        if (conf->bed && idx) { // jump between the regions of -l
+            int tid, n_span = 0, m_span = 0;
+            void *cur = bed_cursor_init(conf->bed);
+            if (cur == NULL) {
+                fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+                exit(EXIT_FAILURE);
             }
-        } else {
-            fprintf(pileup_fp, "%s\t%d\t%c", h->target_name[tid], pos + 1, (ref && pos < ref_len)? ref[pos] : 'N');
-            for (i = 0; i < n; ++i) {
-                int j, cnt;
-                for (j = cnt = 0; j < n_plp[i]; ++j) {
-                    const bam_pileup1_t *p = plp[i] + j;
-                    int c = p->qpos < p->b->core.l_qseq
-                             ? bam_get_qual(p->b)[p->qpos]
-                             : 0;
-                    if (c >= conf->min_baseQ) ++cnt;
-                }
-                fprintf(pileup_fp, "\t%d\t", cnt);
-                if (n_plp[i] == 0) {
-                    fputs("*\t*", pileup_fp);
-                    if (conf->flag & MPLP_PRINT_MAPQ) fputs("\t*", pileup_fp);
-                    if (conf->flag & MPLP_PRINT_POS) fputs("\t*", pileup_fp);
-                } else {
-                    for (j = 0; j < n_plp[i]; ++j) {
-                        const bam_pileup1_t *p = plp[i] + j;
-                        int c = p->qpos < p->b->core.l_qseq
-                            ? bam_get_qual(p->b)[p->qpos]
-                            : 0;
-                        if (c >= conf->min_baseQ)
-                            pileup_seq(pileup_fp, plp[i] + j, pos, ref_len, ref);
-                    }
-                    putc('\t', pileup_fp);
-                    for (j = 0; j < n_plp[i]; ++j) {
-                        const bam_pileup1_t *p = plp[i] + j;
-                        int c = p->qpos < p->b->core.l_qseq
-                            ? bam_get_qual(p->b)[p->qpos]
-                            : 0;
-                        if (c >= conf->min_baseQ) {
-                            c = c + 33 < 126? c + 33 : 126;
-                            putc(c, pileup_fp);
-                        }
-                    }
-                    if (conf->flag & MPLP_PRINT_MAPQ) {
-                        putc('\t', pileup_fp);
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            const bam_pileup1_t *p = plp[i] + j;
-                            int c = bam_get_qual(p->b)[p->qpos];
-                            if ( c < conf->min_baseQ ) continue;
-                            c = plp[i][j].b->core.qual + 33;
-                            if (c > 126) c = 126;
-                            putc(c, pileup_fp);
-                        }
-                    }
-                    if (conf->flag & MPLP_PRINT_POS) {
-                        putc('\t', pileup_fp);
-                        int last = 0;
-                        for (j = 0; j < n_plp[i]; ++j) {
-                            const bam_pileup1_t *p = plp[i] + j;
-                            int c = bam_get_qual(p->b)[p->qpos];
-                            if ( c < conf->min_baseQ ) continue;
-
-                            if (last++) putc(',', pileup_fp);
-                            fprintf(pileup_fp, "%d", plp[i][j].qpos + 1); // FIXME: printf() is very slow...
-                        }
-                    }
-                }
+            for (tid = conf->reg? reg_tid : 0; tid < s.h->n_targets; ++tid) {
+                if (bed_cursor_set(cur, s.h->target_name[tid]))
+                    mplp_add_spans(cur, tid, beg0, end0, &span, &n_span, &m_span);
+                if (conf->reg) break;
             }
-            putc('\n', pileup_fp);
+            bed_cursor_destroy(cur);
+            for (i = 0; i < n; ++i)
+                if (mplp_set_spans(w.data[i], idx[i], span, n_span) < 0) exit(EXIT_FAILURE);
         }
+        w.out = &pileup_out;
+        w.bcf_fp = bcf_fp;
+        ret = mplp_pileup(&w, beg0, end0);
     }
 
-    // clean up
-    free(bc.tmp.s);
-    bcf_destroy1(bcf_rec);
+    // clean up, freeing the indices before the handles they were loaded on
+    if (idx) {
+        for (i = 0; i < n; ++i) hts_idx_destroy(idx[i]);
+        free(idx);
+    }
+    mplp_worker_destroy(&w);
     if (bcf_fp)
     {
         hts_close(bcf_fp);
-        bcf_hdr_destroy(bcf_hdr);
-        bcf_call_destroy(bca);
-        free(bc.PL);
-        free(bc.DP4);
-        free(bc.ADR);
-        free(bc.ADF);
-        free(bc.fmt_arr);
-        free(bcr);
+        bcf_hdr_destroy(s.bcf_hdr);
     }
+    if (pileup_fp && tsv_out_destroy(&pileup_out) < 0)
+        fprintf(stderr, "[%s] failed to write to %s: %s\n", __func__, conf->output_fname? conf->output_fname : "standard output", strerror(errno));
     if (pileup_fp && conf->output_fname) fclose(pileup_fp);
-    bam_smpl_destroy(sm); free(buf.s);
-    for (i = 0; i < gplp.n; ++i) free(gplp.plp[i]);
-    free(gplp.plp); free(gplp.n_plp); free(gplp.m_plp);
-    bcf_call_del_rghash(rghash);
-    bam_mplp_destroy(iter);
-    bam_hdr_destroy(h);
-    for (i = 0; i < n; ++i) {
-        sam_close(data[i]->fp);
-        if (data[i]->iter) hts_itr_destroy(data[i]->iter);
-        free(data[i]);
-    }
-    free(data); free(plp); free(n_plp);
-    free(mp_ref.ref[0]);
-    free(mp_ref.ref[1]);
+    bam_smpl_destroy(s.sm);
+    bcf_call_del_rghash(s.rghash);
+    bam_hdr_destroy(s.h);
+    free(span);
     return ret;
 }
 
@@ -805,6 +1731,9 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "                                            [%s]\n", tmp_filter);
     fprintf(fp,
 "  -x, --ignore-overlaps   disable read-pair overlap detection\n"
+"  -@, --threads INT       additional threads, each piling up a region [0]\n"
+"      --read-threads INT  threads reading the input files ahead of each\n"
+"                          pileup [0]\n"
 "\n"
 "Output options:\n"
 "  -o, --output FILE       write output to FILE [standard output]\n"
@@ -814,6 +1743,8 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "Output options for mpileup format (without -g/-v):\n"
 "  -O, --output-BP         output base positions on reads\n"
 "  -s, --output-MQ         output mapping quality\n"
+"      --allele-counts     output counts of A,C,G,T,deletions,insertions in\n"
+"                          place of bases and qualities; no BAQ unless -E\n"
 "\n"
 "Output options for genotype likelihoods (when -g/-v is used):\n"
 "  -t, --output-tags LIST  optional tags to output:\n"
@@ -830,6 +1761,9 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -I, --skip-indels       do not perform indel calling\n"
 "  -L, --max-idepth INT    maximum per-file depth for INDEL calling [%d]\n", mplp->max_indel_depth);
     fprintf(fp,
+"      --max-realign INT   realign at most INT reads of each indel type,\n"
+"                          evenly subsampled; 0 for all [%d]\n", mplp->max_realign);
+    fprintf(fp,
 "  -m, --min-ireads INT    minimum number gapped reads for indel candidates [%d]\n", mplp->min_support);
     fprintf(fp,
 "  -o, --open-prob INT     Phred-scaled gap open seq error probability [%d]\n", mplp->openQ);
@@ -914,9 +1848,13 @@ int bam_mpileup(int argc, char *argv[])
         {"per-sample-mF", no_argument, NULL, 'p'},
         {"per-sample-mf", no_argument, NULL, 'p'},
         {"platforms", required_argument, NULL, 'P'},
+        {"threads", required_argument, NULL, '@'},
+        {"read-threads", required_argument, NULL, 5},
+        {"allele-counts", no_argument, NULL, 6},
+        {"max-realign", required_argument, NULL, 7},
         {NULL, 0, NULL, 0}
     };
-    while ((c = getopt_long(argc, argv, "Agf:r:l:q:Q:uRC:BDSd:L:b:P:po:e:h:Im:F:EG:6OsVvxt:",lopts,NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "Agf:r:l:q:Q:uRC:BDSd:L:b:P:po:e:h:Im:F:EG:6OsVvxt:@:",lopts,NULL)) >= 0) {
         switch (c) {
         case 'x': mplp.flag &= ~MPLP_SMART_OVERLAPS; break;
         case  1 :
@@ -929,17 +1867,18 @@ int bam_mpileup(int argc, char *argv[])
             break;
         case  3 : mplp.output_fname = optarg; break;
         case  4 : mplp.openQ = atoi(optarg); break;
+        case  5 : mplp.n_readers = atoi(optarg); break;
+        case  6 : mplp.flag |= MPLP_COUNT; break;
+        case  7 : mplp.max_realign = atoi(optarg); break;
         case 'f':
-            mplp.fai = fai_load(optarg);
-            if (mplp.fai == NULL) return 1;
+            mplp.refs = ref_cache_open(optarg);
+            if (mplp.refs == NULL) return 1;
             mplp.fai_fname = optarg;
             break;
         case 'd': mplp.max_depth = atoi(optarg); break;
         case 'r': mplp.reg = strdup(optarg); break;
         case 'l':
-                  // In the original version the whole BAM was streamed which is inefficient
-                  //  with few BED intervals and big BAMs. Todo: devise a heuristic to determine
-                  //  best strategy, that is streaming or jumping.
+                  // Indexed inputs are read only around the regions, see MPLP_JUMP_GAP
                   mplp.bed = bed_read(optarg);
                   if (!mplp.bed) { print_error_errno("mpileup", "Could not read file \"%s\"", optarg); return 1; }
                   break;
@@ -988,6 +1927,7 @@ int bam_mpileup(int argc, char *argv[])
             }
             break;
         case 't': mplp.fmt_flag |= parse_format_flag(optarg); break;
+        case '@': mplp.n_threads = atoi(optarg); break;
         default:
             if (parse_sam_global_opt(c, optarg, lopts, &mplp.ga) == 0) break;
             /* else fall-through */
@@ -996,10 +1936,10 @@ int bam_mpileup(int argc, char *argv[])
             return 1;
         }
     }
-    if (!mplp.fai && mplp.ga.reference) {
+    if (!mplp.refs && mplp.ga.reference) {
         mplp.fai_fname = mplp.ga.reference;
-        mplp.fai = fai_load(mplp.fai_fname);
-        if (mplp.fai == NULL) return 1;
+        mplp.refs = ref_cache_open(mplp.fai_fname);
+        if (mplp.refs == NULL) return 1;
     }
 
     if ( !(mplp.flag&MPLP_REALN) && mplp.flag&MPLP_REDO_BAQ )
@@ -1007,6 +1947,14 @@ int bam_mpileup(int argc, char *argv[])
         fprintf(stderr,"Error: The -B option cannot be combined with -E\n");
         return 1;
     }
+    if (mplp.flag & MPLP_COUNT) {
+        if (mplp.flag & MPLP_BCF) {
+            fprintf(stderr,"Error: The --allele-counts option cannot be combined with -g or -v\n");
+            return 1;
+        }
+        // Only the bases are counted, so BAQ is worth its cost only if asked for
+        if (!(mplp.flag & MPLP_REDO_BAQ)) mplp.flag &= ~MPLP_REALN;
+    }
     if (use_orphan) mplp.flag &= ~MPLP_NO_ORPHAN;
     if (argc == 1)
     {
@@ -1024,7 +1972,7 @@ int bam_mpileup(int argc, char *argv[])
         ret = mpileup(&mplp, argc - optind, argv + optind);
     if (mplp.rghash) khash_str2int_destroy_free(mplp.rghash);
     free(mplp.reg); free(mplp.pl_list);
-    if (mplp.fai) fai_destroy(mplp.fai);
+    ref_cache_close(mplp.refs);
     if (mplp.bed) bed_destroy(mplp.bed);
     return ret;
 }
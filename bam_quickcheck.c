@@ -30,6 +30,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+
+#include "bam_sweep.h"
+#include "bam_scan.h"
 
 static void usage_quickcheck(FILE *write_to)
 {
@@ -37,6 +41,13 @@ static void usage_quickcheck(FILE *write_to)
 "Usage: samtools quickcheck [options] <input> [...]\n"
 "Options:\n"
 "  -v              verbose output (repeat for more verbosity)\n"
+"  -b FILE         list of input files, one per line\n"
+"  -O FORMAT       report every file, in tsv or json format\n"
+"  --deep          also verify the checksum of every BGZF block or CRAM block,\n"
+"                  without decoding any records\n"
+"  -@, --threads INT\n"
+"                  number of additional threads, to check several files at once\n"
+"                  or to verify a single file in parallel with --deep [0]\n"
 "\n"
 "Notes:\n"
 "\n"
@@ -56,18 +67,148 @@ static void usage_quickcheck(FILE *write_to)
     );
 }
 
+// Descriptions of the file_state bits
+static const char *quickcheck_problem[] = {
+    NULL, "unreadable", "not_sequence_data", "no_targets", "missing_eof", "close_failed",
+    "corrupt"
+};
+
+typedef struct {
+    char **fn;
+    int verbose, format;
+    int deep, deep_threads;
+} quickcheck_sweep_t;
+
+static int quickcheck_file(void *data, int i, kstring_t *out)
+{
+    quickcheck_sweep_t *qs = (quickcheck_sweep_t*)data;
+    int verbose = qs->verbose;
+    char* fn = qs->fn[i];
+    int file_state = 0, bit, n;
+
+    if (verbose >= 3) fprintf(stderr, "checking %s\n", fn);
+
+    // attempt to open
+    htsFile *hts_fp = hts_open(fn, "r");
+    if (hts_fp == NULL) {
+        if (verbose >= 2) fprintf(stderr, "%s could not be opened for reading\n", fn);
+        file_state |= 2;
+    }
+    else {
+        if (verbose >= 3) fprintf(stderr, "opened %s\n", fn);
+        // make sure we have sequence data
+        const htsFormat *fmt = hts_get_format(hts_fp);
+        if (fmt->category != sequence_data ) {
+            if (verbose >= 2) fprintf(stderr, "%s was not identified as sequence data\n", fn);
+            file_state |= 4;
+        }
+        else {
+            if (verbose >= 3) fprintf(stderr, "%s is sequence data\n", fn);
+            // check header
+            bam_hdr_t *header = sam_hdr_read(hts_fp);
+            if (header == NULL || header->n_targets <= 0) {
+                if (verbose >= 2) fprintf(stderr, "%s had no targets in header\n", fn);
+                file_state |= 8;
+            }
+            else {
+                if (verbose >= 3) fprintf(stderr, "%s has %d targets in header\n", fn, header->n_targets);
+            }
+            if (header) bam_hdr_destroy(header);
+
+            // only check EOF on BAM for now
+            // TODO implement and use hts_check_EOF() to include CRAM support
+            if (fmt->format == bam) {
+                if (bgzf_check_EOF(hts_fp->fp.bgzf) <= 0) {
+                    if (verbose >= 2) fprintf(stderr, "%s was missing EOF block\n", fn);
+                    file_state |= 16;
+                }
+                else {
+                    if (verbose >= 3) fprintf(stderr, "%s has good EOF block\n", fn);
+                }
+            }
+        }
+
+        if (hts_close(hts_fp) < 0) {
+            file_state |= 32;
+            if (verbose >= 2) fprintf(stderr, "%s did not close cleanly\n", fn);
+        }
+
+        if (qs->deep && !(file_state & 4)) {
+            kstring_t msg = { 0, 0, NULL };
+            int r = bam_scan_verify(fn, qs->deep_threads, &msg);
+            if (r < 0) {
+                if (verbose >= 2) fprintf(stderr, "%s could not be read for the deep check\n", fn);
+                file_state |= 2;
+            }
+            else if (r > 0) {
+                if (verbose >= 2) fprintf(stderr, "%s failed deep check: %s\n", fn, msg.s);
+                file_state |= 64;
+            }
+            else {
+                if (verbose >= 3) fprintf(stderr, "%s passed deep check\n", fn);
+            }
+            free(msg.s);
+        }
+    }
+
+    switch (qs->format) {
+    case SWEEP_TSV:
+        ksprintf(out, "%s\t%d\t", fn, file_state);
+        for (bit = 1, n = 0; bit < sizeof(quickcheck_problem) / sizeof(quickcheck_problem[0]); ++bit)
+            if (file_state & (1 << bit)) ksprintf(out, "%s%s", n++? "," : "", quickcheck_problem[bit]);
+        kputs(n? "\n" : "ok\n", out);
+        break;
+    case SWEEP_JSON:
+        kputs("{\"file\":", out);
+        kputs_json(fn, out);
+        ksprintf(out, ",\"ok\":%s,\"state\":%d,\"problems\":[", file_state? "false" : "true", file_state);
+        for (bit = 1, n = 0; bit < sizeof(quickcheck_problem) / sizeof(quickcheck_problem[0]); ++bit)
+            if (file_state & (1 << bit)) ksprintf(out, "%s\"%s\"", n++? "," : "", quickcheck_problem[bit]);
+        kputs("]}\n", out);
+        break;
+    default:
+        if (file_state > 0 && verbose >= 1) ksprintf(out, "%s\n", fn);
+        break;
+    }
+    return file_state;
+}
+
 int main_quickcheck(int argc, char** argv)
 {
-    int verbose = 0;
+    quickcheck_sweep_t qs;
+    char *fofn = NULL;
+    int verbose = 0, n_threads = 0, n_files;
     hts_verbose = 0;
 
-    const char* optstring = "v";
+    static const struct option lopts[] = {
+        {"threads", required_argument, NULL, '@'},
+        {"output-fmt", required_argument, NULL, 'O'},
+        {"deep", no_argument, NULL, 1},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char* optstring = "vb:O:@:";
     int opt;
-    while ((opt = getopt(argc, argv, optstring)) != -1) {
+    qs.format = SWEEP_TEXT;
+    qs.deep = 0;
+    while ((opt = getopt_long(argc, argv, optstring, lopts, NULL)) != -1) {
         switch (opt) {
         case 'v':
             verbose++;
             break;
+        case 'b':
+            fofn = optarg;
+            break;
+        case 1:
+            qs.deep = 1;
+            break;
+        case '@':
+            n_threads = atoi(optarg);
+            break;
+        case 'O':
+            if ((qs.format = sweep_parse_format(optarg)) >= 0) break;
+            fprintf(stderr, "unknown output format \"%s\"\n", optarg);
+            /* else fall-through */
         default:
             usage_quickcheck(stderr);
             return 1;
@@ -77,7 +218,7 @@ int main_quickcheck(int argc, char** argv)
     argc -= optind;
     argv += optind;
 
-    if (argc < 1) {
+    if (argc < 1 && fofn == NULL) {
         usage_quickcheck(stdout);
         return 1;
     }
@@ -90,65 +231,15 @@ int main_quickcheck(int argc, char** argv)
         hts_verbose = 3;
     }
 
-    int ret = 0;
-    int i;
-
-    for (i = 0; i < argc; i++) {
-        char* fn = argv[i];
-        int file_state = 0;
-
-        if (verbose >= 3) fprintf(stderr, "checking %s\n", fn);
-
-        // attempt to open
-        htsFile *hts_fp = hts_open(fn, "r");
-        if (hts_fp == NULL) {
-            if (verbose >= 2) fprintf(stderr, "%s could not be opened for reading\n", fn);
-            file_state |= 2;
-        }
-        else {
-            if (verbose >= 3) fprintf(stderr, "opened %s\n", fn);
-            // make sure we have sequence data
-            const htsFormat *fmt = hts_get_format(hts_fp);
-            if (fmt->category != sequence_data ) {
-                if (verbose >= 2) fprintf(stderr, "%s was not identified as sequence data\n", fn);
-                file_state |= 4;
-            }
-            else {
-                if (verbose >= 3) fprintf(stderr, "%s is sequence data\n", fn);
-                // check header
-                bam_hdr_t *header = sam_hdr_read(hts_fp);
-                if (header->n_targets <= 0) {
-                    if (verbose >= 2) fprintf(stderr, "%s had no targets in header\n", fn);
-                    file_state |= 8;
-                }
-                else {
-                    if (verbose >= 3) fprintf(stderr, "%s has %d targets in header\n", fn, header->n_targets);
-                }
-
-                // only check EOF on BAM for now
-                // TODO implement and use hts_check_EOF() to include CRAM support
-                if (fmt->format == bam) {
-                    if (bgzf_check_EOF(hts_fp->fp.bgzf) <= 0) {
-                        if (verbose >= 2) fprintf(stderr, "%s was missing EOF block\n", fn);
-                        file_state |= 16;
-                    }
-                    else {
-                        if (verbose >= 3) fprintf(stderr, "%s has good EOF block\n", fn);
-                    }
-                }
-            }
-
-            if (hts_close(hts_fp) < 0) {
-                file_state |= 32;
-                if (verbose >= 2) fprintf(stderr, "%s did not close cleanly\n", fn);
-            }
-        }
+    if ((qs.fn = sweep_inputs(fofn, argc, argv, &n_files)) == NULL)
+        return 1;
+    qs.verbose = verbose;
+    // Threads go to checking files side by side, unless there is only one
+    qs.deep_threads = n_files > 1? 1 : n_threads + 1;
+    if (qs.format == SWEEP_TSV) fputs("#file\tstate\tproblems\n", stdout);
 
-        if (file_state > 0 && verbose >= 1) {
-            fprintf(stdout, "%s\n", fn);
-        }
-        ret |= file_state;
-    }
+    int ret = sweep_run(n_files, n_threads + 1, quickcheck_file, &qs, stdout);
 
+    sweep_free_inputs(qs.fn, n_files);
     return ret;
 }
@@ -0,0 +1,1240 @@
+/*  bam_scan.c -- parallel chunked scanning of BAM and CRAM files.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <pthread.h>
+
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+#include "htslib/cram.h"
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+#include "bam_scan.h"
+#include "thread_pool.h"
+#include "bam_endian.h"
+#include "samtools.h"
+
+// Files are split into roughly this many chunks per thread, for load balancing
+#define SCAN_CHUNKS_PER_THREAD 8
+// ... but chunks are never planned smaller than this many bytes, unless
+// overridden by SAMTOOLS_SCAN_MIN_CHUNK (for testing on small files)
+#define SCAN_MIN_CHUNK (16 << 20)
+// Enough to find a BGZF block start together with the header of the next one
+#define SCAN_WINDOW (2 * BGZF_MAX_BLOCK_SIZE + 18)
+// Largest CRAM container header we are prepared to parse
+#define SCAN_CRAM_HDR_MAX 8192
+
+typedef struct {
+    // BAM: virtual offset of the first record, and the virtual offset at
+    // which the chunk ends.  CRAM: file offset of the first container.
+    int64_t beg, end;
+    int64_t stop;       // BAM: virtual offset where the scan stopped, -1 at EOF
+    int64_t n_records;  // CRAM: number of records in the chunk's containers
+    int guess;          // BAM: beg is only a block address; find a record in it
+    int ret;            // 0 done, 1 truncated or corrupt, -1 aborted
+    void *acc;
+} scan_chunk_t;
+
+typedef struct {
+    const char *fn;
+    hts_opt *in_opts;
+    const bam_scan_ops_t *ops;
+    void *data;
+    int n_targets, is_cram;
+    int n_chunks, m_chunks;
+    scan_chunk_t *chunk;
+} scan_t;
+
+typedef struct {
+    int64_t offset;
+    int32_t length, hdr_len;
+    int32_t ref_seq_id, ref_start, ref_span, n_records;
+    int crc_ok;         // header CRC32 matches (always true before CRAM 3.0)
+} scan_container_t;
+
+static inline int32_t le_to_i32(const uint8_t *p)
+{
+    return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static inline uint32_t le_to_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint16_t le_to_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static int64_t scan_min_chunk(void)
+{
+    const char *env = getenv("SAMTOOLS_SCAN_MIN_CHUNK");
+    char *end;
+    long long n;
+    if (env == NULL || *env == '\0') return SCAN_MIN_CHUNK;
+    n = strtoll(env, &end, 10);
+    return *end == '\0' && n > 0? n : SCAN_MIN_CHUNK;
+}
+
+static samFile *scan_open(const scan_t *s, bam_hdr_t **hdr)
+{
+    const char *cmd = s->ops->cmd;
+    samFile *fp = sam_open(s->fn, "r");
+    if (fp == NULL) {
+        print_error_errno(cmd, "Cannot open input file \"%s\"", s->fn);
+        return NULL;
+    }
+    if (hts_opt_apply(fp, s->in_opts)) {
+        print_error(cmd, "failed to apply input-fmt-options");
+        goto fail;
+    }
+    if (s->ops->required_fields) {
+        if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, s->ops->required_fields)) {
+            print_error(cmd, "failed to set CRAM_OPT_REQUIRED_FIELDS value");
+            goto fail;
+        }
+        // MD and NM are auxiliary fields, so don't generate them unless asked
+        if (!(s->ops->required_fields & SAM_AUX) && hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0)) {
+            print_error(cmd, "failed to set CRAM_OPT_DECODE_MD value");
+            goto fail;
+        }
+    }
+    if ((*hdr = sam_hdr_read(fp)) == NULL) {
+        print_error(cmd, "failed to read header for \"%s\"", s->fn);
+        goto fail;
+    }
+    return fp;
+
+ fail:
+    sam_close(fp);
+    return NULL;
+}
+
+static int scan_serial(const scan_t *s, samFile *fp, bam_hdr_t *h, void *acc)
+{
+    bam1_t *b = bam_init1();
+    int r, ret = 0;
+    while ((r = sam_read1(fp, h, b)) >= 0)
+        if (s->ops->record(acc, b, s->data) < 0) { ret = -1; break; }
+    if (ret == 0 && r < -1) ret = 1;
+    bam_destroy1(b);
+    return ret;
+}
+
+/*******************
+ * BAM chunks      *
+ *******************/
+
+// Returns the total size of the BGZF block whose header is at p, or 0
+static int bgzf_block_size(const uint8_t *p, int64_t len)
+{
+    if (len < 18) return 0;
+    if (p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4)) return 0;
+    if (p[10] != 6 || p[11] != 0 || p[12] != 'B' || p[13] != 'C' || p[14] != 2 || p[15] != 0) return 0;
+    return le_to_u16(p + 16) + 1;
+}
+
+/*
+ * Finds the first BGZF block starting at or after pos.  A candidate is
+ * only accepted if the block following it also has a valid header (or it
+ * ends the file), which rules out stray magic numbers in compressed data.
+ */
+static int64_t next_bgzf_block(hFILE *fp, uint8_t *buf, int64_t pos, int64_t size)
+{
+    ssize_t n, i;
+    if (hseek(fp, pos, SEEK_SET) < 0) return -1;
+    if ((n = hread(fp, buf, SCAN_WINDOW)) < 18) return -1;
+    for (i = 0; i < BGZF_MAX_BLOCK_SIZE && i + 18 <= n; ++i) {
+        int bsize = bgzf_block_size(buf + i, n - i);
+        if (bsize == 0) continue;
+        if (pos + i + bsize == size) return pos + i;
+        if (i + bsize + 18 <= n && bgzf_block_size(buf + i + bsize, n - i - bsize) > 0)
+            return pos + i;
+    }
+    return -1;
+}
+
+// Could a BAM record start at p?  Only the first len bytes are available.
+static int plausible_record(const uint8_t *p, int len, int n_targets)
+{
+    int32_t block_size = le_to_i32(p), tid = le_to_i32(p + 4), pos = le_to_i32(p + 8);
+    int32_t l_qseq = le_to_i32(p + 20), mtid = le_to_i32(p + 24), mpos = le_to_i32(p + 28);
+    int l_qname = p[12], n_cigar = le_to_u16(p + 16), i;
+
+    if (tid < -1 || tid >= n_targets || mtid < -1 || mtid >= n_targets) return 0;
+    if (pos < -1 || mpos < -1 || l_qname < 1 || l_qseq < 0) return 0;
+    if ((int64_t)block_size < 32 + l_qname + 4 * (int64_t)n_cigar + (l_qseq + 1) / 2 + (int64_t)l_qseq)
+        return 0;
+    // The read name must be printable and NUL-terminated, as far as we can see
+    for (i = 0; i < l_qname - 1 && 36 + i < len; ++i)
+        if (p[36 + i] < '!' || p[36 + i] > '~') return 0;
+    if (36 + l_qname - 1 < len && p[36 + l_qname - 1] != '\0') return 0;
+    return 1;
+}
+
+// Guesses the offset of the first record starting in the current block
+static int guess_record_start(BGZF *fp, int n_targets)
+{
+    const uint8_t *p = (const uint8_t *)fp->uncompressed_block;
+    int len = fp->block_length, o;
+    for (o = 0; o + 36 <= len; ++o) {
+        int64_t next;
+        if (!plausible_record(p + o, len - o, n_targets)) continue;
+        // Where the following record also starts in this block, check it too
+        next = o + 4 + (int64_t)le_to_i32(p + o);
+        if (next + 36 <= len && !plausible_record(p + next, len - next, n_targets)) continue;
+        return o;
+    }
+    return -1;
+}
+
+static int plan_bam(scan_t *s, samFile *fp, int64_t size, int n_threads)
+{
+    int64_t first = bgzf_tell(fp->fp.bgzf), prev = first >> 16, chunk_size, pos;
+    int64_t min_chunk = scan_min_chunk();
+    uint8_t *buf;
+    hFILE *hf;
+    int i;
+
+    chunk_size = (size - prev) / ((int64_t)n_threads * SCAN_CHUNKS_PER_THREAD);
+    if (chunk_size < min_chunk) chunk_size = min_chunk;
+    if (size - prev < 2 * chunk_size) return 0;
+    if ((hf = hopen(s->fn, "r")) == NULL) return 0;
+    if ((buf = (uint8_t*)malloc(SCAN_WINDOW)) == NULL) { hclose(hf); return 0; }
+
+    for (pos = prev; ; pos += chunk_size) {
+        int64_t block;
+        if (s->n_chunks == 0) block = prev;
+        else if (pos >= size || (block = next_bgzf_block(hf, buf, pos, size)) < 0) break;
+        else if (block <= prev) continue;
+        if (s->n_chunks == s->m_chunks) {
+            s->m_chunks = s->m_chunks? s->m_chunks * 2 : 16;
+            s->chunk = (scan_chunk_t*)realloc(s->chunk, s->m_chunks * sizeof(scan_chunk_t));
+        }
+        memset(&s->chunk[s->n_chunks], 0, sizeof(scan_chunk_t));
+        s->chunk[s->n_chunks].beg = s->n_chunks? block << 16 : first;
+        s->chunk[s->n_chunks].guess = (s->n_chunks > 0);
+        s->n_chunks++;
+        prev = block;
+    }
+    for (i = 0; i < s->n_chunks; ++i)
+        s->chunk[i].end = i + 1 < s->n_chunks? s->chunk[i+1].beg : INT64_MAX;
+
+    free(buf);
+    hclose(hf);
+    return s->n_chunks;
+}
+
+static void scan_bam_chunk(const scan_t *s, scan_chunk_t *c)
+{
+    BGZF *fp = bgzf_open(s->fn, "r");
+    bam1_t *b = NULL;
+    int r;
+
+    c->ret = 1; c->stop = -1;
+    if (fp == NULL) return;
+    if (c->guess) {
+        int o;
+        c->guess = 0;
+        if (bgzf_seek(fp, c->beg, SEEK_SET) < 0 || bgzf_read_block(fp) < 0
+            || (o = guess_record_start(fp, s->n_targets)) < 0) {
+            c->beg = -1; // will not match, so the chunk gets rescanned
+            goto done;
+        }
+        c->beg |= o;
+    }
+    if (bgzf_seek(fp, c->beg, SEEK_SET) < 0) goto done;
+
+    b = bam_init1();
+    for (;;) {
+        int64_t off = bgzf_tell(fp);
+        if (off >= c->end) { c->stop = off; c->ret = 0; break; }
+        if ((r = bam_read1(fp, b)) < 0) {
+            if (r == -1) c->ret = 0;
+            break;
+        }
+        if (s->ops->record(c->acc, b, s->data) < 0) { c->ret = -1; break; }
+    }
+
+ done:
+    if (b) bam_destroy1(b);
+    bgzf_close(fp);
+}
+
+/*******************
+ * CRAM chunks     *
+ *******************/
+
+static int itf8_get(const uint8_t *p, const uint8_t *end, int32_t *val)
+{
+    if (p >= end) return 0;
+    int n = p[0] < 0x80? 1 : p[0] < 0xc0? 2 : p[0] < 0xe0? 3 : p[0] < 0xf0? 4 : 5;
+    if (p + n > end) return 0;
+    switch (n) {
+    case 1: *val = p[0]; break;
+    case 2: *val = (p[0] << 8 | p[1]) & 0x3fff; break;
+    case 3: *val = (p[0] << 16 | p[1] << 8 | p[2]) & 0x1fffff; break;
+    case 4: *val = ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) & 0x0fffffff; break;
+    default: *val = (int32_t)((uint32_t)(p[0] & 0x0f) << 28 | p[1] << 20 | p[2] << 12 | p[3] << 4 | (p[4] & 0x0f)); break;
+    }
+    return n;
+}
+
+static int ltf8_len(const uint8_t *p, const uint8_t *end)
+{
+    int n = 1;
+    uint8_t c;
+    if (p >= end) return 0;
+    c = p[0];
+    while (n < 9 && (c & 0x80)) { ++n; c <<= 1; }
+    return p + n > end? 0 : n;
+}
+
+// Parses the header of the container at off
+static int read_container(hFILE *fp, int major, int64_t off, scan_container_t *c)
+{
+    uint8_t buf[SCAN_CRAM_HDR_MAX], *p, *end;
+    int32_t i, n_landmarks, skip;
+    ssize_t n;
+    int l;
+
+    if (hseek(fp, off, SEEK_SET) < 0 || (n = hread(fp, buf, sizeof buf)) < 5) return -1;
+    p = buf; end = buf + n;
+    c->offset = off;
+    c->length = le_to_i32(p); p += 4;
+#define GET_ITF8(v) do { if ((l = itf8_get(p, end, &(v))) == 0) return -1; p += l; } while (0)
+#define SKIP_LTF8() do { if ((l = ltf8_len(p, end)) == 0) return -1; p += l; } while (0)
+    GET_ITF8(c->ref_seq_id);
+    GET_ITF8(c->ref_start);
+    GET_ITF8(c->ref_span);
+    GET_ITF8(c->n_records);
+    if (major >= 3) SKIP_LTF8(); else GET_ITF8(skip); // record counter
+    SKIP_LTF8();                                        // number of bases
+    GET_ITF8(skip);                                     // number of blocks
+    GET_ITF8(n_landmarks);
+    for (i = 0; i < n_landmarks; ++i) GET_ITF8(skip);
+#undef GET_ITF8
+#undef SKIP_LTF8
+    c->crc_ok = 1;
+    if (major >= 3) {
+        if (end - p < 4) return -1;
+        c->crc_ok = crc32(crc32(0L, NULL, 0), buf, p - buf) == le_to_u32(p);
+        p += 4;
+    }
+    if (c->length < 0) return -1;
+    c->hdr_len = p - buf;
+    return 0;
+}
+
+static int plan_cram(scan_t *s, int major, int64_t size, int n_threads)
+{
+    int64_t off = 26, chunk_size, beg = -1, n_records = 0, min_chunk = scan_min_chunk();
+    scan_container_t c;
+    hFILE *hf;
+
+    if (major < 2 || major > 3) return 0;
+    chunk_size = size / ((int64_t)n_threads * SCAN_CHUNKS_PER_THREAD);
+    if (chunk_size < min_chunk) chunk_size = min_chunk;
+    if (size < 2 * chunk_size) return 0;
+    if ((hf = hopen(s->fn, "r")) == NULL) return 0;
+
+    // The first container holds the SAM header
+    if (read_container(hf, major, off, &c) < 0) goto fail;
+    off += c.hdr_len + c.length;
+    while (off < size) {
+        if (read_container(hf, major, off, &c) < 0) goto fail;
+        if (c.n_records > 0) {
+            if (beg < 0) beg = off;
+            n_records += c.n_records;
+        }
+        off += c.hdr_len + c.length;
+        if (beg >= 0 && (off - beg >= chunk_size || off >= size)) {
+            if (s->n_chunks == s->m_chunks) {
+                s->m_chunks = s->m_chunks? s->m_chunks * 2 : 16;
+                s->chunk = (scan_chunk_t*)realloc(s->chunk, s->m_chunks * sizeof(scan_chunk_t));
+            }
+            memset(&s->chunk[s->n_chunks], 0, sizeof(scan_chunk_t));
+            s->chunk[s->n_chunks].beg = beg;
+            s->chunk[s->n_chunks].n_records = n_records;
+            s->n_chunks++;
+            beg = -1; n_records = 0;
+        }
+    }
+    hclose(hf);
+    return s->n_chunks;
+
+ fail:
+    // Leave anything odd to the serial reader, which will report it properly
+    hclose(hf);
+    s->n_chunks = 0;
+    return 0;
+}
+
+static void scan_cram_chunk(const scan_t *s, scan_chunk_t *c)
+{
+    bam_hdr_t *h;
+    samFile *fp = scan_open(s, &h);
+    bam1_t *b;
+    int64_t n;
+
+    c->ret = 1;
+    if (fp == NULL) return;
+    // Nothing has been decoded yet, so we can simply reposition the stream
+    if (hseek(cram_fd_get_fp(fp->fp.cram), c->beg, SEEK_SET) >= 0) {
+        b = bam_init1();
+        for (n = 0; n < c->n_records; ++n) {
+            if (sam_read1(fp, h, b) < 0) break;
+            if (s->ops->record(c->acc, b, s->data) < 0) { n = -1; break; }
+        }
+        c->ret = n == c->n_records? 0 : n < 0? -1 : 1;
+        bam_destroy1(b);
+    }
+    bam_hdr_destroy(h);
+    sam_close(fp);
+}
+
+/*******************
+ * Driver          *
+ *******************/
+
+static int scan_job(void *data, int i)
+{
+    scan_t *s = (scan_t*)data;
+    if (s->is_cram) scan_cram_chunk(s, &s->chunk[i]);
+    else scan_bam_chunk(s, &s->chunk[i]);
+    return 0;
+}
+
+static int scan_chunks(scan_t *s, int n_threads, void *acc)
+{
+    int64_t expect = s->chunk[0].beg;
+    int i, ret = 0;
+
+    for (i = 0; i < s->n_chunks; ++i)
+        if ((s->chunk[i].acc = calloc(1, s->ops->acc_size)) == NULL) {
+            print_error(s->ops->cmd, "couldn't allocate memory");
+            return -1;
+        }
+    tpool_run(s->n_chunks, n_threads, scan_job, s);
+
+    for (i = 0; i < s->n_chunks; ++i) {
+        scan_chunk_t *c = &s->chunk[i];
+        // Every BAM chunk must start where the previous one stopped.  If the
+        // guessed start was wrong, scan the chunk again from the right place.
+        if (!s->is_cram && c->beg != expect) {
+            memset(c->acc, 0, s->ops->acc_size);
+            c->beg = expect;
+            scan_bam_chunk(s, c);
+        }
+        if (c->ret < 0) { ret = -1; break; }
+        s->ops->merge(acc, c->acc, s->data);
+        if (c->ret > 0) { ret = 1; break; }
+        if (!s->is_cram && (expect = c->stop) < 0) break;
+    }
+
+    for (i = 0; i < s->n_chunks; ++i) free(s->chunk[i].acc);
+    return ret;
+}
+
+int bam_scan(const char *fn, hts_opt *in_opts, int n_threads,
+             const bam_scan_ops_t *ops, void *data, void *acc)
+{
+    scan_t s;
+    samFile *fp;
+    bam_hdr_t *h;
+    struct stat st;
+    int ret;
+
+    memset(&s, 0, sizeof s);
+    s.fn = fn; s.in_opts = in_opts; s.ops = ops; s.data = data;
+    if ((fp = scan_open(&s, &h)) == NULL) return -1;
+    s.n_targets = h->n_targets;
+
+    if (n_threads > 1 && strcmp(fn, "-") != 0 && stat(fn, &st) == 0 && S_ISREG(st.st_mode)) {
+        const htsFormat *fmt = hts_get_format(fp);
+        if (fmt->format == bam && fmt->compression == bgzf)
+            plan_bam(&s, fp, st.st_size, n_threads);
+        else if (fmt->format == cram) {
+            s.is_cram = 1;
+            plan_cram(&s, fmt->version.major, st.st_size, n_threads);
+        }
+    }
+
+    if (s.n_chunks > 1) {
+        bam_hdr_destroy(h);
+        sam_close(fp);
+        ret = scan_chunks(&s, n_threads, acc);
+    } else {
+        void *tmp = calloc(1, ops->acc_size);
+        if (tmp == NULL) {
+            print_error(ops->cmd, "couldn't allocate memory");
+            ret = -1;
+        } else {
+            ret = scan_serial(&s, fp, h, tmp);
+            if (ret >= 0) ops->merge(acc, tmp, data);
+            free(tmp);
+        }
+        bam_hdr_destroy(h);
+        sam_close(fp);
+    }
+    free(s.chunk);
+    return ret;
+}
+
+/*******************
+ * CRAM index stats *
+ *******************/
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y? -1 : x > y;
+}
+
+// Reads the distinct container offsets listed in fn.crai, in file order
+static int64_t *load_crai_offsets(const char *fn, int *n)
+{
+    kstring_t str = { 0, 0, NULL };
+    int64_t *off = NULL;
+    int i, m = 0;
+    BGZF *fp;
+
+    *n = 0;
+    ksprintf(&str, "%s.crai", fn);
+    fp = bgzf_open(str.s, "r");
+    if (fp == NULL) { free(str.s); return NULL; }
+    while (bgzf_getline(fp, '\n', &str) >= 0) {
+        // ref_id, start, span, container offset, slice offset, slice size
+        char *p = str.s;
+        int64_t o;
+        for (i = 0; i < 3 && p; ++i)
+            if ((p = strchr(p, '\t')) != NULL) ++p;
+        if (p == NULL || (o = strtoll(p, NULL, 10)) <= 0) continue;
+        if (*n == m) {
+            m = m? m * 2 : 256;
+            off = (int64_t*)realloc(off, m * sizeof(int64_t));
+        }
+        off[(*n)++] = o;
+    }
+    bgzf_close(fp);
+    free(str.s);
+    if (*n == 0) { free(off); return NULL; }
+
+    qsort(off, *n, sizeof(int64_t), cmp_int64);
+    for (i = 1, m = 1; i < *n; ++i)
+        if (off[i] != off[m-1]) off[m++] = off[i];
+    *n = m;
+    return off;
+}
+
+// Opens CRAM file fn to decode just the reference ids and flags of its
+// records
+static samFile *open_flags_only(const char *fn, bam_hdr_t **h)
+{
+    samFile *fp = sam_open(fn, "r");
+
+    *h = NULL;
+    if (fp == NULL) return NULL;
+    if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, SAM_RNAME | SAM_FLAG) == 0
+        && hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0) == 0
+        && (*h = sam_hdr_read(fp)) != NULL) return fp;
+    sam_close(fp);
+    return NULL;
+}
+
+// Counts the n_records records of the container at off in fp, opened by
+// open_flags_only(), by reference and BAM_FUNMAP
+static int count_container(samFile *fp, bam_hdr_t *h, bam1_t *b, int64_t off, int32_t n_records,
+                           int n_targets, uint64_t *mapped, uint64_t *unmapped, uint64_t *unplaced)
+{
+    int32_t n;
+
+    if (hseek(cram_fd_get_fp(fp->fp.cram), off, SEEK_SET) < 0) return -1;
+    for (n = 0; n < n_records; ++n) {
+        if (sam_read1(fp, h, b) < 0) return -1;
+        if (b->core.tid < 0 || b->core.tid >= n_targets) (*unplaced)++;
+        else if (b->core.flag & BAM_FUNMAP) unmapped[b->core.tid]++;
+        else mapped[b->core.tid]++;
+    }
+    return 0;
+}
+
+int bam_scan_cram_counts(const char *fn, int n_targets, uint64_t *mapped,
+                         uint64_t *unmapped, uint64_t *unplaced, int fast)
+{
+    scan_container_t c;
+    const htsFormat *fmt;
+    htsFile *fp;
+    samFile *rfp = NULL;
+    bam_hdr_t *h = NULL;
+    bam1_t *b = NULL;
+    hFILE *hf = NULL;
+    int64_t *off, next = -1;
+    struct stat st;
+    int i, n_off, major, ret = -1;
+
+    if ((fp = hts_open(fn, "r")) == NULL) return -1;
+    fmt = hts_get_format(fp);
+    major = fmt->format == cram? fmt->version.major : 0;
+    hts_close(fp);
+    if (major < 2 || major > 3 || stat(fn, &st) < 0) return -1;
+    if ((off = load_crai_offsets(fn, &n_off)) == NULL) return -1;
+    if ((hf = hopen(fn, "r")) == NULL) goto done;
+    if ((rfp = open_flags_only(fn, &h)) == NULL || (b = bam_init1()) == NULL) goto done;
+
+    memset(mapped, 0, n_targets * sizeof(uint64_t));
+    memset(unmapped, 0, n_targets * sizeof(uint64_t));
+    *unplaced = 0;
+    for (i = 0; ; ++i) {
+        int64_t pos;
+        // After the last indexed container, follow the chain to the end of
+        // the file in case anything (e.g. unplaced reads) was not indexed
+        if (i < n_off) pos = off[i];
+        else if (next >= 0 && next < st.st_size) pos = next;
+        else break;
+        if (read_container(hf, major, pos, &c) < 0) goto done;
+        next = pos + c.hdr_len + c.length;
+        if (c.n_records == 0) continue;
+        if (c.ref_seq_id == -1 || c.ref_seq_id >= n_targets) {
+            *unplaced += c.n_records;
+        } else if (fast && c.ref_seq_id >= 0) {
+            mapped[c.ref_seq_id] += c.n_records;
+        } else if (count_container(rfp, h, b, pos, c.n_records, n_targets, mapped, unmapped, unplaced) < 0) {
+            goto done;
+        }
+    }
+    ret = 0;
+
+ done:
+    if (b) bam_destroy1(b);
+    if (h) bam_hdr_destroy(h);
+    if (rfp) sam_close(rfp);
+    if (hf) hclose(hf);
+    free(off);
+    return ret;
+}
+
+/*******************
+ * Pipelined reads *
+ *******************/
+
+// Blocks that each inflating thread may read ahead of the consumer
+#define PIPE_SLOTS_PER_THREAD 4
+
+enum { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+
+typedef struct {
+    uint8_t comp[BGZF_MAX_BLOCK_SIZE], data[BGZF_MAX_BLOCK_SIZE];
+    int64_t addr;       // file offset of the block
+    int comp_len, data_len;
+    int state;
+    int last;           // end of file, or a bad block (err set)
+    int err;
+} pipe_slot_t;
+
+struct bam_scan_reader_t {
+    hFILE *fp;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *tid;
+    int n_workers, n_slots;
+    int n_ready, init_err, go; // workers that have set up zlib, and whether all did
+    pipe_slot_t *slot;
+    int64_t n_read, n_used;     // blocks taken from the file, and consumed
+    int64_t addr;               // file offset of the next block to read
+    int eof, stop;
+    hFILE *tee;                 // where to copy the raw blocks as they are read
+    int tee_err;
+    z_stream zs;                // for inflating in the consumer, if no workers
+    // Consumer state
+    pipe_slot_t *cur;
+    int cur_off;
+    int done, err;
+    uint64_t eof_voff;
+};
+
+// Takes the next block from the file into s, with the lock held
+static void pipe_read(bam_scan_reader_t *r, pipe_slot_t *s)
+{
+    ssize_t n;
+    int bsize;
+
+    r->n_read++;
+    s->addr = r->addr;
+    s->comp_len = s->data_len = 0;
+    s->last = s->err = 0;
+    if ((n = hread(r->fp, s->comp, 18)) == 0) {
+        s->last = 1;
+    } else if (n != 18 || (bsize = bgzf_block_size(s->comp, 18)) < 26) {
+        s->last = s->err = 1;
+    } else if ((n = hread(r->fp, s->comp + 18, bsize - 18)) != bsize - 18) {
+        s->last = s->err = 1;
+        n += 18;
+    } else {
+        s->comp_len = bsize;
+        r->addr += bsize;
+        s->state = SLOT_BUSY;
+        if (r->tee && hwrite(r->tee, s->comp, bsize) != bsize) r->tee_err = 1;
+        return;
+    }
+    // Pass on whatever was read of a bad block, so the copy is faithful
+    if (r->tee && n > 0 && hwrite(r->tee, s->comp, n) != n) r->tee_err = 1;
+    r->eof = 1;
+    s->state = SLOT_READY;
+}
+
+static void pipe_inflate(pipe_slot_t *s, z_stream *zs)
+{
+    uint32_t isize = le_to_u32(s->comp + s->comp_len - 4);
+
+    inflateReset(zs);
+    zs->next_in = s->comp + 18; zs->avail_in = s->comp_len - 26;
+    zs->next_out = s->data; zs->avail_out = BGZF_MAX_BLOCK_SIZE;
+    if (isize > BGZF_MAX_BLOCK_SIZE || inflate(zs, Z_FINISH) != Z_STREAM_END
+        || zs->total_out != isize
+        || crc32(crc32(0L, NULL, 0), s->data, isize) != le_to_u32(s->comp + s->comp_len - 8)) {
+        s->last = s->err = 1;
+        return;
+    }
+    s->data_len = isize;
+}
+
+static void *pipe_worker(void *data)
+{
+    bam_scan_reader_t *r = (bam_scan_reader_t*)data;
+    z_stream zs;
+    int ok;
+
+    memset(&zs, 0, sizeof zs);
+    ok = (inflateInit2(&zs, -15) == Z_OK);
+    pthread_mutex_lock(&r->lock);
+    r->n_ready++;
+    if (!ok) r->init_err = 1;
+    pthread_cond_broadcast(&r->cond);
+    while (ok && !r->stop && !r->eof) {
+        pipe_slot_t *s = &r->slot[r->n_read % r->n_slots];
+        if (!r->go || s->state != SLOT_FREE) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        pipe_read(r, s);
+        if (s->state == SLOT_BUSY) {
+            pthread_mutex_unlock(&r->lock);
+            pipe_inflate(s, &zs);
+            pthread_mutex_lock(&r->lock);
+            s->state = SLOT_READY;
+        }
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (ok) inflateEnd(&zs);
+    return NULL;
+}
+
+// Releases the current block and waits for the next one
+static pipe_slot_t *pipe_next(bam_scan_reader_t *r)
+{
+    pipe_slot_t *s;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->cur) {
+        r->cur->state = SLOT_FREE;
+        r->n_used++;
+        pthread_cond_broadcast(&r->cond);
+    }
+    s = &r->slot[r->n_used % r->n_slots];
+    if (r->n_workers == 0 && s->state == SLOT_FREE) {
+        pipe_read(r, s);
+        if (s->state == SLOT_BUSY) {
+            pipe_inflate(s, &r->zs);
+            s->state = SLOT_READY;
+        }
+    }
+    while (s->state != SLOT_READY) pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    r->cur = s;
+    r->cur_off = 0;
+    return s;
+}
+
+// Copies the next len bytes of uncompressed data into buf.  Returns 0 on
+// success, -1 at the end of the data if no bytes were copied, or -2 if the
+// file is truncated or corrupt.
+static int pipe_read_bytes(bam_scan_reader_t *r, void *buf, int len)
+{
+    uint8_t *p = (uint8_t*)buf;
+    int got = 0;
+
+    while (got < len) {
+        pipe_slot_t *s = r->cur;
+        int n;
+        if (r->done) return r->err || got? -2 : -1;
+        if (s == NULL || r->cur_off == s->data_len) {
+            s = pipe_next(r);
+            // Like bgzf_read(), stop at the first empty block (normally the
+            // EOF marker), with the offset just past it
+            if (s->last || s->data_len == 0) {
+                r->done = 1;
+                r->err = s->err;
+                r->eof_voff = (uint64_t)(s->addr + s->comp_len) << 16;
+            }
+            continue;
+        }
+        n = s->data_len - r->cur_off;
+        if (n > len - got) n = len - got;
+        memcpy(p + got, s->data + r->cur_off, n);
+        r->cur_off += n;
+        got += n;
+    }
+    return 0;
+}
+
+static bam_hdr_t *pipe_read_header(bam_scan_reader_t *r)
+{
+    uint8_t buf[4];
+    int32_t n_targets, l_name;
+    bam_hdr_t *h;
+    int i;
+
+    if (pipe_read_bytes(r, buf, 4) < 0 || memcmp(buf, "BAM\1", 4) != 0) return NULL;
+    if ((h = bam_hdr_init()) == NULL) return NULL;
+    if (pipe_read_bytes(r, buf, 4) < 0 || le_to_i32(buf) < 0) goto fail;
+    h->l_text = le_to_i32(buf);
+    if ((h->text = (char*)malloc(h->l_text + 1)) == NULL) goto fail;
+    h->text[h->l_text] = 0;
+    if (pipe_read_bytes(r, h->text, h->l_text) < 0) goto fail;
+    if (pipe_read_bytes(r, buf, 4) < 0 || (n_targets = le_to_i32(buf)) < 0) goto fail;
+    h->target_name = (char**)calloc(n_targets, sizeof(char*));
+    h->target_len = (uint32_t*)calloc(n_targets, sizeof(uint32_t));
+    if (n_targets && (h->target_name == NULL || h->target_len == NULL)) goto fail;
+    h->n_targets = n_targets;
+    for (i = 0; i < n_targets; ++i) {
+        if (pipe_read_bytes(r, buf, 4) < 0 || (l_name = le_to_i32(buf)) <= 0) goto fail;
+        if ((h->target_name[i] = (char*)malloc(l_name)) == NULL) goto fail;
+        if (pipe_read_bytes(r, h->target_name[i], l_name) < 0) goto fail;
+        h->target_name[i][l_name - 1] = 0;
+        if (pipe_read_bytes(r, buf, 4) < 0) goto fail;
+        h->target_len[i] = le_to_u32(buf);
+    }
+    return h;
+
+ fail:
+    bam_hdr_destroy(h);
+    return NULL;
+}
+
+bam_scan_reader_t *bam_scan_reader_open(const char *fn, int n_threads, hFILE *tee,
+                                        bam_hdr_t **hdr)
+{
+    bam_scan_reader_t *r;
+    int i, err;
+
+    // Records are decoded directly from the little-endian data
+    if (bam_is_big_endian()) return NULL;
+    if ((r = (bam_scan_reader_t*)calloc(1, sizeof(bam_scan_reader_t))) == NULL) return NULL;
+    if ((r->fp = hopen(fn, "r")) == NULL) { free(r); return NULL; }
+    r->n_slots = n_threads > 1? n_threads * PIPE_SLOTS_PER_THREAD : 1;
+    r->slot = (pipe_slot_t*)calloc(r->n_slots, sizeof(pipe_slot_t));
+    r->tid = (pthread_t*)calloc(n_threads > 1? n_threads : 1, sizeof(pthread_t));
+    r->tee = tee;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (r->slot == NULL || r->tid == NULL || inflateInit2(&r->zs, -15) != Z_OK) {
+        bam_scan_reader_close(r);
+        return NULL;
+    }
+    if (n_threads > 1)
+        for (i = 0; i < n_threads; ++i, ++r->n_workers)
+            if (pthread_create(&r->tid[i], NULL, pipe_worker, r) != 0) break;
+    // Nothing is read until every worker has managed to set up zlib
+    pthread_mutex_lock(&r->lock);
+    while (r->n_ready < r->n_workers) pthread_cond_wait(&r->cond, &r->lock);
+    err = r->init_err;
+    r->go = !err;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (err) {
+        bam_scan_reader_close(r);
+        return NULL;
+    }
+
+    if ((*hdr = pipe_read_header(r)) == NULL) {
+        bam_scan_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+int bam_scan_reader_read(bam_scan_reader_t *r, bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    uint8_t x[32];
+    uint32_t u;
+    int32_t block_len;
+    int ret;
+
+    if ((ret = pipe_read_bytes(r, x, 4)) < 0) return ret;
+    if ((block_len = le_to_i32(x)) < 32) return -4;
+    if (pipe_read_bytes(r, x, 32) < 0) return -3;
+    c->tid = le_to_i32(x);
+    c->pos = le_to_i32(x + 4);
+    u = le_to_u32(x + 8);
+    c->bin = u >> 16; c->qual = u >> 8 & 0xff; c->l_qname = u & 0xff;
+    u = le_to_u32(x + 12);
+    c->flag = u >> 16; c->n_cigar = u & 0xffff;
+    c->l_qseq = le_to_i32(x + 16);
+    c->mtid = le_to_i32(x + 20);
+    c->mpos = le_to_i32(x + 24);
+    c->isize = le_to_i32(x + 28);
+    b->l_data = block_len - 32;
+    if (c->l_qseq < 0 || c->l_qname == 0) return -4;
+    if (((uint64_t)c->n_cigar << 2) + c->l_qname + ((uint64_t)c->l_qseq + 1) / 2 + c->l_qseq
+        > (uint64_t)b->l_data) return -4;
+    if (b->m_data < b->l_data) {
+        int m = b->l_data;
+        uint8_t *tmp;
+        kroundup32(m);
+        if ((tmp = (uint8_t*)realloc(b->data, m)) == NULL) return -4;
+        b->data = tmp;
+        b->m_data = m;
+    }
+    if (pipe_read_bytes(r, b->data, b->l_data) < 0) return -4;
+    return 4 + block_len;
+}
+
+uint64_t bam_scan_reader_tell(const bam_scan_reader_t *r)
+{
+    const pipe_slot_t *s = r->cur;
+    if (r->done) return r->eof_voff;
+    if (s == NULL) return 0;
+    // Like bgzf_tell(), the end of a block is the start of the next one
+    if (r->cur_off == s->data_len) return (uint64_t)(s->addr + s->comp_len) << 16;
+    return (uint64_t)s->addr << 16 | r->cur_off;
+}
+
+int bam_scan_reader_close(bam_scan_reader_t *r)
+{
+    int i, ret = 0;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    for (i = 0; i < r->n_workers; ++i) pthread_join(r->tid[i], NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    inflateEnd(&r->zs);
+    // The copy must be complete even if the records ended early
+    if (r->tee && r->go) {
+        uint8_t buf[BGZF_MAX_BLOCK_SIZE];
+        ssize_t n;
+        while ((n = hread(r->fp, buf, sizeof buf)) > 0)
+            if (hwrite(r->tee, buf, n) != n) { r->tee_err = 1; break; }
+        if (n < 0) r->tee_err = 1;
+    }
+    if (hclose(r->fp) != 0 || r->tee_err) ret = -1;
+    free(r->slot);
+    free(r->tid);
+    free(r);
+    return ret;
+}
+
+/*******************
+ * Verification    *
+ *******************/
+
+typedef struct {
+    int64_t beg, end;   // BGZF: byte range; beg is where a block starts
+    int64_t next;       // BGZF: offset of the block following the chunk
+    int first, n;       // CRAM: range of containers
+    int64_t bad;        // offset of the first bad block or container, or -1
+    const char *why;
+} verify_chunk_t;
+
+typedef struct {
+    const char *fn;
+    int major;
+    scan_container_t *ctr;
+    verify_chunk_t *chunk;
+} verify_t;
+
+static void verify_bgzf_chunk(const verify_t *v, verify_chunk_t *c)
+{
+    uint8_t *cdata = NULL, *udata = NULL;
+    int64_t off = c->beg;
+    z_stream zs;
+    BGZF *fp;
+
+    c->bad = off; c->next = -1;
+    if ((fp = bgzf_open(v->fn, "r")) == NULL) { c->why = "failed to open file"; return; }
+    memset(&zs, 0, sizeof zs);
+    if (inflateInit2(&zs, -15) != Z_OK) { c->why = "failed to initialise zlib"; bgzf_close(fp); return; }
+    cdata = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
+    udata = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
+    c->why = "failed to seek";
+    if (cdata == NULL || udata == NULL || bgzf_seek(fp, off << 16, SEEK_SET) < 0) goto done;
+
+    for (;;) {
+        ssize_t n;
+        int bsize;
+        uint32_t isize;
+        if (off >= c->end) { c->next = off; c->bad = -1; break; }
+        c->bad = off;
+        if ((n = bgzf_raw_read(fp, cdata, 18)) == 0) { c->next = off; c->bad = -1; break; }
+        if (n != 18) { c->why = "truncated BGZF block header"; break; }
+        if ((bsize = bgzf_block_size(cdata, 18)) < 26) { c->why = "invalid BGZF block header"; break; }
+        if (bgzf_raw_read(fp, cdata + 18, bsize - 18) != bsize - 18) { c->why = "truncated BGZF block"; break; }
+        isize = le_to_u32(cdata + bsize - 4);
+        if (isize > BGZF_MAX_BLOCK_SIZE) { c->why = "invalid ISIZE in BGZF block"; break; }
+        inflateReset(&zs);
+        zs.next_in = cdata + 18; zs.avail_in = bsize - 26;
+        zs.next_out = udata; zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END) { c->why = "BGZF block failed to decompress"; break; }
+        if (zs.total_out != isize) { c->why = "ISIZE mismatch in BGZF block"; break; }
+        if (crc32(crc32(0L, NULL, 0), udata, isize) != le_to_u32(cdata + bsize - 8)) {
+            c->why = "CRC32 mismatch in BGZF block";
+            break;
+        }
+        off += bsize;
+    }
+
+ done:
+    free(cdata); free(udata);
+    inflateEnd(&zs);
+    bgzf_close(fp);
+}
+
+// Checks the blocks making up the body of a container
+static const char *verify_cram_blocks(int major, const uint8_t *p, const uint8_t *end)
+{
+    while (p < end) {
+        const uint8_t *b = p;
+        int32_t content_id, comp_size, raw_size;
+        int l;
+        p += 2; // method, content type
+        if ((l = itf8_get(p, end, &content_id)) == 0) return "truncated CRAM block header";
+        p += l;
+        if ((l = itf8_get(p, end, &comp_size)) == 0) return "truncated CRAM block header";
+        p += l;
+        if ((l = itf8_get(p, end, &raw_size)) == 0) return "truncated CRAM block header";
+        p += l;
+        if (comp_size < 0 || raw_size < 0 || end - p < comp_size)
+            return "CRAM block extends beyond its container";
+        p += comp_size;
+        if (major >= 3) {
+            if (end - p < 4) return "truncated CRAM block";
+            if (crc32(crc32(0L, NULL, 0), b, p - b) != le_to_u32(p)) return "CRC32 mismatch in CRAM block";
+            p += 4;
+        }
+    }
+    return NULL;
+}
+
+static void verify_cram_chunk(const verify_t *v, verify_chunk_t *c)
+{
+    uint8_t *buf = NULL;
+    size_t m_buf = 0;
+    hFILE *fp;
+    int i;
+
+    c->bad = v->ctr[c->first].offset;
+    if ((fp = hopen(v->fn, "r")) == NULL) { c->why = "failed to open file"; return; }
+    for (i = c->first; i < c->first + c->n; ++i) {
+        const scan_container_t *ctr = &v->ctr[i];
+        c->bad = ctr->offset;
+        if (m_buf < ctr->length) {
+            m_buf = ctr->length;
+            uint8_t *tmp = (uint8_t*)realloc(buf, m_buf);
+            if (tmp == NULL) { c->why = "out of memory"; goto done; }
+            buf = tmp;
+        }
+        if (hseek(fp, ctr->offset + ctr->hdr_len, SEEK_SET) < 0
+            || hread(fp, buf, ctr->length) != ctr->length) {
+            c->why = "truncated CRAM container";
+            goto done;
+        }
+        if ((c->why = verify_cram_blocks(v->major, buf, buf + ctr->length)) != NULL) goto done;
+    }
+    c->bad = -1;
+
+ done:
+    free(buf);
+    hclose(fp);
+}
+
+static int verify_job(void *data, int i)
+{
+    verify_t *v = (verify_t*)data;
+    if (v->ctr) verify_cram_chunk(v, &v->chunk[i]);
+    else verify_bgzf_chunk(v, &v->chunk[i]);
+    return 0;
+}
+
+static int verify_bgzf(verify_t *v, int64_t size, int n_threads, kstring_t *msg)
+{
+    int64_t chunk_size = size, expect = 0;
+    uint8_t *buf = NULL;
+    hFILE *hf = NULL;
+    int i, n_chunks = 1, ret = 0;
+
+    if (n_threads > 1) {
+        int64_t min_chunk = scan_min_chunk();
+        chunk_size = size / ((int64_t)n_threads * SCAN_CHUNKS_PER_THREAD);
+        if (chunk_size < min_chunk) chunk_size = min_chunk;
+        n_chunks = (size + chunk_size - 1) / chunk_size;
+        if (n_chunks < 1) n_chunks = 1;
+    }
+    if (n_chunks > 1) {
+        if ((hf = hopen(v->fn, "r")) == NULL || (buf = (uint8_t*)malloc(SCAN_WINDOW)) == NULL)
+            n_chunks = 1;
+    }
+    v->chunk = (verify_chunk_t*)calloc(n_chunks, sizeof(verify_chunk_t));
+    for (i = 0; i < n_chunks; ++i) {
+        v->chunk[i].beg = i? next_bgzf_block(hf, buf, i * chunk_size, size) : 0;
+        v->chunk[i].end = i + 1 < n_chunks? (i + 1) * chunk_size : INT64_MAX;
+    }
+    free(buf);
+    if (hf) hclose(hf);
+
+    tpool_run(n_chunks, n_threads, verify_job, v);
+
+    for (i = 0; i < n_chunks; ++i) {
+        verify_chunk_t *c = &v->chunk[i];
+        // A chunk whose start was guessed wrongly is checked again from
+        // where the previous one really ended
+        if (c->beg != expect) {
+            c->beg = expect;
+            verify_bgzf_chunk(v, c);
+        }
+        if (c->bad >= 0) {
+            ksprintf(msg, "%s at offset %lld", c->why, (long long)c->bad);
+            ret = 1;
+            break;
+        }
+        expect = c->next;
+    }
+    free(v->chunk);
+    return ret;
+}
+
+static int verify_cram(verify_t *v, int minor, int64_t size, int n_threads, kstring_t *msg)
+{
+    int64_t off = 26, chunk_size, chunk_beg;
+    int i, n_ctr = 0, m_ctr = 0, n_chunks = 0, eof = 0, ret = 0;
+    hFILE *hf;
+
+    if ((hf = hopen(v->fn, "r")) == NULL) return -1;
+    // Walk the container headers, which also checks that they chain together
+    while (off < size) {
+        scan_container_t c;
+        if (read_container(hf, v->major, off, &c) < 0) {
+            ksprintf(msg, "invalid CRAM container header at offset %lld", (long long)off);
+            ret = 1;
+            break;
+        }
+        if (!c.crc_ok) {
+            ksprintf(msg, "CRC32 mismatch in CRAM container header at offset %lld", (long long)off);
+            ret = 1;
+            break;
+        }
+        if (off + c.hdr_len + c.length > size) {
+            ksprintf(msg, "truncated CRAM container at offset %lld", (long long)off);
+            ret = 1;
+            break;
+        }
+        if (n_ctr == m_ctr) {
+            m_ctr = m_ctr? m_ctr * 2 : 256;
+            v->ctr = (scan_container_t*)realloc(v->ctr, m_ctr * sizeof(scan_container_t));
+        }
+        v->ctr[n_ctr++] = c;
+        eof = (c.n_records == 0 && c.ref_seq_id == -1 && c.ref_start == 4542278);
+        off += c.hdr_len + c.length;
+    }
+    hclose(hf);
+    if (ret == 0 && !eof && (v->major >= 3 || (v->major == 2 && minor >= 1))) {
+        ksprintf(msg, "missing CRAM EOF container");
+        ret = 1;
+    }
+
+    if (ret == 0 && n_ctr > 0) {
+        int64_t min_chunk = scan_min_chunk();
+        chunk_size = size / ((int64_t)(n_threads > 1? n_threads : 1) * SCAN_CHUNKS_PER_THREAD);
+        if (chunk_size < min_chunk) chunk_size = min_chunk;
+        v->chunk = (verify_chunk_t*)calloc(n_ctr, sizeof(verify_chunk_t));
+        chunk_beg = v->ctr[0].offset;
+        v->chunk[0].first = 0;
+        for (i = 0; i < n_ctr; ++i) {
+            if (v->ctr[i].offset - chunk_beg >= chunk_size) {
+                v->chunk[n_chunks].n = i - v->chunk[n_chunks].first;
+                v->chunk[++n_chunks].first = i;
+                chunk_beg = v->ctr[i].offset;
+            }
+        }
+        v->chunk[n_chunks].n = n_ctr - v->chunk[n_chunks].first;
+        n_chunks++;
+
+        tpool_run(n_chunks, n_threads, verify_job, v);
+
+        for (i = 0; i < n_chunks; ++i)
+            if (v->chunk[i].bad >= 0) {
+                ksprintf(msg, "%s at offset %lld", v->chunk[i].why, (long long)v->chunk[i].bad);
+                ret = 1;
+                break;
+            }
+        free(v->chunk);
+    }
+    free(v->ctr);
+    return ret;
+}
+
+int bam_scan_verify(const char *fn, int n_threads, kstring_t *msg)
+{
+    verify_t v;
+    htsFile *fp;
+    htsFormat fmt;
+    struct stat st;
+
+    if ((fp = hts_open(fn, "r")) == NULL) return -1;
+    fmt = *hts_get_format(fp);
+    hts_close(fp);
+    if (stat(fn, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+
+    memset(&v, 0, sizeof v);
+    v.fn = fn;
+    if (fmt.format == cram) {
+        v.major = fmt.version.major;
+        if (v.major < 2) return 0; // nothing but the records themselves to check
+        return verify_cram(&v, fmt.version.minor, st.st_size, n_threads, msg);
+    }
+    if (fmt.compression == bgzf)
+        return verify_bgzf(&v, st.st_size, n_threads, msg);
+    return 0;
+}
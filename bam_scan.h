@@ -0,0 +1,113 @@
+/*  bam_scan.h -- parallel chunked scanning of BAM and CRAM files.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef BAM_SCAN_H
+#define BAM_SCAN_H
+
+#include <stddef.h>
+#include <htslib/sam.h>
+#include <htslib/hfile.h>
+#include <htslib/kstring.h>
+
+/*
+ * Describes a whole-file scan.  The file is split into chunks (runs of
+ * BGZF blocks for BAM, runs of containers for CRAM) which are decoded
+ * independently, each into its own zero-initialised accumulator of
+ * acc_size bytes.  The accumulators are then folded into the caller's
+ * one with merge(), in file order.
+ */
+typedef struct {
+    const char *cmd;        // subcommand name used in error messages
+    size_t acc_size;
+    int required_fields;    // CRAM_OPT_REQUIRED_FIELDS value, or 0 for all
+
+    // Called for each record of a chunk, in file order.  Return <0 to abort.
+    int (*record)(void *acc, bam1_t *b, void *data);
+    // Adds the chunk accumulator src into dst
+    void (*merge)(void *dst, const void *src, void *data);
+} bam_scan_ops_t;
+
+/*
+ * Scans all records of fn using up to n_threads decoding threads,
+ * accumulating the results into acc.  SAM files, streams and inputs that
+ * cannot be split are scanned serially in the calling thread.
+ *
+ * Returns 0 on success; 1 if the file is truncated or corrupt, in which case
+ * acc holds everything before the first bad record, as a serial scan would;
+ * or -1 if the file could not be opened or the scan was aborted.
+ */
+int bam_scan(const char *fn, hts_opt *in_opts, int n_threads,
+             const bam_scan_ops_t *ops, void *data, void *acc);
+
+/*
+ * Counts the mapped and unmapped records of CRAM file fn placed on each of
+ * its n_targets references, and the unplaced ones, visiting the containers
+ * listed in fn.crai.  Containers of unplaced reads are counted from their
+ * headers; elsewhere only the reference ids and flags of the records are
+ * decoded, as CRAM does not say which placed records are unmapped.  If
+ * fast is set, the records of single-reference containers are not decoded
+ * but all counted in mapped[], unmapped reads placed alongside their mates
+ * included.
+ *
+ * Returns 0 on success, or -1 if fn is not CRAM or it or its index can't
+ * be read.
+ */
+int bam_scan_cram_counts(const char *fn, int n_targets, uint64_t *mapped,
+                         uint64_t *unmapped, uint64_t *unplaced, int fast);
+
+/*
+ * Sequential reader for BGZF-compressed BAM files whose blocks are read and
+ * inflated ahead of the caller by n_threads threads (none if n_threads <= 1).
+ * Records come back in file order with the same virtual offsets bgzf_tell()
+ * would give, so they can be used to build an index.  As with bam_read1(),
+ * the records end at the first empty BGZF block.
+ *
+ * bam_scan_reader_open() reads the header into *hdr.  It returns NULL if fn
+ * can't be opened or is not a BGZF-compressed BAM file, or on big-endian
+ * hosts; callers should then fall back to reading fn with htslib.  If tee
+ * is not NULL, every block is copied to it unchanged as it is read, so
+ * reading all the records also makes an exact copy of fn.
+ */
+typedef struct bam_scan_reader_t bam_scan_reader_t;
+
+bam_scan_reader_t *bam_scan_reader_open(const char *fn, int n_threads, hFILE *tee,
+                                        bam_hdr_t **hdr);
+// Returns as bam_read1() does: >= 0 on success, -1 at EOF, < -1 on error
+int bam_scan_reader_read(bam_scan_reader_t *r, bam1_t *b);
+uint64_t bam_scan_reader_tell(const bam_scan_reader_t *r);
+// Copies the rest of fn to the tee, if any, even where the records ended
+// early.  Returns 0, or -1 if closing fn or writing to the tee failed.
+int bam_scan_reader_close(bam_scan_reader_t *r);
+
+/*
+ * Checks the integrity of fn without decoding any records: the CRC32 and
+ * uncompressed size of every BGZF block, or the structure of a CRAM file
+ * and, for CRAM 3.0, the CRC32 of every container header and block.  The
+ * file is split into chunks which are checked by up to n_threads threads.
+ *
+ * Returns 0 if no problems are found (including for formats that have
+ * nothing to check); 1 if there is a problem, having appended a
+ * description of the first one to msg; or -1 if fn can't be read.
+ */
+int bam_scan_verify(const char *fn, int n_threads, kstring_t *msg);
+
+#endif
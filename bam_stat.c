@@ -25,6 +25,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <config.h>
 
 #include <unistd.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +35,8 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include "htslib/sam.h"
 #include "samtools.h"
+#include "bam_scan.h"
+#include "bam_sweep.h"
 
 typedef struct {
     long long n_reads[2], n_mapped[2], n_pair_all[2], n_pair_map[2], n_pair_good[2];
@@ -85,6 +88,49 @@ bam_flagstat_t *bam_flagstat_core(samFile *fp, bam_hdr_t *h)
     return s;
 }
 
+static int flagstat_record(void *acc, bam1_t *b, void *data)
+{
+    bam_flagstat_t *s = (bam_flagstat_t*)acc;
+    bam1_core_t *c = &b->core;
+    flagstat_loop(s, c);
+    return 0;
+}
+
+static void flagstat_merge(void *dst, const void *src, void *data)
+{
+    long long *d = (long long*)dst;
+    const long long *s = (const long long*)src;
+    size_t i;
+    for (i = 0; i < sizeof(bam_flagstat_t) / sizeof(long long); ++i) d[i] += s[i];
+}
+
+static const bam_scan_ops_t flagstat_ops = {
+    "flagstat", sizeof(bam_flagstat_t), SAM_FLAG | SAM_MAPQ | SAM_RNEXT,
+    flagstat_record, flagstat_merge
+};
+
+// Categories in the order they are reported
+static const struct {
+    const char *name;
+    size_t offset;
+} flagstat_cat[] = {
+    { "total", offsetof(bam_flagstat_t, n_reads) },
+    { "secondary", offsetof(bam_flagstat_t, n_secondary) },
+    { "supplementary", offsetof(bam_flagstat_t, n_supp) },
+    { "duplicates", offsetof(bam_flagstat_t, n_dup) },
+    { "mapped", offsetof(bam_flagstat_t, n_mapped) },
+    { "paired", offsetof(bam_flagstat_t, n_pair_all) },
+    { "read1", offsetof(bam_flagstat_t, n_read1) },
+    { "read2", offsetof(bam_flagstat_t, n_read2) },
+    { "properly_paired", offsetof(bam_flagstat_t, n_pair_good) },
+    { "with_mate_mapped", offsetof(bam_flagstat_t, n_pair_map) },
+    { "singletons", offsetof(bam_flagstat_t, n_sgltn) },
+    { "mate_diff_chr", offsetof(bam_flagstat_t, n_diffchr) },
+    { "mate_diff_chr_mapq5", offsetof(bam_flagstat_t, n_diffhigh) },
+};
+#define N_FLAGSTAT_CAT (sizeof(flagstat_cat) / sizeof(flagstat_cat[0]))
+#define flagstat_count(s, i) ((const long long*)((const char*)(s) + flagstat_cat[i].offset))
+
 static const char *percent(char *buffer, long long n, long long total)
 {
     if (total != 0) sprintf(buffer, "%.2f%%", (float)n / total * 100.0);
@@ -92,20 +138,105 @@ static const char *percent(char *buffer, long long n, long long total)
     return buffer;
 }
 
+static void flagstat_text(const bam_flagstat_t *s, kstring_t *out)
+{
+    char b0[16], b1[16];
+    ksprintf(out, "%lld + %lld in total (QC-passed reads + QC-failed reads)\n", s->n_reads[0], s->n_reads[1]);
+    ksprintf(out, "%lld + %lld secondary\n", s->n_secondary[0], s->n_secondary[1]);
+    ksprintf(out, "%lld + %lld supplementary\n", s->n_supp[0], s->n_supp[1]);
+    ksprintf(out, "%lld + %lld duplicates\n", s->n_dup[0], s->n_dup[1]);
+    ksprintf(out, "%lld + %lld mapped (%s : %s)\n", s->n_mapped[0], s->n_mapped[1], percent(b0, s->n_mapped[0], s->n_reads[0]), percent(b1, s->n_mapped[1], s->n_reads[1]));
+    ksprintf(out, "%lld + %lld paired in sequencing\n", s->n_pair_all[0], s->n_pair_all[1]);
+    ksprintf(out, "%lld + %lld read1\n", s->n_read1[0], s->n_read1[1]);
+    ksprintf(out, "%lld + %lld read2\n", s->n_read2[0], s->n_read2[1]);
+    ksprintf(out, "%lld + %lld properly paired (%s : %s)\n", s->n_pair_good[0], s->n_pair_good[1], percent(b0, s->n_pair_good[0], s->n_pair_all[0]), percent(b1, s->n_pair_good[1], s->n_pair_all[1]));
+    ksprintf(out, "%lld + %lld with itself and mate mapped\n", s->n_pair_map[0], s->n_pair_map[1]);
+    ksprintf(out, "%lld + %lld singletons (%s : %s)\n", s->n_sgltn[0], s->n_sgltn[1], percent(b0, s->n_sgltn[0], s->n_pair_all[0]), percent(b1, s->n_sgltn[1], s->n_pair_all[1]));
+    ksprintf(out, "%lld + %lld with mate mapped to a different chr\n", s->n_diffchr[0], s->n_diffchr[1]);
+    ksprintf(out, "%lld + %lld with mate mapped to a different chr (mapQ>=5)\n", s->n_diffhigh[0], s->n_diffhigh[1]);
+}
+
+static void flagstat_tsv_header(FILE *fp)
+{
+    size_t i;
+    fputs("#file\tstatus", fp);
+    for (i = 0; i < N_FLAGSTAT_CAT; ++i)
+        fprintf(fp, "\t%s_pass\t%s_fail", flagstat_cat[i].name, flagstat_cat[i].name);
+    fputc('\n', fp);
+}
+
+// One TSV row, or one JSON object per line, for each file
+static void flagstat_report(const char *fn, int ret, const bam_flagstat_t *s, int format, kstring_t *out)
+{
+    const char *status = ret < 0? "error" : ret > 0? "truncated" : "ok";
+    size_t i;
+    int w;
+
+    if (format == SWEEP_TSV) {
+        ksprintf(out, "%s\t%s", fn, status);
+        for (i = 0; i < N_FLAGSTAT_CAT; ++i) {
+            if (ret < 0) kputs("\tNA\tNA", out);
+            else ksprintf(out, "\t%lld\t%lld", flagstat_count(s, i)[0], flagstat_count(s, i)[1]);
+        }
+        kputc('\n', out);
+    } else {
+        kputs("{\"file\":", out);
+        kputs_json(fn, out);
+        ksprintf(out, ",\"status\":\"%s\"", status);
+        if (ret >= 0) {
+            for (w = 0; w < 2; ++w) {
+                ksprintf(out, ",\"%s\":{", w == 0? "pass" : "fail");
+                for (i = 0; i < N_FLAGSTAT_CAT; ++i)
+                    ksprintf(out, "%s\"%s\":%lld", i? "," : "", flagstat_cat[i].name, flagstat_count(s, i)[w]);
+                kputc('}', out);
+            }
+        }
+        kputs("}\n", out);
+    }
+}
+
+typedef struct {
+    char **fn;
+    hts_opt *in_opts;
+    int format, n_threads;
+} flagstat_sweep_t;
+
+static int flagstat_file(void *data, int i, kstring_t *out)
+{
+    flagstat_sweep_t *fs = (flagstat_sweep_t*)data;
+    bam_flagstat_t s;
+    int ret;
+
+    memset(&s, 0, sizeof s);
+    ret = bam_scan(fs->fn[i], fs->in_opts, fs->n_threads, &flagstat_ops, NULL, &s);
+    if (ret > 0)
+        print_error("flagstat", "\"%s\" is truncated or corrupt", fs->fn[i]);
+    flagstat_report(fs->fn[i], ret, &s, fs->format, out);
+    return ret != 0;
+}
+
 static void usage_exit(FILE *fp, int exit_status)
 {
-    fprintf(fp, "Usage: samtools flagstat [--input-fmt-option OPT=VAL] <in.bam>\n");
+    fprintf(fp, "Usage: samtools flagstat [options] <in.bam> [...]\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "  -b FILE    List of input files, one per line\n");
+    fprintf(fp, "  -O FORMAT  Write one line per file, in tsv or json format\n");
+    fprintf(fp, "             [tsv for more than one file, otherwise the usual report]\n");
+    fprintf(fp, "  -@, --threads INT\n");
+    fprintf(fp, "             Number of additional threads [0]\n");
+    fprintf(fp, "      --input-fmt-option OPT=VAL\n");
+    fprintf(fp, "             Specify a single input file format option in the form\n");
+    fprintf(fp, "             of OPTION or OPTION=VALUE\n");
     exit(exit_status);
 }
 
 int bam_flagstat(int argc, char *argv[])
 {
-    samFile *fp;
-    bam_hdr_t *header;
     bam_flagstat_t *s;
-    char b0[16], b1[16];
     hts_opt *in_opts = NULL;
-    int c;
+    char *fofn = NULL, **fn;
+    int c, ret, n_threads = 0, format = -1, n_files;
+    kstring_t out = { 0, 0, NULL };
 
     enum {
         INPUT_FMT_OPTION = CHAR_MAX+1,
@@ -113,67 +244,64 @@ int bam_flagstat(int argc, char *argv[])
 
     static const struct option lopts[] = {
         {"input-fmt-option",  required_argument, NULL, INPUT_FMT_OPTION},
+        {"threads", required_argument, NULL, '@'},
+        {"output-fmt", required_argument, NULL, 'O'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((c = getopt_long(argc, argv, "", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "@:b:O:", lopts, NULL)) >= 0) {
         switch (c) {
         case INPUT_FMT_OPTION:
             if (hts_opt_add(&in_opts, optarg) < 0)
                 usage_exit(stderr, EXIT_FAILURE);
             break;
+        case '@': n_threads = atoi(optarg); break;
+        case 'b': fofn = optarg; break;
+        case 'O':
+            if ((format = sweep_parse_format(optarg)) < 0) {
+                print_error("flagstat", "unknown output format \"%s\"", optarg);
+                usage_exit(stderr, EXIT_FAILURE);
+            }
+            break;
         default:
             usage_exit(stderr, EXIT_FAILURE);
         }
     }
 
-    if (argc != optind+1) {
-        if (argc == optind) usage_exit(stdout, EXIT_SUCCESS);
-        else usage_exit(stderr, EXIT_FAILURE);
-    }
-    fp = sam_open(argv[optind], "r");
-    if (fp == NULL) {
-        print_error_errno("flagstat", "Cannot open input file \"%s\"", argv[optind]);
+    if (argc == optind && fofn == NULL) usage_exit(stdout, EXIT_SUCCESS);
+    if ((fn = sweep_inputs(fofn, argc - optind, argv + optind, &n_files)) == NULL)
         return 1;
-    }
-    if (hts_opt_apply(fp, in_opts)) {
-        fprintf(stderr, "Failed to apply input-fmt-options\n");
-        return 1;
-    }
+    if (n_files == 0) usage_exit(stderr, EXIT_FAILURE);
 
-    if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS,
-                    SAM_FLAG | SAM_MAPQ | SAM_RNEXT)) {
-        fprintf(stderr, "Failed to set CRAM_OPT_REQUIRED_FIELDS value\n");
-        return 1;
+    if (n_files > 1 || format >= 0) {
+        flagstat_sweep_t fs;
+        fs.fn = fn; fs.in_opts = in_opts;
+        fs.format = format >= 0? format : SWEEP_TSV;
+        // Spread several files over the threads, or split up a single one
+        fs.n_threads = n_files > 1? 1 : n_threads + 1;
+        if (fs.format == SWEEP_TSV) flagstat_tsv_header(stdout);
+        ret = sweep_run(n_files, n_threads + 1, flagstat_file, &fs, stdout);
+        sweep_free_inputs(fn, n_files);
+        hts_opt_free(in_opts);
+        return ret? 1 : 0;
     }
 
-    if (hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0)) {
-        fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+    s = (bam_flagstat_t*)calloc(1, sizeof(bam_flagstat_t));
+    ret = bam_scan(fn[0], in_opts, n_threads + 1, &flagstat_ops, NULL, s);
+    if (ret < 0) {
+        free(s);
+        sweep_free_inputs(fn, n_files);
+        hts_opt_free(in_opts);
         return 1;
     }
+    if (ret > 0)
+        fprintf(stderr, "[bam_flagstat_core] Truncated file? Continue anyway.\n");
 
-    header = sam_hdr_read(fp);
-    if (header == NULL) {
-        fprintf(stderr, "Failed to read header for \"%s\"\n", argv[optind]);
-        return 1;
-    }
-    s = bam_flagstat_core(fp, header);
-    printf("%lld + %lld in total (QC-passed reads + QC-failed reads)\n", s->n_reads[0], s->n_reads[1]);
-    printf("%lld + %lld secondary\n", s->n_secondary[0], s->n_secondary[1]);
-    printf("%lld + %lld supplementary\n", s->n_supp[0], s->n_supp[1]);
-    printf("%lld + %lld duplicates\n", s->n_dup[0], s->n_dup[1]);
-    printf("%lld + %lld mapped (%s : %s)\n", s->n_mapped[0], s->n_mapped[1], percent(b0, s->n_mapped[0], s->n_reads[0]), percent(b1, s->n_mapped[1], s->n_reads[1]));
-    printf("%lld + %lld paired in sequencing\n", s->n_pair_all[0], s->n_pair_all[1]);
-    printf("%lld + %lld read1\n", s->n_read1[0], s->n_read1[1]);
-    printf("%lld + %lld read2\n", s->n_read2[0], s->n_read2[1]);
-    printf("%lld + %lld properly paired (%s : %s)\n", s->n_pair_good[0], s->n_pair_good[1], percent(b0, s->n_pair_good[0], s->n_pair_all[0]), percent(b1, s->n_pair_good[1], s->n_pair_all[1]));
-    printf("%lld + %lld with itself and mate mapped\n", s->n_pair_map[0], s->n_pair_map[1]);
-    printf("%lld + %lld singletons (%s : %s)\n", s->n_sgltn[0], s->n_sgltn[1], percent(b0, s->n_sgltn[0], s->n_pair_all[0]), percent(b1, s->n_sgltn[1], s->n_pair_all[1]));
-    printf("%lld + %lld with mate mapped to a different chr\n", s->n_diffchr[0], s->n_diffchr[1]);
-    printf("%lld + %lld with mate mapped to a different chr (mapQ>=5)\n", s->n_diffhigh[0], s->n_diffhigh[1]);
+    flagstat_text(s, &out);
+    fputs(out.s, stdout);
+    free(out.s);
     free(s);
-    bam_hdr_destroy(header);
-    sam_close(fp);
+    sweep_free_inputs(fn, n_files);
     hts_opt_free(in_opts);
     return 0;
 }
@@ -0,0 +1,178 @@
+/*  bam_sweep.c -- helpers for commands that report on many files.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "htslib/hts.h"
+#include "htslib/kstring.h"
+#include "bam_sweep.h"
+
+// Completed reports held back per thread while waiting for an earlier file
+#define SWEEP_BACKLOG 4
+
+int sweep_parse_format(const char *str)
+{
+    if (strcasecmp(str, "tsv") == 0) return SWEEP_TSV;
+    if (strcasecmp(str, "json") == 0) return SWEEP_JSON;
+    return -1;
+}
+
+char **sweep_inputs(const char *fofn, int argc, char **argv, int *n)
+{
+    char **fn = NULL, **lines = NULL;
+    int i, n_lines = 0;
+
+    if (fofn) {
+        lines = hts_readlines(fofn, &n_lines);
+        if (lines == NULL) {
+            fprintf(stderr, "[%s] Invalid file list \"%s\"\n", __func__, fofn);
+            return NULL;
+        }
+    }
+    fn = (char**)malloc((n_lines + argc + 1) * sizeof(char*));
+    *n = 0;
+    for (i = 0; i < n_lines; ++i) {
+        if (lines[i][0] == '\0') free(lines[i]);
+        else fn[(*n)++] = lines[i];
+    }
+    for (i = 0; i < argc; ++i) fn[(*n)++] = strdup(argv[i]);
+    free(lines);
+    return fn;
+}
+
+void sweep_free_inputs(char **fn, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) free(fn[i]);
+    free(fn);
+}
+
+void kputs_json(const char *s, kstring_t *str)
+{
+    kputc('"', str);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        switch (c) {
+        case '"':  kputs("\\\"", str); break;
+        case '\\': kputs("\\\\", str); break;
+        case '\n': kputs("\\n", str); break;
+        case '\t': kputs("\\t", str); break;
+        case '\r': kputs("\\r", str); break;
+        default:
+            if (c < 0x20) ksprintf(str, "\\u%04x", c);
+            else kputc(c, str);
+        }
+    }
+    kputc('"', str);
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int n_files, next, next_out, window, ret;
+    sweep_func_t func;
+    sweep_write_t write;    // or NULL to write reports to fp
+    void *data;
+    FILE *fp;
+    kstring_t *report;  // ring of window slots, indexed by file % window
+    char *done;
+} sweep_t;
+
+static void *sweep_worker(void *arg)
+{
+    sweep_t *s = (sweep_t*)arg;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        kstring_t out = { 0, 0, NULL };
+        int i, ret;
+        while (s->next < s->n_files && s->next - s->next_out >= s->window)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->next >= s->n_files) break;
+        i = s->next++;
+        pthread_mutex_unlock(&s->lock);
+
+        ret = s->func(s->data, i, &out);
+
+        pthread_mutex_lock(&s->lock);
+        s->ret |= ret;
+        s->report[i % s->window] = out;
+        s->done[i % s->window] = 1;
+        // Write out everything that is now complete, in order
+        while (s->next_out < s->n_files && s->done[s->next_out % s->window]) {
+            kstring_t *r = &s->report[s->next_out % s->window];
+            if (s->write) s->ret |= s->write(s->data, s->next_out, r);
+            else if (r->l) fwrite(r->s, 1, r->l, s->fp);
+            free(r->s);
+            s->done[s->next_out % s->window] = 0;
+            s->next_out++;
+        }
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static int sweep_start(int n_files, int n_threads, sweep_func_t func,
+                       sweep_write_t write, void *data, FILE *fp)
+{
+    sweep_t s;
+    pthread_t *tid;
+    int i, n_started = 0;
+
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > n_files) n_threads = n_files;
+    memset(&s, 0, sizeof s);
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    s.n_files = n_files; s.func = func; s.write = write; s.data = data; s.fp = fp;
+    s.window = n_threads * SWEEP_BACKLOG;
+    s.report = (kstring_t*)calloc(s.window, sizeof(kstring_t));
+    s.done = (char*)calloc(s.window, 1);
+    tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+    if (n_threads > 1)
+        for (n_started = 0; n_started < n_threads; ++n_started)
+            if (pthread_create(&tid[n_started], NULL, sweep_worker, &s) != 0) break;
+    if (n_started == 0) sweep_worker(&s);
+    for (i = 0; i < n_started; ++i) pthread_join(tid[i], NULL);
+
+    free(tid); free(s.report); free(s.done);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    return s.ret;
+}
+
+int sweep_run(int n_files, int n_threads, sweep_func_t func, void *data, FILE *fp)
+{
+    return sweep_start(n_files, n_threads, func, NULL, data, fp);
+}
+
+int sweep_run_ordered(int n, int n_threads, sweep_func_t func, sweep_write_t write, void *data)
+{
+    return sweep_start(n, n_threads, func, write, data, NULL);
+}
@@ -0,0 +1,73 @@
+/*  bam_sweep.h -- helpers for commands that report on many files.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef BAM_SWEEP_H
+#define BAM_SWEEP_H
+
+#include <stdio.h>
+#include <htslib/kstring.h>
+
+// Output formats for per-file reports
+enum sweep_format { SWEEP_TEXT, SWEEP_TSV, SWEEP_JSON };
+
+/*
+ * Parses a -O argument ("tsv" or "json", case insensitive).
+ * Returns the format, or -1 if it is not recognised.
+ */
+int sweep_parse_format(const char *str);
+
+/*
+ * Builds the list of input files from the lines of fofn (if not NULL,
+ * blank lines being ignored) followed by argv[0..argc-1].  The names are
+ * not checked, so that missing files can be reported like any other
+ * failure.  Returns NULL, having printed a message, if fofn can't be read.
+ */
+char **sweep_inputs(const char *fofn, int argc, char **argv, int *n);
+void sweep_free_inputs(char **fn, int n);
+
+/*
+ * Appends s to str as a quoted JSON string.
+ */
+void kputs_json(const char *s, kstring_t *str);
+
+/*
+ * Calls func for each file index in [0, n_files), using up to n_threads
+ * threads.  Each call appends its report for that file to out, and the
+ * reports are written to fp in input order as soon as all earlier ones
+ * are complete.  Only a bounded number of completed reports is held back,
+ * so workers wait rather than racing ahead of a slow file.
+ *
+ * The return values of func are ORed together and returned.
+ */
+typedef int (*sweep_func_t)(void *data, int i, kstring_t *out);
+int sweep_run(int n_files, int n_threads, sweep_func_t func, void *data, FILE *fp);
+
+/*
+ * As sweep_run(), but for n pieces of work of any kind, with each report
+ * passed in order to write rather than written to a file.  Calls to write
+ * are never concurrent, and the report is freed afterwards.  The return
+ * values of write are ORed in with those of func.
+ */
+typedef int (*sweep_write_t)(void *data, int i, kstring_t *report);
+int sweep_run_ordered(int n, int n_threads, sweep_func_t func, sweep_write_t write, void *data);
+
+#endif
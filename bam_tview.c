@@ -28,7 +28,6 @@ DEALINGS IN THE SOFTWARE.  */
 #include <regex.h>
 #include <assert.h>
 #include "bam_tview.h"
-#include <htslib/faidx.h>
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 #include "sam_opts.h"
@@ -87,7 +86,8 @@ int base_tv_init(tview_t* tv, const char *fn, const char *fn_fa,
         exit(EXIT_FAILURE);
     }
     tv->lplbuf = bam_lplbuf_init(tv_pl_func, tv);
-    if (fn_fa) tv->fai = fai_load(fn_fa);
+    tv->ref_tid = -1;
+    if (fn_fa) tv->refs = ref_cache_open(fn_fa);
     tv->bca = bcf_call_init(0.83, 13);
     tv->ins = 1;
 
@@ -106,8 +106,8 @@ void base_tv_destroy(tview_t* tv)
     bam_lplbuf_destroy(tv->lplbuf);
     bcf_call_destroy(tv->bca);
     hts_idx_destroy(tv->idx);
-    if (tv->fai) fai_destroy(tv->fai);
-    free(tv->ref);
+    if (tv->ref_seq) ref_cache_put(tv->refs, tv->header->target_name[tv->ref_tid]);
+    ref_cache_close(tv->refs);
     bam_hdr_destroy(tv->header);
     sam_close(tv->fp);
 }
@@ -132,18 +132,19 @@ int tv_pl_func(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *pl, void
         memset(&bcr, 0, sizeof bcr);
         int qsum[4], a1, a2, tmp;
         double p[3], prior = 30;
-        bcf_call_glfgen(n, pl, seq_nt16_table[rb], tv->bca, &bcr);
-        for (i = 0; i < 4; ++i) qsum[i] = ((int)bcr.qsum[i])<<2 | i;
-        for (i = 1; i < 4; ++i) // insertion sort
-            for (j = i; j > 0 && qsum[j] > qsum[j-1]; --j)
-                tmp = qsum[j], qsum[j] = qsum[j-1], qsum[j-1] = tmp;
-        a1 = qsum[0]&3; a2 = qsum[1]&3;
-        p[0] = bcr.p[a1*5+a1]; p[1] = bcr.p[a1*5+a2] + prior; p[2] = bcr.p[a2*5+a2];
-        if ("ACGT"[a1] != toupper(rb)) p[0] += prior + 3;
-        if ("ACGT"[a2] != toupper(rb)) p[2] += prior + 3;
-        if (p[0] < p[1] && p[0] < p[2]) call = (1<<a1)<<16 | (int)((p[1]<p[2]?p[1]:p[2]) - p[0] + .499);
-        else if (p[2] < p[1] && p[2] < p[0]) call = (1<<a2)<<16 | (int)((p[0]<p[1]?p[0]:p[1]) - p[2] + .499);
-        else call = (1<<a1|1<<a2)<<16 | (int)((p[0]<p[2]?p[0]:p[2]) - p[1] + .499);
+        if (bcf_call_glfgen(n, pl, seq_nt16_table[rb], tv->bca, &bcr) >= 0) { // else leave it uncalled
+            for (i = 0; i < 4; ++i) qsum[i] = ((int)bcr.qsum[i])<<2 | i;
+            for (i = 1; i < 4; ++i) // insertion sort
+                for (j = i; j > 0 && qsum[j] > qsum[j-1]; --j)
+                    tmp = qsum[j], qsum[j] = qsum[j-1], qsum[j-1] = tmp;
+            a1 = qsum[0]&3; a2 = qsum[1]&3;
+            p[0] = bcr.p[a1*5+a1]; p[1] = bcr.p[a1*5+a2] + prior; p[2] = bcr.p[a2*5+a2];
+            if ("ACGT"[a1] != toupper(rb)) p[0] += prior + 3;
+            if ("ACGT"[a2] != toupper(rb)) p[2] += prior + 3;
+            if (p[0] < p[1] && p[0] < p[2]) call = (1<<a1)<<16 | (int)((p[1]<p[2]?p[1]:p[2]) - p[0] + .499);
+            else if (p[2] < p[1] && p[2] < p[0]) call = (1<<a2)<<16 | (int)((p[0]<p[1]?p[0]:p[1]) - p[2] + .499);
+            else call = (1<<a1|1<<a2)<<16 | (int)((p[0]<p[2]?p[0]:p[2]) - p[1] + .499);
+        }
     }
     attr = tv->my_underline(tv);
     c = ",ACMGRSVTWYHKDBN"[call>>16&0xf];
@@ -285,20 +286,26 @@ int base_draw_aln(tview_t *tv, int tid, int pos)
     tv->last_pos = tv->left_pos - 1;
     tv->ccol = 0;
     // print ref and consensus
-    if (tv->fai) {
-        char *str;
-        if (tv->ref) free(tv->ref);
+    if (tv->refs) {
         assert(tv->curr_tid>=0);
 
-        str = (char*)calloc(strlen(tv->header->target_name[tv->curr_tid]) + 30, 1);
-        assert(str!=NULL);
-        sprintf(str, "%s:%d-%d", tv->header->target_name[tv->curr_tid], tv->left_pos + 1, tv->left_pos + tv->mcol);
-        tv->ref = fai_fetch(tv->fai, str, &tv->l_ref);
-        free(str);
-        if ( !tv->ref )
-        {
-            fprintf(stderr,"Could not read the reference sequence. Is it seekable (plain text or compressed + .gzi indexed with bgzip)?\n");
-            exit(1);
+        if (tv->ref_tid != tv->curr_tid) {
+            if (tv->ref_seq) ref_cache_put(tv->refs, tv->header->target_name[tv->ref_tid]);
+            tv->ref_seq = ref_cache_get(tv->refs, tv->header->target_name[tv->curr_tid], &tv->ref_seq_len);
+            if ( !tv->ref_seq )
+            {
+                fprintf(stderr,"Could not read the reference sequence. Is it seekable (plain text or compressed + .gzi indexed with bgzip)?\n");
+                exit(1);
+            }
+            tv->ref_tid = tv->curr_tid;
+        }
+        // The screen's worth from left_pos, as far as the sequence goes
+        if (tv->left_pos < tv->ref_seq_len) {
+            tv->ref = tv->ref_seq + tv->left_pos;
+            tv->l_ref = tv->ref_seq_len - tv->left_pos < tv->mcol? tv->ref_seq_len - tv->left_pos : tv->mcol;
+        } else {
+            tv->ref = tv->ref_seq + tv->ref_seq_len;
+            tv->l_ref = 0;
         }
     }
     // draw aln
@@ -418,13 +425,13 @@ int bam_tview_main(int argc, char *argv[])
         tid = bam_name2id(tv->header, position);
         if (tid >= 0) { tv->curr_tid = tid; tv->left_pos = beg; }
     }
-    else if ( tv->fai )
+    else if ( tv->refs )
     {
         // find the first sequence present in both BAM and the reference file
         int i;
         for (i=0; i<tv->header->n_targets; i++)
         {
-            if ( faidx_has_seq(tv->fai, tv->header->target_name[i]) ) break;
+            if ( ref_cache_seq_len(tv->refs, tv->header->target_name[i]) >= 0 ) break;
         }
         if ( i==tv->header->n_targets )
         {
@@ -35,8 +35,8 @@ DEALINGS IN THE SOFTWARE.  */
 #include "bam2bcf.h"
 #include <htslib/khash.h>
 #include <htslib/hts.h>
-#include <htslib/faidx.h>
 #include "bam_lpileup.h"
+#include "ref_cache.h"
 
 
 KHASH_MAP_INIT_STR(kh_rg, const char *)
@@ -50,12 +50,14 @@ typedef struct AbstractTview {
     bam_hdr_t* header;
     samFile* fp;
     int curr_tid, left_pos;
-    faidx_t* fai;
+    ref_cache_t* refs;
     bcf_callaux_t* bca;
 
     int ccol, last_pos, row_shift, base_for, color_for, is_dot, l_ref, ins;
     int no_skip, show_name, inverse;
-    char *ref;
+    const char *ref;        // the part of ref_seq on screen
+    const char *ref_seq;    // reference ref_tid, held from refs
+    int ref_tid, ref_seq_len;
     /* maps @RG ID => SM (sample), in practice only used to determine whether a particular RG is in the list of allowed ones */
     khash_t(kh_rg) *rg_hash;
     /* callbacks */
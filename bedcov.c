@@ -31,9 +31,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
+#include "htslib/ksort.h"
 #include "sam_opts.h"
+#include "tsv_out.h"
+#include "thread_pool.h"
 
 #include "htslib/kseq.h"
 KSTREAM_INIT(gzFile, gzread, 16384)
@@ -60,27 +64,399 @@ static int read_bam(void *data, bam1_t *b)
     return ret;
 }
 
+/*
+ * The BED lines are read in first and their intervals sorted by position.
+ * Intervals that overlap, or lie within BEDCOV_MERGE_GAP of each other, are
+ * gathered into clusters, and each cluster is swept once with a single
+ * iterator per file.  Bases are added to every interval that is active at
+ * their position, and the counts are written out in the original order.
+ */
+#define BEDCOV_MERGE_GAP 65536
+
+typedef struct {
+    int tid, beg, end;
+    int line;           // index of the BED line
+} bedcov_iv_t;
+
+#define bedcov_iv_lt(a, b) ((a).tid < (b).tid || ((a).tid == (b).tid && ((a).beg < (b).beg || ((a).beg == (b).beg && (a).line < (b).line))))
+KSORT_INIT(bedcov_iv, bedcov_iv_t, bedcov_iv_lt)
+
+typedef struct {
+    int tid, beg, end;
+    int first, n_iv;    // range of the sorted intervals
+} bedcov_cluster_t;
+
+typedef struct {
+    int n;              // number of input files
+    kstring_t text;     // the BED lines, each terminated by NUL
+    size_t *off;        // start of each line in text
+    int n_lines, m_lines;
+    bedcov_iv_t *iv;
+    bedcov_cluster_t *cl;
+    int n_cl;
+    int64_t *cnt;       // n counts for each line
+    int count_reads;    // -c: count the reads overlapping each line
+    int min_depth;      // if > 0, report the fraction covered this deeply
+    int64_t *reads;     // for -c, n read counts for each line
+    int64_t *covered;   // for -d, n numbers of bases for each line
+    int *pos;           // where each line's interval was sorted to
+} bedcov_t;
+
+typedef struct {     // file handles and buffers for sweeping clusters
+    aux_t **aux;
+    hts_idx_t **idx;        // loaded for each handle, as a CRAM index must be
+    int *n_plp;
+    const bam_pileup1_t **plp;
+    int *active, m_active;
+    int *span, m_span;      // reads' active intervals, for the direct counts
+    int *diff, max;         // window of depth changes, for the direct counts
+} bedcov_ws_t;
+
+static void bedcov_ws_destroy(bedcov_ws_t *ws, int n)
+{
+    int i;
+    if (ws == NULL) return;
+    for (i = 0; i < n; ++i) {
+        if (ws->aux[i] == NULL) continue;
+        if (ws->aux[i]->iter) hts_itr_destroy(ws->aux[i]->iter);
+        if (ws->aux[i]->header) bam_hdr_destroy(ws->aux[i]->header);
+        if (ws->idx[i]) hts_idx_destroy(ws->idx[i]);   // before the handle it refers to
+        if (ws->aux[i]->fp) sam_close(ws->aux[i]->fp);
+        free(ws->aux[i]);
+    }
+    free(ws->aux); free(ws->idx); free(ws->n_plp); free(ws->plp); free(ws->active);
+    free(ws->span); free(ws->diff);
+    free(ws);
+}
+
+// Opens the n files in fn and loads their indices
+static bedcov_ws_t *bedcov_ws_init(char **fn, int n, const htsFormat *fmt, int min_mapQ)
+{
+    bedcov_ws_t *ws = calloc(1, sizeof(bedcov_ws_t));
+    int i;
+
+    ws->aux = calloc(n, sizeof(aux_t*));
+    ws->idx = calloc(n, sizeof(hts_idx_t*));
+    ws->n_plp = calloc(n, sizeof(int));
+    ws->plp = calloc(n, sizeof(bam_pileup1_t*));
+    for (i = 0; i < n; ++i) {
+        ws->aux[i] = calloc(1, sizeof(aux_t));
+        ws->aux[i]->min_mapQ = min_mapQ;
+        ws->aux[i]->fp = sam_open_format(fn[i], "r", fmt);
+        if (ws->aux[i]->fp)
+            ws->idx[i] = sam_index_load(ws->aux[i]->fp, fn[i]);
+        if (ws->aux[i]->fp == 0 || ws->idx[i] == 0) {
+            fprintf(stderr, "ERROR: fail to open index BAM file '%s'\n", fn[i]);
+            goto fail;
+        }
+        // TODO bgzf_set_cache_size(aux[i]->fp, 20);
+        ws->aux[i]->header = sam_hdr_read(ws->aux[i]->fp);
+        if (ws->aux[i]->header == NULL) {
+            fprintf(stderr, "ERROR: failed to read header for '%s'\n", fn[i]);
+            goto fail;
+        }
+    }
+    return ws;
+
+ fail:
+    bedcov_ws_destroy(ws, n);
+    return NULL;
+}
+
+// Parses a BED line into iv, returning -1 if it can't be used
+static int bedcov_parse(char *s, bam_hdr_t *h, bedcov_iv_t *iv)
+{
+    char *p, *q;
+
+    for (p = q = s; *p && *p != '\t'; ++p);
+    if (*p != '\t') return -1;
+    *p = 0; iv->tid = bam_name2id(h, q); *p = '\t';
+    if (iv->tid < 0) return -1;
+    for (q = p = p + 1; isdigit(*p); ++p);
+    if (*p != '\t') return -1;
+    *p = 0; iv->beg = atoi(q); *p = '\t';
+    for (q = p = p + 1; isdigit(*p); ++p);
+    if (*p == '\t' || *p == 0) {
+        int c = *p;
+        *p = 0; iv->end = atoi(q); *p = c;
+    } else return -1;
+    return 0;
+}
+
+static void bedcov_read(bedcov_t *bc, kstream_t *ks, bam_hdr_t *h)
+{
+    kstring_t str = { 0, 0, NULL };
+    int i, dret;
+
+    while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
+        bedcov_iv_t iv;
+        if (bedcov_parse(str.s, h, &iv) < 0) {
+            fprintf(stderr, "Errors in BED line '%s'\n", str.s);
+            continue;
+        }
+        if (bc->n_lines == bc->m_lines) {
+            bc->m_lines = bc->m_lines? bc->m_lines << 1 : 1024;
+            bc->off = realloc(bc->off, bc->m_lines * sizeof(size_t));
+            bc->iv = realloc(bc->iv, bc->m_lines * sizeof(bedcov_iv_t));
+        }
+        iv.line = bc->n_lines;
+        bc->iv[bc->n_lines] = iv;
+        bc->off[bc->n_lines++] = bc->text.l;
+        kputsn(str.s, str.l, &bc->text);
+        kputc('\0', &bc->text);
+    }
+    free(str.s);
+
+    ks_introsort(bedcov_iv, bc->n_lines, bc->iv);
+    bc->cl = malloc((bc->n_lines + 1) * sizeof(bedcov_cluster_t));
+    for (i = 0; i < bc->n_lines; ++i) {
+        bedcov_iv_t *iv = &bc->iv[i];
+        bedcov_cluster_t *c = bc->n_cl? &bc->cl[bc->n_cl - 1] : NULL;
+        if (c && c->tid == iv->tid && iv->beg < (int64_t)c->end + BEDCOV_MERGE_GAP) {
+            if (c->end < iv->end) c->end = iv->end;
+            c->n_iv++;
+        } else {
+            c = &bc->cl[bc->n_cl++];
+            c->tid = iv->tid; c->beg = iv->beg; c->end = iv->end;
+            c->first = i; c->n_iv = 1;
+        }
+    }
+    bc->pos = malloc((bc->n_lines + 1) * sizeof(int));
+    for (i = 0; i < bc->n_lines; ++i) bc->pos[bc->iv[i].line] = i;
+    bc->cnt = calloc((size_t)bc->n_lines * bc->n, sizeof(int64_t));
+    if (bc->count_reads) bc->reads = calloc((size_t)bc->n_lines * bc->n, sizeof(int64_t));
+    if (bc->min_depth > 0) bc->covered = calloc((size_t)bc->n_lines * bc->n, sizeof(int64_t));
+}
+
+static void bedcov_cluster(bedcov_ws_t *ws, bedcov_t *bc, int k)
+{
+    const bedcov_cluster_t *c = &bc->cl[k];
+    const bedcov_iv_t *iv = bc->iv;
+    aux_t **aux = ws->aux;
+    int i, j, tid, pos, n = bc->n, next = c->first, last = c->first + c->n_iv, n_active = 0;
+    bam_mplp_t mplp;
+
+    if (ws->m_active < c->n_iv) {
+        ws->m_active = c->n_iv;
+        ws->active = realloc(ws->active, ws->m_active * sizeof(int));
+    }
+    for (i = 0; i < n; ++i) {
+        if (aux[i]->iter) hts_itr_destroy(aux[i]->iter);
+        aux[i]->iter = sam_itr_queryi(ws->idx[i], c->tid, c->beg, c->end);
+    }
+    mplp = bam_mplp_init(n, read_bam, (void**)aux);
+    bam_mplp_set_maxcnt(mplp, 64000);
+    while (bam_mplp_auto(mplp, &tid, &pos, ws->n_plp, ws->plp) > 0) {
+        // Drop the intervals that have ended and add those now begun
+        for (i = j = 0; i < n_active; ++i)
+            if (iv[ws->active[i]].end > pos) ws->active[j++] = ws->active[i];
+        n_active = j;
+        for (; next < last && iv[next].beg <= pos; ++next)
+            if (iv[next].end > pos) ws->active[n_active++] = next;
+        if (n_active == 0 && next == last) break;
+
+        for (j = 0; j < n_active; ++j) {
+            int64_t *cnt = bc->cnt + (size_t)iv[ws->active[j]].line * n;
+            for (i = 0; i < n; ++i) cnt[i] += ws->n_plp[i];
+        }
+    }
+    bam_mplp_destroy(mplp);
+}
+
+/*
+ * With -c or -d, the extra counts come straight from the alignments, after
+ * the pileup has given the base counts.  A filtered read is counted against
+ * every interval its span overlaps.  For -d, each M, = or X block of a read
+ * adds +1 at its start and -1 at its end to a difference array, so bases
+ * deleted or skipped by the read are not covered by it.  The array is a
+ * window from the first position not yet added to the intervals, and as
+ * the reads are sorted, everything before the start of the next read is
+ * final.  These depths are not capped as in the pileup.
+ */
+#define BEDCOV_FLUSH 65536   // positions added to intervals at a time
+
+// Adds the window's depths up to (but not including) upto to the intervals,
+// or as many of them as the window holds
+static void bedcov_flush(bedcov_ws_t *ws, bedcov_t *bc, int f, int *beg, int upto, int *next, int last, int *n_active)
+{
+    const bedcov_iv_t *iv = bc->iv;
+    int i, j, k, m = upto - *beg, cur = 0;
+
+    if (m <= 0) return;
+    if (m > ws->max) m = ws->max;
+    upto = *beg + m;
+    for (k = 0; k < m; ++k) ws->diff[k] = cur += ws->diff[k];
+
+    for (i = j = 0; i < *n_active; ++i)
+        if (iv[ws->active[i]].end > *beg) ws->active[j++] = ws->active[i];
+    *n_active = j;
+    for (; *next < last && iv[*next].beg < upto; ++*next)
+        if (iv[*next].end > *beg) ws->active[(*n_active)++] = *next;
+    for (j = 0; j < *n_active; ++j) {
+        const bedcov_iv_t *v = &iv[ws->active[j]];
+        int x = v->beg > *beg? v->beg - *beg : 0;
+        int y = v->end < upto? v->end - *beg : m;
+        int64_t covered = 0;
+        for (k = x; k < y; ++k) covered += ws->diff[k] >= bc->min_depth;
+        bc->covered[(size_t)v->line * bc->n + f] += covered;
+    }
+
+    // Carry the depth over to the rest of the window
+    memmove(ws->diff, ws->diff + m, (ws->max - m) * sizeof(int));
+    memset(ws->diff + ws->max - m, 0, m * sizeof(int));
+    ws->diff[0] += cur;
+    *beg = upto;
+}
+
+static void bedcov_direct(bedcov_ws_t *ws, bedcov_t *bc, int k)
+{
+    const bedcov_cluster_t *c = &bc->cl[k];
+    const bedcov_iv_t *iv = bc->iv;
+    int i, j, f, last = c->first + c->n_iv;
+    bam1_t *b = bam_init1();
+
+    if (ws->m_active < c->n_iv) {
+        ws->m_active = c->n_iv;
+        ws->active = realloc(ws->active, ws->m_active * sizeof(int));
+    }
+    if (ws->m_span < c->n_iv) {
+        ws->m_span = c->n_iv;
+        ws->span = realloc(ws->span, ws->m_span * sizeof(int));
+    }
+    if (bc->covered && ws->max == 0) {
+        ws->max = 2 * BEDCOV_FLUSH;
+        ws->diff = malloc(ws->max * sizeof(int));
+    }
+    for (f = 0; f < bc->n; ++f) {
+        aux_t *aux = ws->aux[f];
+        int beg = c->beg, next = c->first, n_active = 0, next_span = c->first, n_span = 0;
+
+        if (bc->covered) memset(ws->diff, 0, ws->max * sizeof(int));
+        if (aux->iter) hts_itr_destroy(aux->iter);
+        aux->iter = sam_itr_queryi(ws->idx[f], c->tid, c->beg, c->end);
+        while (read_bam(aux, b) >= 0) {
+            const uint32_t *cigar = bam_get_cigar(b);
+            int x = b->core.pos, y = bam_endpos(b);
+            if (b->core.n_cigar == 0) continue;
+
+            // Count the read against each interval it overlaps
+            if (bc->reads) {
+                for (i = j = 0; i < n_span; ++i)
+                    if (iv[ws->span[i]].end > x) ws->span[j++] = ws->span[i];
+                n_span = j;
+                for (; next_span < last && iv[next_span].beg < y; ++next_span)
+                    if (iv[next_span].end > x) ws->span[n_span++] = next_span;
+                for (i = 0; i < n_span; ++i)
+                    if (iv[ws->span[i]].beg < y)
+                        bc->reads[(size_t)iv[ws->span[i]].line * bc->n + f]++;
+            }
+            if (bc->covered == NULL) continue;
+
+            if (x - beg >= BEDCOV_FLUSH)
+                while (beg < x) bedcov_flush(ws, bc, f, &beg, x, &next, last, &n_active);
+            if (y > c->end) y = c->end;
+            if (y - beg + 1 > ws->max) {
+                int max = ws->max;
+                while (max < y - beg + 1) max *= 2;
+                ws->diff = realloc(ws->diff, max * sizeof(int));
+                memset(ws->diff + ws->max, 0, (max - ws->max) * sizeof(int));
+                ws->max = max;
+            }
+            for (i = 0; i < b->core.n_cigar; ++i) {
+                int op = bam_cigar_op(cigar[i]), len = bam_cigar_oplen(cigar[i]);
+                if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+                    int xb = x > beg? x : beg, xe = x + len < y? x + len : y;
+                    if (xb < xe) {
+                        ws->diff[xb - beg]++;
+                        ws->diff[xe - beg]--;
+                    }
+                }
+                if (bam_cigar_type(op) & 2) x += len;
+            }
+        }
+        if (bc->covered)
+            while (beg < c->end)
+                bedcov_flush(ws, bc, f, &beg, c->end, &next, last, &n_active);
+    }
+    bam_destroy1(b);
+}
+
+/*
+ * With -@, the clusters are shared out between threads.  Each thread takes
+ * a set of file handles and their indices from a shared pool, opening a new
+ * set only if none is free.  Every interval belongs to one cluster, so the
+ * threads never update the same counts.
+ */
+typedef struct {
+    char **fn;
+    const htsFormat *fmt;
+    int min_mapQ;
+    bedcov_t *bc;
+    pthread_mutex_t lock;
+    int n_spare;
+    bedcov_ws_t **spare;
+} bedcov_par_t;
+
+static int bedcov_job(void *data, int k)
+{
+    bedcov_par_t *p = (bedcov_par_t*)data;
+    bedcov_ws_t *ws = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->n_spare) ws = p->spare[--p->n_spare];
+    pthread_mutex_unlock(&p->lock);
+    if (ws == NULL && (ws = bedcov_ws_init(p->fn, p->bc->n, p->fmt, p->min_mapQ)) == NULL)
+        return -1;
+
+    bedcov_cluster(ws, p->bc, k);
+    if (p->bc->reads || p->bc->covered) bedcov_direct(ws, p->bc, k);
+
+    pthread_mutex_lock(&p->lock);
+    p->spare[p->n_spare++] = ws;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static int bedcov_parallel(bedcov_par_t *p, bedcov_ws_t *ws, int n_threads)
+{
+    int i, ret;
+
+    p->spare = calloc(n_threads, sizeof(bedcov_ws_t*));
+    p->spare[p->n_spare++] = ws;
+    pthread_mutex_init(&p->lock, NULL);
+    ret = tpool_run(p->bc->n_cl, n_threads, bedcov_job, p);
+
+    // The first set of handles belongs to the caller
+    for (i = 0; i < p->n_spare; ++i)
+        if (p->spare[i] != ws) bedcov_ws_destroy(p->spare[i], p->bc->n);
+    free(p->spare);
+    pthread_mutex_destroy(&p->lock);
+    return ret;
+}
+
 int main_bedcov(int argc, char *argv[])
 {
     gzFile fp;
-    kstring_t str;
     kstream_t *ks;
-    hts_idx_t **idx;
-    aux_t **aux;
-    int *n_plp, dret, i, n, c, min_mapQ = 0;
-    int64_t *cnt;
-    const bam_pileup1_t **plp;
-    int usage = 0;
+    bedcov_ws_t *ws;
+    bedcov_t bc;
+    int i, j, n, c, min_mapQ = 0, n_threads = 0, count_reads = 0, min_depth = 0;
+    int usage = 0, status = 0;
+    tsv_out_t out;
 
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
     static const struct option lopts[] = {
         SAM_OPT_GLOBAL_OPTIONS('-', 0, '-', '-', 0),
+        { "threads", required_argument, NULL, '@' },
         { NULL, 0, NULL, 0 }
     };
 
-    while ((c = getopt_long(argc, argv, "Q:", lopts, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "Q:cd:@:", lopts, NULL)) >= 0) {
         switch (c) {
         case 'Q': min_mapQ = atoi(optarg); break;
+        case 'c': count_reads = 1; break;
+        case 'd': min_depth = atoi(optarg); break;
+        case '@': n_threads = atoi(optarg); break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
         case '?': usage = 1; break;
@@ -90,90 +466,69 @@ int main_bedcov(int argc, char *argv[])
     if (usage || optind + 2 > argc) {
         fprintf(stderr, "Usage: samtools bedcov [options] <in.bed> <in1.bam> [...]\n\n");
         fprintf(stderr, "  -Q INT       Only count bases of at least INT quality [0]\n");
+        fprintf(stderr, "  -c           Add the number of reads overlapping each region\n");
+        fprintf(stderr, "  -d INT       Add the fraction of each region covered by at least INT reads\n");
+        fprintf(stderr, "  -@, --threads INT\n");
+        fprintf(stderr, "               Number of additional threads, each counting different regions [0]\n");
         sam_global_opt_help(stderr, "-.--.");
         return 1;
     }
-    memset(&str, 0, sizeof(kstring_t));
     n = argc - optind - 1;
-    aux = calloc(n, sizeof(aux_t*));
-    idx = calloc(n, sizeof(hts_idx_t*));
-    for (i = 0; i < n; ++i) {
-        aux[i] = calloc(1, sizeof(aux_t));
-        aux[i]->min_mapQ = min_mapQ;
-        aux[i]->fp = sam_open_format(argv[i+optind+1], "r", &ga.in);
-        if (aux[i]->fp)
-            idx[i] = sam_index_load(aux[i]->fp, argv[i+optind+1]);
-        if (aux[i]->fp == 0 || idx[i] == 0) {
-            fprintf(stderr, "ERROR: fail to open index BAM file '%s'\n", argv[i+optind+1]);
-            return 2;
-        }
-        // TODO bgzf_set_cache_size(aux[i]->fp, 20);
-        aux[i]->header = sam_hdr_read(aux[i]->fp);
-        if (aux[i]->header == NULL) {
-            fprintf(stderr, "ERROR: failed to read header for '%s'\n",
-                    argv[i+optind+1]);
-            return 2;
-        }
-    }
-    cnt = calloc(n, 8);
+    if ((ws = bedcov_ws_init(argv + optind + 1, n, &ga.in, min_mapQ)) == NULL)
+        return 2;
 
+    memset(&bc, 0, sizeof bc);
+    bc.n = n;
+    bc.count_reads = count_reads;
+    bc.min_depth = min_depth;
     fp = gzopen(argv[optind], "rb");
     ks = ks_init(fp);
-    n_plp = calloc(n, sizeof(int));
-    plp = calloc(n, sizeof(bam_pileup1_t*));
-    while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
-        char *p, *q;
-        int tid, beg, end, pos;
-        bam_mplp_t mplp;
-
-        for (p = q = str.s; *p && *p != '\t'; ++p);
-        if (*p != '\t') goto bed_error;
-        *p = 0; tid = bam_name2id(aux[0]->header, q); *p = '\t';
-        if (tid < 0) goto bed_error;
-        for (q = p = p + 1; isdigit(*p); ++p);
-        if (*p != '\t') goto bed_error;
-        *p = 0; beg = atoi(q); *p = '\t';
-        for (q = p = p + 1; isdigit(*p); ++p);
-        if (*p == '\t' || *p == 0) {
-            int c = *p;
-            *p = 0; end = atoi(q); *p = c;
-        } else goto bed_error;
-
-        for (i = 0; i < n; ++i) {
-            if (aux[i]->iter) hts_itr_destroy(aux[i]->iter);
-            aux[i]->iter = sam_itr_queryi(idx[i], tid, beg, end);
-        }
-        mplp = bam_mplp_init(n, read_bam, (void**)aux);
-        bam_mplp_set_maxcnt(mplp, 64000);
-        memset(cnt, 0, 8 * n);
-        while (bam_mplp_auto(mplp, &tid, &pos, n_plp, plp) > 0)
-            if (pos >= beg && pos < end)
-                for (i = 0; i < n; ++i) cnt[i] += n_plp[i];
-        for (i = 0; i < n; ++i) {
-            kputc('\t', &str);
-            kputl(cnt[i], &str);
-        }
-        puts(str.s);
-        bam_mplp_destroy(mplp);
-        continue;
-
-bed_error:
-        fprintf(stderr, "Errors in BED line '%s'\n", str.s);
-    }
-    free(n_plp); free(plp);
+    bedcov_read(&bc, ks, ws->aux[0]->header);
     ks_destroy(ks);
     gzclose(fp);
 
-    free(cnt);
-    for (i = 0; i < n; ++i) {
-        if (aux[i]->iter) hts_itr_destroy(aux[i]->iter);
-        hts_idx_destroy(idx[i]);
-        bam_hdr_destroy(aux[i]->header);
-        sam_close(aux[i]->fp);
-        free(aux[i]);
+    if (n_threads > 0) {
+        bedcov_par_t p;
+        memset(&p, 0, sizeof p);
+        p.fn = argv + optind + 1; p.fmt = &ga.in;
+        p.min_mapQ = min_mapQ; p.bc = &bc;
+        if (bedcov_parallel(&p, ws, n_threads + 1) != 0) status = 1;
+    } else {
+        for (i = 0; i < bc.n_cl; ++i) {
+            bedcov_cluster(ws, &bc, i);
+            if (bc.reads || bc.covered) bedcov_direct(ws, &bc, i);
+        }
     }
-    free(aux); free(idx);
-    free(str.s);
+
+    tsv_out_init(&out, stdout);
+    for (i = 0; status == 0 && i < bc.n_lines; ++i) {
+        size_t end = i + 1 < bc.n_lines? bc.off[i+1] : bc.text.l;
+        const bedcov_iv_t *v = &bc.iv[bc.pos[i]];
+        tsv_putsn(&out, bc.text.s + bc.off[i], end - bc.off[i] - 1);
+        for (j = 0; j < n; ++j) {
+            tsv_putc(&out, '\t');
+            tsv_putl(&out, bc.cnt[(size_t)i * n + j]);
+        }
+        for (j = 0; count_reads && j < n; ++j) {
+            tsv_putc(&out, '\t');
+            tsv_putl(&out, bc.reads[(size_t)i * n + j]);
+        }
+        for (j = 0; min_depth > 0 && j < n; ++j) {
+            char buf[32];
+            int l = snprintf(buf, sizeof buf, "\t%.4f", v->end > v->beg?
+                             (double)bc.covered[(size_t)i * n + j] / (v->end - v->beg) : 0.0);
+            tsv_putsn(&out, buf, l);
+        }
+        tsv_putc(&out, '\n');
+    }
+    if (tsv_out_destroy(&out) < 0) {
+        fprintf(stderr, "ERROR: failed to write to standard output\n");
+        status = 1;
+    }
+
+    bedcov_ws_destroy(ws, n);
+    free(bc.text.s); free(bc.off); free(bc.iv); free(bc.cl); free(bc.cnt);
+    free(bc.reads); free(bc.covered); free(bc.pos);
     sam_global_args_free(&ga);
-    return 0;
+    return status;
 }
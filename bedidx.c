@@ -42,79 +42,91 @@ KSORT_INIT_GENERIC(uint64_t)
 #include "htslib/kseq.h"
 KSTREAM_INIT(gzFile, gzread, 8192)
 
+/*
+ * The regions of each reference are kept as read, sorted by start, and are
+ * also merged where they overlap or abut into separate arrays of starts and
+ * ends.  Overlap queries binary search the ends, so only the one 4-byte
+ * array is touched until the answer is found.  Queries for increasing
+ * positions can pass the previous result as a hint, which is checked
+ * first and then searched forward from, making them O(1) amortised.
+ */
 typedef struct {
     int n, m;
-    uint64_t *a;
-    int *idx;
+    uint64_t *a;        // start<<32|end of each region, sorted
+    int n_merged;
+    int *beg, *end;     // the merged regions, in order
 } bed_reglist_t;
 
 #include "htslib/khash.h"
 KHASH_MAP_INIT_STR(reg, bed_reglist_t)
 
-#define LIDX_SHIFT 13
-
 typedef kh_reg_t reghash_t;
 
 void bed_destroy(void *_h);
 
 
-int *bed_index_core(int n, uint64_t *a, int *n_idx)
+static int bed_index_core(bed_reglist_t *p)
 {
-    int i, j, m, *idx;
-    m = *n_idx = 0; idx = 0;
-    for (i = 0; i < n; ++i) {
-        int beg, end;
-        beg = a[i]>>32 >> LIDX_SHIFT; end = ((uint32_t)a[i]) >> LIDX_SHIFT;
-        if (m < end + 1) {
-            int oldm = m;
-            m = end + 1;
-            kroundup32(m);
-            idx = realloc(idx, m * sizeof(int));
-            for (j = oldm; j < m; ++j) idx[j] = -1;
-        }
-        if (beg == end) {
-            if (idx[beg] < 0) idx[beg] = i;
+    int i, j;
+    free(p->beg); free(p->end);
+    p->n_merged = 0;
+    p->beg = malloc((p->n + 1) * sizeof(int));
+    p->end = malloc((p->n + 1) * sizeof(int));
+    if (p->beg == NULL || p->end == NULL) return -1;
+    for (i = 0, j = -1; i < p->n; ++i) {
+        int beg = p->a[i] >> 32, end = (uint32_t)p->a[i];
+        if (j >= 0 && beg <= p->end[j]) {
+            if (p->end[j] < end) p->end[j] = end;
         } else {
-            for (j = beg; j <= end; ++j)
-                if (idx[j] < 0) idx[j] = i;
+            p->beg[++j] = beg;
+            p->end[j] = end;
         }
-        *n_idx = end + 1;
     }
-    return idx;
+    p->n_merged = j + 1;
+    return 0;
 }
 
-void bed_index(void *_h)
+int bed_index(void *_h)
 {
     reghash_t *h = (reghash_t*)_h;
     khint_t k;
     for (k = 0; k < kh_end(h); ++k) {
         if (kh_exist(h, k)) {
             bed_reglist_t *p = &kh_val(h, k);
-            if (p->idx) free(p->idx);
             ks_introsort(uint64_t, p->n, p->a);
-            p->idx = bed_index_core(p->n, p->a, &p->m);
+            if (bed_index_core(p) < 0) return -1;
         }
     }
+    return 0;
 }
 
-int bed_overlap_core(const bed_reglist_t *p, int beg, int end)
+/*
+ * Returns the index of the first merged region ending after pos, searching
+ * forward from i if no earlier region can qualify.
+ */
+static inline int bed_find(const bed_reglist_t *p, int i, int pos)
 {
-    int i, min_off;
-    if (p->n == 0) return 0;
-    min_off = (beg>>LIDX_SHIFT >= p->n)? p->idx[p->n-1] : p->idx[beg>>LIDX_SHIFT];
-    if (min_off < 0) { // TODO: this block can be improved, but speed should not matter too much here
-        int n = beg>>LIDX_SHIFT;
-        if (n > p->n) n = p->n;
-        for (i = n - 1; i >= 0; --i)
-            if (p->idx[i] >= 0) break;
-        min_off = i >= 0? p->idx[i] : 0;
+    int lo, hi, step;
+    if (i < 0 || i > p->n_merged || (i > 0 && p->end[i-1] > pos)) i = 0;
+    // Gallop forward from i, then binary search the last step
+    for (lo = i, step = 1; lo < p->n_merged && p->end[lo] <= pos; step <<= 1) {
+        i = lo + 1;
+        lo += step;
     }
-    for (i = min_off; i < p->n; ++i) {
-        if ((int)(p->a[i]>>32) >= end) break; // out of range; no need to proceed
-        if ((int32_t)p->a[i] > beg && (int32_t)(p->a[i]>>32) < end)
-            return 1; // find the overlap; return
+    hi = lo < p->n_merged? lo : p->n_merged;
+    while (i < hi) {
+        int mid = i + ((hi - i) >> 1);
+        if (p->end[mid] <= pos) i = mid + 1;
+        else hi = mid;
     }
-    return 0;
+    return i;
+}
+
+int bed_overlap_core(const bed_reglist_t *p, int beg, int end, int *hint)
+{
+    int i = bed_find(p, hint? *hint : 0, beg);
+    if (hint) *hint = i;
+    return i < p->n_merged && p->beg[i] < end;
 }
 
 int bed_overlap(const void *_h, const char *chr, int beg, int end)
@@ -124,7 +136,67 @@ int bed_overlap(const void *_h, const char *chr, int beg, int end)
     if (!h) return 0;
     k = kh_get(reg, h, chr);
     if (k == kh_end(h)) return 0;
-    return bed_overlap_core(&kh_val(h, k), beg, end);
+    return bed_overlap_core(&kh_val(h, k), beg, end, NULL);
+}
+
+/*
+ * A cursor follows one reference at a time, so that callers moving along
+ * it look up the name only when the reference changes and each query can
+ * start from where the last one ended.
+ */
+typedef struct {
+    const reghash_t *h;
+    const bed_reglist_t *p; // regions of the current reference, or NULL
+    int i;                  // merged region found by the last query
+} bed_cursor_t;
+
+void *bed_cursor_init(const void *_h)
+{
+    bed_cursor_t *c = calloc(1, sizeof(bed_cursor_t));
+    if (c) c->h = (const reghash_t*)_h;
+    return c;
+}
+
+void bed_cursor_destroy(void *_c)
+{
+    free(_c);
+}
+
+int bed_cursor_set(void *_c, const char *chr)
+{
+    bed_cursor_t *c = (bed_cursor_t*)_c;
+    khint_t k = c->h? kh_get(reg, c->h, chr) : 0;
+    c->p = c->h && k != kh_end(c->h)? &kh_val(c->h, k) : NULL;
+    c->i = 0;
+    return c->p? c->p->n_merged : 0;
+}
+
+int bed_cursor_overlap(void *_c, int beg, int end)
+{
+    bed_cursor_t *c = (bed_cursor_t*)_c;
+    return c->p? bed_overlap_core(c->p, beg, end, &c->i) : 0;
+}
+
+int bed_cursor_next(void *_c, int pos, int *end)
+{
+    bed_cursor_t *c = (bed_cursor_t*)_c;
+    if (c->p == NULL) return -1;
+    c->i = bed_find(c->p, c->i, pos);
+    if (c->i >= c->p->n_merged) return -1;
+    if (end) *end = c->p->end[c->i];
+    return c->p->beg[c->i] > pos? c->p->beg[c->i] : pos;
+}
+
+const uint64_t *bed_regions(const void *_h, const char *chr, int *n)
+{
+    const reghash_t *h = (const reghash_t*)_h;
+    khint_t k;
+    *n = 0;
+    if (!h) return NULL;
+    k = kh_get(reg, h, chr);
+    if (k == kh_end(h)) return NULL;
+    *n = kh_val(h, k).n;
+    return kh_val(h, k).a;
 }
 
 /* "BED" file reader, which actually reads two different formats.
@@ -233,7 +305,7 @@ void *bed_read(const char *fn)
     ks_destroy(ks);
     gzclose(fp);
     free(str.s);
-    bed_index(h);
+    if (bed_index(h) < 0) goto fail_index;
     return h;
  fail:
     fprintf(stderr, "[bed_read] Error reading %s : %s\n", fn, strerror(errno));
@@ -243,6 +315,10 @@ void *bed_read(const char *fn)
     free(str.s);
     bed_destroy(h);
     return NULL;
+ fail_index:
+    fprintf(stderr, "[bed_read] Error indexing %s : %s\n", fn, strerror(errno));
+    bed_destroy(h);
+    return NULL;
 }
 
 void bed_destroy(void *_h)
@@ -252,7 +328,8 @@ void bed_destroy(void *_h)
     for (k = 0; k < kh_end(h); ++k) {
         if (kh_exist(h, k)) {
             free(kh_val(h, k).a);
-            free(kh_val(h, k).idx);
+            free(kh_val(h, k).beg);
+            free(kh_val(h, k).end);
             free((char*)kh_key(h, k));
         }
     }
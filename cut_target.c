@@ -31,6 +31,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/sam.h"
 #include "errmod.h"
 #include "htslib/faidx.h"
+#include "kprobaln.h"
 #include "sam_opts.h"
 
 #define ERR_DEP 0.83
@@ -53,9 +54,10 @@ typedef struct {
     int len;
     faidx_t *fai;
     errmod_t *em;
+    kpa_buf_t baq;
 } ct_t;
 
-static uint16_t gencns(ct_t *g, int n, const bam_pileup1_t *plp)
+static int gencns(ct_t *g, int n, const bam_pileup1_t *plp)
 {
     int i, j, ret, tmp, k, sum[4], qual;
     float q[16];
@@ -80,7 +82,7 @@ static uint16_t gencns(ct_t *g, int n, const bam_pileup1_t *plp)
         g->bases[k++] = q<<5 | bam_is_rev(p->b)<<4 | b;
     }
     if (k == 0) return 0;
-    errmod_cal(g->em, k, 4, g->bases, q);
+    if (errmod_cal(g->em, k, 4, g->bases, q) < 0) return -1;
     for (i = 0; i < 4; ++i) sum[i] = (int)(q[i<<2|i] + .499) << 2 | i;
     for (i = 1; i < 4; ++i) // insertion sort
         for (j = i; j > 0 && sum[j] < sum[j-1]; --j)
@@ -146,7 +148,7 @@ static void process_cns(bam_hdr_t *h, int tid, int l, uint16_t *cns)
 
 static int read_aln(void *data, bam1_t *b)
 {
-    extern int bam_prob_realn_core(bam1_t *b, const char *ref, int ref_len, int flag);
+    extern int bam_prob_realn_buf(bam1_t *b, const char *ref, int ref_len, int flag, kpa_buf_t *buf);
     ct_t *g = (ct_t*)data;
     int ret;
     while (1)
@@ -160,7 +162,7 @@ static int read_aln(void *data, bam1_t *b)
                 g->ref = fai_fetch(g->fai, g->h->target_name[b->core.tid], &g->len);
                 g->tid = b->core.tid;
             }
-            bam_prob_realn_core(b, g->ref, g->len, 1<<1|1);
+            bam_prob_realn_buf(b, g->ref, g->len, 1<<1|1, &g->baq);
         }
         break;
     }
@@ -169,7 +171,7 @@ static int read_aln(void *data, bam1_t *b)
 
 int main_cut_target(int argc, char *argv[])
 {
-    int c, tid, pos, n, lasttid = -1, l, max_l, usage = 0;
+    int c, tid, pos, n, lasttid = -1, l, max_l, usage = 0, ret = 0;
     const bam_pileup1_t *p;
     bam_plp_t plp;
     uint16_t *cns;
@@ -227,18 +229,24 @@ int main_cut_target(int argc, char *argv[])
             memset(cns, 0, max_l * 2);
             lasttid = tid;
         }
-        cns[pos] = gencns(&g, n, p);
+        if ((c = gencns(&g, n, p)) < 0) {
+            fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+            ret = 1;
+            break;
+        }
+        cns[pos] = c;
     }
-    process_cns(g.h, lasttid, l, cns);
+    if (ret == 0) process_cns(g.h, lasttid, l, cns);
     free(cns);
     bam_hdr_destroy(g.h);
     bam_plp_destroy(plp);
     sam_close(g.fp);
     if (g.fai) {
         fai_destroy(g.fai); free(g.ref);
+        kpa_buf_destroy(&g.baq);
     }
     errmod_destroy(g.em);
     free(g.bases);
     sam_global_args_free(&ga);
-    return 0;
+    return ret;
 }
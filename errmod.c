@@ -30,9 +30,17 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/ksort.h"
 KSORT_INIT_GENERIC(uint16_t)
 
-/* table of constants generated for given depcorr and eta */
+/*
+ * Table of constants generated for given depcorr and eta.  beta has a
+ * slice of n+1 values for each quality q and depth n, which is only
+ * computed when errmod_cal() first needs it, as most are never used.
+ * This makes an errmod_t cheap to set up, but it must not be shared
+ * between threads.
+ */
 typedef struct __errmod_coef_t {
-    double *fk, *beta, *lhet;
+    double *fk, *lhet;
+    double lfact[256];  // log(n!)
+    double *beta[64<<8];
 } errmod_coef_t;
 
 typedef struct {
@@ -43,61 +51,51 @@ typedef struct {
 /* \Gamma(n) = (n-1)! */
 #define lfact(n) lgamma(n+1)
 
-/* generates a success * trials table of bionomial probability densities (log transformed) */
-static double* logbinomial_table( const int n_size )
-{
-    /* prob distribution for binom var is p(k) = {n! \over k! (n-k)! } p^k (1-p)^{n-k} */
-    /* this calcs p(k) = {log(n!) - log(k!) - log((n-k)!) */
-    int k, n;
-    double *logbinom = (double*)calloc(n_size * n_size, sizeof(double));
-    for (n = 1; n < n_size; ++n) {
-        double lfn = lfact(n);
-        for (k = 1; k <= n; ++k)
-            logbinom[n<<8|k] = lfn - lfact(k) - lfact(n-k);
-    }
-    return logbinom;
-}
+/* log transformed binomial coefficient, n choose k */
+#define logbinom(ec, n, k) ((ec)->lfact[n] - (ec)->lfact[k] - (ec)->lfact[(n)-(k)])
 
 static errmod_coef_t *cal_coef(double depcorr, double eta)
 {
-    int k, n, q;
-    long double sum, sum1;
-    double *lC;
+    int k, n;
     errmod_coef_t *ec;
 
     ec = calloc(1, sizeof(errmod_coef_t));
+    for (n = 0; n < 256; ++n)
+        ec->lfact[n] = lfact(n);
     // initialize ->fk
     ec->fk = (double*)calloc(256, sizeof(double));
     ec->fk[0] = 1.0;
     for (n = 1; n < 256; ++n)
         ec->fk[n] = pow(1. - depcorr, n) * (1.0 - eta) + eta;
-    // initialize ->coef
-    ec->beta = (double*)calloc(256 * 256 * 64, sizeof(double));
-
-    lC = logbinomial_table( 256 );
-
-    for (q = 1; q < 64; ++q) {
-        double e = pow(10.0, -q/10.0);
-        double le = log(e);
-        double le1 = log(1.0 - e);
-        for (n = 1; n <= 255; ++n) {
-            double *beta = ec->beta + (q<<16|n<<8);
-            sum1 = sum = 0.0;
-            for (k = n; k >= 0; --k, sum1 = sum) {
-                sum = sum1 + expl(lC[n<<8|k] + k*le + (n-k)*le1);
-                beta[k] = -10. / M_LN10 * logl(sum1 / sum);
-            }
-        }
-    }
     // initialize ->lhet
     ec->lhet = (double*)calloc(256 * 256, sizeof(double));
     for (n = 0; n < 256; ++n)
         for (k = 0; k < 256; ++k)
-            ec->lhet[n<<8|k] = lC[n<<8|k] - M_LN2 * n;
-    free(lC);
+            ec->lhet[n<<8|k] = (k <= n? logbinom(ec, n, k) : 0) - M_LN2 * n;
     return ec;
 }
 
+/* returns the beta slice for quality q and depth n, computing it if needed */
+static const double *cal_beta(errmod_coef_t *ec, int q, int n)
+{
+    int k;
+    long double sum, sum1;
+    double e, le, le1, *beta = ec->beta[q<<8|n];
+
+    if (beta) return beta;
+    beta = ec->beta[q<<8|n] = malloc((n + 1) * sizeof(double));
+    if (beta == NULL) return NULL;
+    e = pow(10.0, -q/10.0);
+    le = log(e);
+    le1 = log(1.0 - e);
+    sum1 = sum = 0.0;
+    for (k = n; k >= 0; --k, sum1 = sum) {
+        sum = sum1 + expl(logbinom(ec, n, k) + k*le + (n-k)*le1);
+        beta[k] = -10. / M_LN10 * logl(sum1 / sum);
+    }
+    return beta;
+}
+
 /**
  * Create errmod_t object with obj.depcorr set to depcorr and initialise
  */
@@ -115,8 +113,10 @@ errmod_t *errmod_init(double depcorr)
  */
 void errmod_destroy(errmod_t *em)
 {
+    int i;
     if (em == 0) return;
-    free(em->coef->lhet); free(em->coef->fk); free(em->coef->beta);
+    for (i = 0; i < 64<<8; ++i) free(em->coef->beta[i]);
+    free(em->coef->lhet); free(em->coef->fk);
     free(em->coef); free(em);
 }
 
@@ -126,7 +126,7 @@ void errmod_destroy(errmod_t *em)
 // n: number of bases observed in sample
 // bases[i]: bases observed in pileup [6 bit quality|1 bit strand|4 bit base]
 // q[i*m+j]: (Output) phred-scaled likelihood of each genotype (i,j)
-int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
+int errmod_cal(errmod_t *em, int n, int m, uint16_t *bases, float *q)
 {
     // Aux
     // aux.c is total count of each base observed (ignoring strand)
@@ -158,7 +158,9 @@ int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q)
         /* extract base */
         int base = b&0xf;
         aux.fsum[base] += em->coef->fk[w[basestrand]];
-        aux.bsum[base] += em->coef->fk[w[basestrand]] * em->coef->beta[qual<<16|n<<8|aux.c[base]];
+        const double *beta = cal_beta(em->coef, qual, n);
+        if (beta == NULL) return -1;
+        aux.bsum[base] += em->coef->fk[w[basestrand]] * beta[aux.c[base]];
         ++aux.c[base];
         ++w[basestrand];
     }
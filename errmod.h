@@ -43,7 +43,11 @@ void errmod_destroy(errmod_t *em);
     m: maximum base
     bases[i]: qual:6, strand:1, base:4
     q[i*m+j]: phred-scaled likelihood of (i,j)
+
+    Coefficients are computed as they are first needed and stored in em,
+    which is therefore not const: each thread must use its own errmod_t.
+    Returns -1 if they can't be allocated.
  */
-int errmod_cal(const errmod_t *em, int n, int m, uint16_t *bases, float *q);
+int errmod_cal(errmod_t *em, int n, int m, uint16_t *bases, float *q);
 
 #endif
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include "kprobaln.h"
 
 /*****************************************
@@ -46,6 +47,185 @@ static float g_qual2prob[256];
 kpa_par_t kpa_par_def = { 0.001, 0.1, 10 };
 kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
 
+/*
+  Row kernels.  Each row of the forward and backward matrices is held as
+  three arrays, for the M, I and D states, indexed by u/3 as set by
+  set_u().  The M and I states of a row depend only on the row before,
+  so they are computed several cells at a time; D depends on the cell
+  beside it and is left to a pass in order.  Every cell still gets the
+  same operations in the same order as one at a time, so the results do
+  not depend on which kernels are used.
+
+  kpa_fwd() computes n cells of M and I from the row before, where M[]
+  holds the emission probabilities on input and pM, pI and pD point at
+  the cell diagonally before M[0].  kpa_bwd() does the same for the row
+  after, with nM pointing at the cell diagonally after M[0] and nI at
+  the one below it; it leaves the parts of M and D that don't depend on
+  the cell beside them.  kpa_scale() multiplies n values by y.
+ */
+typedef struct {
+	void (*fwd)(int n, const double *m, const double *pM, const double *pI, const double *pD, double *M, double *I);
+	void (*bwd)(int n, const double *m, const double *nM, const double *nI, double *M, double *I, double *D);
+	void (*scale)(int n, double y, double *x);
+} kpa_kernels_t;
+
+static void kpa_fwd_c(int n, const double *m, const double *pM, const double *pI, const double *pD, double *M, double *I)
+{
+	int j;
+	for (j = 0; j < n; ++j) {
+		M[j] = M[j] * (m[0] * pM[j] + m[3] * pI[j] + m[6] * pD[j]);
+		I[j] = EI * (m[1] * pM[j+1] + m[4] * pI[j+1]);
+	}
+}
+
+static void kpa_bwd_c(int n, const double *m, const double *nM, const double *nI, double *M, double *I, double *D)
+{
+	double em1 = EI * m[1], em4 = EI * m[4];
+	int j;
+	for (j = 0; j < n; ++j) {
+		double e = M[j] * nM[j];
+		M[j] = e * m[0] + em1 * nI[j];
+		I[j] = e * m[3] + em4 * nI[j];
+		D[j] = e * m[6];
+	}
+}
+
+static void kpa_scale_c(int n, double y, double *x)
+{
+	int j;
+	for (j = 0; j < n; ++j) x[j] *= y;
+}
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#include <immintrin.h>
+#define KPA_X86 1
+
+// SSE2 is part of x86-64, so these need no check
+static void kpa_fwd_sse2(int n, const double *m, const double *pM, const double *pI, const double *pD, double *M, double *I)
+{
+	__m128d m0 = _mm_set1_pd(m[0]), m3 = _mm_set1_pd(m[3]), m6 = _mm_set1_pd(m[6]);
+	__m128d m1 = _mm_set1_pd(m[1]), m4 = _mm_set1_pd(m[4]), ei = _mm_set1_pd(EI);
+	int j;
+	for (j = 0; j + 2 <= n; j += 2) {
+		__m128d t = _mm_add_pd(_mm_add_pd(_mm_mul_pd(m0, _mm_loadu_pd(pM + j)), _mm_mul_pd(m3, _mm_loadu_pd(pI + j))),
+							   _mm_mul_pd(m6, _mm_loadu_pd(pD + j)));
+		_mm_storeu_pd(M + j, _mm_mul_pd(_mm_loadu_pd(M + j), t));
+		t = _mm_add_pd(_mm_mul_pd(m1, _mm_loadu_pd(pM + j + 1)), _mm_mul_pd(m4, _mm_loadu_pd(pI + j + 1)));
+		_mm_storeu_pd(I + j, _mm_mul_pd(ei, t));
+	}
+	kpa_fwd_c(n - j, m, pM + j, pI + j, pD + j, M + j, I + j);
+}
+
+static void kpa_bwd_sse2(int n, const double *m, const double *nM, const double *nI, double *M, double *I, double *D)
+{
+	__m128d m0 = _mm_set1_pd(m[0]), m3 = _mm_set1_pd(m[3]), m6 = _mm_set1_pd(m[6]);
+	__m128d em1 = _mm_set1_pd(EI * m[1]), em4 = _mm_set1_pd(EI * m[4]);
+	int j;
+	for (j = 0; j + 2 <= n; j += 2) {
+		__m128d e = _mm_mul_pd(_mm_loadu_pd(M + j), _mm_loadu_pd(nM + j)), i1 = _mm_loadu_pd(nI + j);
+		_mm_storeu_pd(M + j, _mm_add_pd(_mm_mul_pd(e, m0), _mm_mul_pd(em1, i1)));
+		_mm_storeu_pd(I + j, _mm_add_pd(_mm_mul_pd(e, m3), _mm_mul_pd(em4, i1)));
+		_mm_storeu_pd(D + j, _mm_mul_pd(e, m6));
+	}
+	kpa_bwd_c(n - j, m, nM + j, nI + j, M + j, I + j, D + j);
+}
+
+static void kpa_scale_sse2(int n, double y, double *x)
+{
+	__m128d v = _mm_set1_pd(y);
+	int j;
+	for (j = 0; j + 2 <= n; j += 2)
+		_mm_storeu_pd(x + j, _mm_mul_pd(_mm_loadu_pd(x + j), v));
+	kpa_scale_c(n - j, y, x + j);
+}
+
+// Not "fma": fused multiply-adds would round differently.  The tails are
+// left to the SSE2 kernels, which is only quick once AVX state is cleared.
+__attribute__((target("avx")))
+static void kpa_fwd_avx(int n, const double *m, const double *pM, const double *pI, const double *pD, double *M, double *I)
+{
+	__m256d m0 = _mm256_set1_pd(m[0]), m3 = _mm256_set1_pd(m[3]), m6 = _mm256_set1_pd(m[6]);
+	__m256d m1 = _mm256_set1_pd(m[1]), m4 = _mm256_set1_pd(m[4]), ei = _mm256_set1_pd(EI);
+	int j;
+	for (j = 0; j + 4 <= n; j += 4) {
+		__m256d t = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m0, _mm256_loadu_pd(pM + j)), _mm256_mul_pd(m3, _mm256_loadu_pd(pI + j))),
+								  _mm256_mul_pd(m6, _mm256_loadu_pd(pD + j)));
+		_mm256_storeu_pd(M + j, _mm256_mul_pd(_mm256_loadu_pd(M + j), t));
+		t = _mm256_add_pd(_mm256_mul_pd(m1, _mm256_loadu_pd(pM + j + 1)), _mm256_mul_pd(m4, _mm256_loadu_pd(pI + j + 1)));
+		_mm256_storeu_pd(I + j, _mm256_mul_pd(ei, t));
+	}
+	_mm256_zeroupper(); // the rest is done without AVX
+	kpa_fwd_sse2(n - j, m, pM + j, pI + j, pD + j, M + j, I + j);
+}
+
+__attribute__((target("avx")))
+static void kpa_bwd_avx(int n, const double *m, const double *nM, const double *nI, double *M, double *I, double *D)
+{
+	__m256d m0 = _mm256_set1_pd(m[0]), m3 = _mm256_set1_pd(m[3]), m6 = _mm256_set1_pd(m[6]);
+	__m256d em1 = _mm256_set1_pd(EI * m[1]), em4 = _mm256_set1_pd(EI * m[4]);
+	int j;
+	for (j = 0; j + 4 <= n; j += 4) {
+		__m256d e = _mm256_mul_pd(_mm256_loadu_pd(M + j), _mm256_loadu_pd(nM + j)), i1 = _mm256_loadu_pd(nI + j);
+		_mm256_storeu_pd(M + j, _mm256_add_pd(_mm256_mul_pd(e, m0), _mm256_mul_pd(em1, i1)));
+		_mm256_storeu_pd(I + j, _mm256_add_pd(_mm256_mul_pd(e, m3), _mm256_mul_pd(em4, i1)));
+		_mm256_storeu_pd(D + j, _mm256_mul_pd(e, m6));
+	}
+	_mm256_zeroupper(); // the rest is done without AVX
+	kpa_bwd_sse2(n - j, m, nM + j, nI + j, M + j, I + j, D + j);
+}
+
+__attribute__((target("avx")))
+static void kpa_scale_avx(int n, double y, double *x)
+{
+	__m256d v = _mm256_set1_pd(y);
+	int j;
+	for (j = 0; j + 4 <= n; j += 4)
+		_mm256_storeu_pd(x + j, _mm256_mul_pd(_mm256_loadu_pd(x + j), v));
+	_mm256_zeroupper(); // the rest is done without AVX
+	kpa_scale_sse2(n - j, y, x + j);
+}
+#endif
+
+static kpa_kernels_t g_kernels = { kpa_fwd_c, kpa_bwd_c, kpa_scale_c };
+static pthread_once_t g_kpa_once = PTHREAD_ONCE_INIT;
+
+static void kpa_init(void)
+{
+	int i;
+	for (i = 0; i < 256; ++i)
+		g_qual2prob[i] = pow(10, -i/10.);
+#ifdef KPA_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) {
+		g_kernels.fwd = kpa_fwd_avx; g_kernels.bwd = kpa_bwd_avx; g_kernels.scale = kpa_scale_avx;
+	} else {
+		g_kernels.fwd = kpa_fwd_sse2; g_kernels.bwd = kpa_bwd_sse2; g_kernels.scale = kpa_scale_sse2;
+	}
+#endif
+}
+
+static int kpa_buf_grow(void **p, size_t *m, size_t size)
+{
+	void *x;
+	if (size <= *m) return 0;
+	if (size < *m * 2) size = *m * 2;
+	if ((x = malloc(size)) == NULL) return -1;
+	free(*p); // the contents need not be kept
+	*p = x; *m = size;
+	return 0;
+}
+
+void *kpa_buf_aux(kpa_buf_t *buf, size_t size)
+{
+	return kpa_buf_grow(&buf->aux, &buf->m_aux, size) < 0? NULL : buf->aux;
+}
+
+void kpa_buf_destroy(kpa_buf_t *buf)
+{
+	free(buf->mat); free(buf->aux);
+	memset(buf, 0, sizeof(kpa_buf_t));
+}
+
 /*
   The topology of the profile HMM:
 
@@ -70,14 +250,29 @@ kpa_par_t kpa_par_alt = { 0.0001, 0.01, 10 };
    lower two bits can be 0 (an alignment match) or 1 (an
    insertion). q[i] gives the phred scaled posterior probability of
    state[i] being wrong.
+
+   kpa_glocal_buf() keeps the matrices in buf, which is reused from one
+   call to the next and only ever grows.  It returns -1 if buf cannot
+   be grown.
  */
 int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
 			   const kpa_par_t *c, int *state, uint8_t *q)
 {
-	double **f, **b = 0, *s, m[9], sI, sM, bI, bM, pb;
+	kpa_buf_t buf = { 0, 0, NULL, NULL };
+	int ret = kpa_glocal_buf(&buf, _ref, l_ref, _query, l_query, iqual, c, state, q);
+	kpa_buf_destroy(&buf);
+	return ret;
+}
+
+int kpa_glocal_buf(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query,
+				   const uint8_t *iqual, const kpa_par_t *c, int *state, uint8_t *q)
+{
+	double *f, *b = 0, *s, m[9], sI, sM, bI, bM, pb, e_row[5];
+	size_t n;
 	float *qual, *_qual;
 	const uint8_t *ref, *query;
-	int bw, bw2, i, k, is_diff = 0, is_backward = 1, Pr;
+	int bw, bw2, w, i, k, is_diff = 0, is_backward = 1, Pr;
+	const kpa_kernels_t *kern = &g_kernels;
 
     if ( l_ref<=0 || l_query<=0 ) return 0; // FIXME: this may not be an ideal fix, just prevents sefgault
 
@@ -88,19 +283,25 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	if (bw > c->bw) bw = c->bw;
 	if (bw < abs(l_ref - l_query)) bw = abs(l_ref - l_query);
 	bw2 = bw * 2 + 1;
-	// allocate the forward and backward matrices f[][] and b[][] and the scaling array s[]
-	f = calloc(l_query+1, sizeof(double*));
-	if (is_backward) b = calloc(l_query+1, sizeof(double*));
-	for (i = 0; i <= l_query; ++i) {    // FIXME: this will lead in segfault for l_query==0
-		f[i] = calloc(bw2 * 3 + 6, sizeof(double)); // FIXME: this is over-allocated for very short seqs
-		if (is_backward) b[i] = calloc(bw2 * 3 + 6, sizeof(double));
-	}
-	s = calloc(l_query+2, sizeof(double)); // s[] is the scaling factor to avoid underflow
+	w = bw2 + 2; // cells per state per row, including one either side of the band
+	// lay out the forward and backward matrices f and b, l_query+1 rows
+	// of M, I and D each, the scaling array s[] and qual in buf
+#define F_M(i) (f + (size_t)(i) * 3 * w)
+#define F_I(i) (F_M(i) + w)
+#define F_D(i) (F_M(i) + 2 * w)
+#define B_M(i) (b + (size_t)(i) * 3 * w)
+#define B_I(i) (B_M(i) + w)
+#define B_D(i) (B_M(i) + 2 * w)
+	n = (size_t)(l_query+1) * 3 * w;
+	if (kpa_buf_grow(&buf->mat, &buf->m_mat, ((is_backward? 2 : 1) * n + l_query+2) * sizeof(double) + l_query * sizeof(float)) < 0)
+		return -1;
+	f = (double*)buf->mat;
+	if (is_backward) b = f + n;
+	s = f + (is_backward? 2 : 1) * n; // s[] is the scaling factor to avoid underflow
+	memset(f, 0, (is_backward? 2 : 1) * n * sizeof(double)); // cells beside the band are read as 0
 	// initialize qual
-	_qual = calloc(l_query, sizeof(float));
-	if (g_qual2prob[0] == 0)
-		for (i = 0; i < 256; ++i)
-			g_qual2prob[i] = pow(10, -i/10.);
+	_qual = (float*)(s + l_query+2);
+	pthread_once(&g_kpa_once, kpa_init); // mpileup may align in several threads
 	for (i = 0; i < l_query; ++i) _qual[i] = g_qual2prob[iqual? iqual[i] : 30];
 	qual = _qual - 1;
 	// initialize transition probability
@@ -112,44 +313,45 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 	/*** forward ***/
 	// f[0]
 	set_u(k, bw, 0, 0);
-	f[0][k] = s[0] = 1.;
+	F_M(0)[k/3] = s[0] = 1.;
 	{ // f[1]
-		double *fi = f[1], sum;
+		double *M = F_M(1), *I = F_I(1), sum;
 		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1, _beg, _end;
 		for (k = beg, sum = 0.; k <= end; ++k) {
 			int u;
 			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
-			set_u(u, bw, 1, k);
-			fi[u+0] = e * bM; fi[u+1] = EI * bI;
-			sum += fi[u] + fi[u+1];
+			set_u(u, bw, 1, k); u /= 3;
+			M[u] = e * bM; I[u] = EI * bI;
+			sum += M[u] + I[u];
 		}
 		// rescale
 		s[1] = sum;
-		set_u(_beg, bw, 1, beg); set_u(_end, bw, 1, end); _end += 2;
-		for (k = _beg; k <= _end; ++k) fi[k] /= sum;
+		set_u(_beg, bw, 1, beg); set_u(_end, bw, 1, end); _beg /= 3; _end /= 3;
+		for (k = _beg; k <= _end; ++k) M[k] /= sum, I[k] /= sum, F_D(1)[k] /= sum;
 	}
 	// f[2..l_query]
 	for (i = 2; i <= l_query; ++i) {
-		double *fi = f[i], *fi1 = f[i-1], sum, qli = qual[i];
-		int beg = 1, end = l_ref, x, _beg, _end;
+		double *M = F_M(i), *I = F_I(i), *D = F_D(i), sum, qli = qual[i];
+		int beg = 1, end = l_ref, x, _beg, _end, d;
 		uint8_t qyi = query[i];
 		x = i - bw; beg = beg > x? beg : x; // band start
 		x = i + bw; end = end < x? end : x; // band end
-		for (k = beg, sum = 0.; k <= end; ++k) {
-			int u, v11, v01, v10;
-			double e;
-			e = (ref[k] > 3 || qyi > 3)? 1. : ref[k] == qyi? 1. - qli : qli * EM;
-			set_u(u, bw, i, k); set_u(v11, bw, i-1, k-1); set_u(v10, bw, i-1, k); set_u(v01, bw, i, k-1);
-			fi[u+0] = e * (m[0] * fi1[v11+0] + m[3] * fi1[v11+1] + m[6] * fi1[v11+2]);
-			fi[u+1] = EI * (m[1] * fi1[v10+0] + m[4] * fi1[v10+1]);
-			fi[u+2] = m[2] * fi[v01+0] + m[8] * fi[v01+2];
-			sum += fi[u] + fi[u+1] + fi[u+2];
-//			fprintf(stderr, "F (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, fi[u], fi[u+1], fi[u+2]); // DEBUG
+		for (k = 0; k < 4; ++k) e_row[k] = qyi > 3? 1. : k == qyi? 1. - qli : qli * EM;
+		e_row[4] = 1.;
+		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _beg /= 3; _end /= 3;
+		set_u(d, bw, i-1, beg-1); d = d/3 - _beg; // offset of the diagonal in the row before
+		for (k = beg; k <= end; ++k) M[_beg + k - beg] = e_row[ref[k] > 3? 4 : ref[k]];
+		kern->fwd(_end - _beg + 1, m, F_M(i-1) + _beg + d, F_I(i-1) + _beg + d, F_D(i-1) + _beg + d, M + _beg, I + _beg);
+		for (k = _beg, sum = 0.; k <= _end; ++k) {
+			D[k] = m[2] * M[k-1] + m[8] * D[k-1];
+			sum += M[k] + I[k] + D[k];
 		}
 		// rescale
 		s[i] = sum;
-		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
-		for (k = _beg, sum = 1./sum; k <= _end; ++k) fi[k] *= sum;
+		sum = 1./sum;
+		kern->scale(_end - _beg + 1, sum, M + _beg);
+		kern->scale(_end - _beg + 1, sum, I + _beg);
+		kern->scale(_end - _beg + 1, sum, D + _beg);
 	}
 	{ // f[l_query+1]
 		double sum;
@@ -157,7 +359,8 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 			int u;
 			set_u(u, bw, l_query, k);
 			if (u < 3 || u >= bw2*3+3) continue;
-		    sum += f[l_query][u+0] * sM + f[l_query][u+1] * sI;
+			u /= 3;
+		    sum += F_M(l_query)[u] * sM + F_I(l_query)[u] * sI;
 		}
 		s[l_query+1] = sum; // the last scaling factor
 	}
@@ -169,41 +372,41 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 		}
 		Pr1 += -4.343 * log(p * l_ref * l_query);
 		Pr = (int)(Pr1 + .499);
-		if (!is_backward) { // skip backward and MAP
-			for (i = 0; i <= l_query; ++i) free(f[i]);
-			free(f); free(s); free(_qual);
-			return Pr;
-		}
+		if (!is_backward) return Pr; // skip backward and MAP
 	}
 	/*** backward ***/
 	// b[l_query] (b[l_query+1][0]=1 and thus \tilde{b}[][]=1/s[l_query+1]; this is where s[l_query+1] comes from)
 	for (k = 1; k <= l_ref; ++k) {
 		int u;
-		double *bi = b[l_query];
 		set_u(u, bw, l_query, k);
 		if (u < 3 || u >= bw2*3+3) continue;
-		bi[u+0] = sM / s[l_query] / s[l_query+1]; bi[u+1] = sI / s[l_query] / s[l_query+1];
+		u /= 3;
+		B_M(l_query)[u] = sM / s[l_query] / s[l_query+1]; B_I(l_query)[u] = sI / s[l_query] / s[l_query+1];
 	}
 	// b[l_query-1..1]
 	for (i = l_query - 1; i >= 1; --i) {
-		int beg = 1, end = l_ref, x, _beg, _end;
-		double *bi = b[i], *bi1 = b[i+1], y = (i > 1), qli1 = qual[i+1];
+		int beg = 1, end = l_ref, x, _beg, _end, d;
+		double *M = B_M(i), *I = B_I(i), *D = B_D(i), y, qli1 = qual[i+1];
 		uint8_t qyi1 = query[i+1];
 		x = i - bw; beg = beg > x? beg : x;
 		x = i + bw; end = end < x? end : x;
-		for (k = end; k >= beg; --k) {
-			int u, v11, v01, v10;
-			double e;
-			set_u(u, bw, i, k); set_u(v11, bw, i+1, k+1); set_u(v10, bw, i+1, k); set_u(v01, bw, i, k+1);
-			e = (k >= l_ref? 0 : (ref[k+1] > 3 || qyi1 > 3)? 1. : ref[k+1] == qyi1? 1. - qli1 : qli1 * EM) * bi1[v11];
-			bi[u+0] = e * m[0] + EI * m[1] * bi1[v10+1] + m[2] * bi[v01+2]; // bi1[v11] has been foled into e.
-			bi[u+1] = e * m[3] + EI * m[4] * bi1[v10+1];
-			bi[u+2] = (e * m[6] + m[8] * bi[v01+2]) * y;
-//			fprintf(stderr, "B (%d,%d;%d): %lg,%lg,%lg\n", i, k, u, bi[u], bi[u+1], bi[u+2]); // DEBUG
-		}
+		for (k = 0; k < 4; ++k) e_row[k] = qyi1 > 3? 1. : k == qyi1? 1. - qli1 : qli1 * EM;
+		e_row[4] = 1.;
+		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _beg /= 3; _end /= 3;
+		set_u(d, bw, i+1, beg+1); d = d/3 - _beg; // offset of the diagonal in the row after
+		for (k = beg; k <= end; ++k) M[_beg + k - beg] = k >= l_ref? 0 : e_row[ref[k+1] > 3? 4 : ref[k+1]];
+		kern->bwd(_end - _beg + 1, m, B_M(i+1) + _beg + d, B_I(i+1) + _beg + d - 1, M + _beg, I + _beg, D + _beg);
+		if (i > 1) {
+			for (k = _end; k >= _beg; --k) {
+				M[k] = M[k] + m[2] * D[k+1];
+				D[k] = D[k] + m[8] * D[k+1];
+			}
+		} else memset(D + _beg, 0, (_end - _beg + 1) * sizeof(double)); // no deletion before the first base
 		// rescale
-		set_u(_beg, bw, i, beg); set_u(_end, bw, i, end); _end += 2;
-		for (k = _beg, y = 1./s[i]; k <= _end; ++k) bi[k] *= y;
+		y = 1./s[i];
+		kern->scale(_end - _beg + 1, y, M + _beg);
+		kern->scale(_end - _beg + 1, y, I + _beg);
+		kern->scale(_end - _beg + 1, y, D + _beg);
 	}
 	{ // b[0]
 		int beg = 1, end = l_ref < bw + 1? l_ref : bw + 1;
@@ -213,24 +416,25 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 			double e = (ref[k] > 3 || query[1] > 3)? 1. : ref[k] == query[1]? 1. - qual[1] : qual[1] * EM;
 			set_u(u, bw, 1, k);
 			if (u < 3 || u >= bw2*3+3) continue;
-		    sum += e * b[1][u+0] * bM + EI * b[1][u+1] * bI;
+			u /= 3;
+		    sum += e * B_M(1)[u] * bM + EI * B_I(1)[u] * bI;
 		}
 		set_u(k, bw, 0, 0);
-		pb = b[0][k] = sum / s[0]; // if everything works as is expected, pb == 1.0
+		pb = B_M(0)[k/3] = sum / s[0]; // if everything works as is expected, pb == 1.0
 	}
 	is_diff = fabs(pb - 1.) > 1e-7? 1 : 0;
 	/*** MAP ***/
 	for (i = 1; i <= l_query; ++i) {
-		double sum = 0., *fi = f[i], *bi = b[i], max = 0.;
+		double sum = 0., *fm = F_M(i), *fi = F_I(i), *bm = B_M(i), *bi = B_I(i), max = 0.;
 		int beg = 1, end = l_ref, x, max_k = -1;
 		x = i - bw; beg = beg > x? beg : x;
 		x = i + bw; end = end < x? end : x;
 		for (k = beg; k <= end; ++k) {
 			int u;
 			double z;
-			set_u(u, bw, i, k);
-			z = fi[u+0] * bi[u+0]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
-			z = fi[u+1] * bi[u+1]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
+			set_u(u, bw, i, k); u /= 3;
+			z = fm[u] * bm[u]; if (z > max) max = z, max_k = (k-1)<<2 | 0; sum += z;
+			z = fi[u] * bi[u]; if (z > max) max = z, max_k = (k-1)<<2 | 1; sum += z;
 		}
 		max /= sum; sum *= s[i]; // if everything works as is expected, sum == 1.0
 		if (state) state[i-1] = max_k;
@@ -240,11 +444,12 @@ int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_quer
 				"ACGT"[query[i]], "ACGT"[ref[(max_k>>2)+1]], max_k&3, max); // DEBUG
 #endif
 	}
-	/*** free ***/
-	for (i = 0; i <= l_query; ++i) {
-		free(f[i]); free(b[i]);
-	}
-	free(f); free(b); free(s); free(_qual);
+#undef F_M
+#undef F_I
+#undef F_D
+#undef B_M
+#undef B_I
+#undef B_D
 	return Pr;
 }
 
@@ -26,6 +26,7 @@
 #ifndef LH3_KPROBALN_H_
 #define LH3_KPROBALN_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct {
@@ -33,12 +34,23 @@ typedef struct {
 	int bw;
 } kpa_par_t;
 
+/* Workspace for one thread's alignments; zero-initialise before use.
+   mat belongs to kpa_glocal_buf() and aux is scratch for the caller. */
+typedef struct {
+	size_t m_mat, m_aux;
+	void *mat, *aux;
+} kpa_buf_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 	int kpa_glocal(const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query, const uint8_t *iqual,
 				   const kpa_par_t *c, int *state, uint8_t *q);
+	int kpa_glocal_buf(kpa_buf_t *buf, const uint8_t *_ref, int l_ref, const uint8_t *_query, int l_query,
+					   const uint8_t *iqual, const kpa_par_t *c, int *state, uint8_t *q);
+	void *kpa_buf_aux(kpa_buf_t *buf, size_t size);
+	void kpa_buf_destroy(kpa_buf_t *buf);
 
 #ifdef __cplusplus
 }
@@ -31,10 +31,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include <unistd.h>
 #include <htslib/kstring.h>
 #include <htslib/sam.h>
-#include <htslib/faidx.h>
 #include "sam_header.h"
 #include "sam_opts.h"
 #include "samtools.h"
+#include "ref_cache.h"
 
 #define bam_reg2bin(b,e) hts_reg2bin((b),(e), 14, 5)
 
@@ -107,16 +107,16 @@ static int unpad_seq(bam1_t *b, kstring_t *s)
     return length != s->l;
 }
 
-int load_unpadded_ref(faidx_t *fai, char *ref_name, int ref_len, kstring_t *seq)
+int load_unpadded_ref(ref_cache_t *refs, char *ref_name, int ref_len, kstring_t *seq)
 {
     char base;
-    char *fai_ref = 0;
+    const char *fai_ref = 0;
     int fai_ref_len = 0, k;
 
-    fai_ref = fai_fetch(fai, ref_name, &fai_ref_len);
+    fai_ref = ref_cache_get(refs, ref_name, &fai_ref_len);
     if (fai_ref_len != ref_len) {
         fprintf(stderr, "[depad] ERROR: FASTA sequence %s length %i, expected %i\n", ref_name, fai_ref_len, ref_len);
-        free(fai_ref);
+        if (fai_ref) ref_cache_put(refs, ref_name);
         return -1;
     }
     ks_resize(seq, ref_len);
@@ -130,28 +130,28 @@ int load_unpadded_ref(faidx_t *fai, char *ref_name, int ref_len, kstring_t *seq)
             int i = seq_nt16_table[(int)base];
             if (i == 0 || i==16) { // Equals maps to 0, anything unexpected to 16
                 fprintf(stderr, "[depad] ERROR: Invalid character %c (ASCII %i) in FASTA sequence %s\n", base, (int)base, ref_name);
-                free(fai_ref);
+                ref_cache_put(refs, ref_name);
                 return -1;
             }
             seq->s[seq->l++] = i;
         }
     }
     assert(ref_len == seq->l);
-    free(fai_ref);
+    ref_cache_put(refs, ref_name);
     return 0;
 }
 
-int get_unpadded_len(faidx_t *fai, char *ref_name, int padded_len)
+int get_unpadded_len(ref_cache_t *refs, char *ref_name, int padded_len)
 {
     char base;
-    char *fai_ref = 0;
+    const char *fai_ref = 0;
     int fai_ref_len = 0, k;
     int bases=0, gaps=0;
 
-    fai_ref = fai_fetch(fai, ref_name, &fai_ref_len);
+    fai_ref = ref_cache_get(refs, ref_name, &fai_ref_len);
     if (fai_ref_len != padded_len) {
         fprintf(stderr, "[depad] ERROR: FASTA sequence '%s' length %i, expected %i\n", ref_name, fai_ref_len, padded_len);
-        free(fai_ref);
+        if (fai_ref) ref_cache_put(refs, ref_name);
         return -1;
     }
     for (k = 0; k < padded_len; ++k) {
@@ -163,13 +163,13 @@ int get_unpadded_len(faidx_t *fai, char *ref_name, int padded_len)
             int i = seq_nt16_table[(int)base];
             if (i == 0 || i==16) { // Equals maps to 0, anything unexpected to 16
                 fprintf(stderr, "[depad] ERROR: Invalid character %c (ASCII %i) in FASTA sequence '%s'\n", base, (int)base, ref_name);
-                free(fai_ref);
+                ref_cache_put(refs, ref_name);
                 return -1;
             }
             bases += 1;
         }
     }
-    free(fai_ref);
+    ref_cache_put(refs, ref_name);
     assert (padded_len == bases + gaps);
     return bases;
 }
@@ -185,7 +185,7 @@ static inline int * update_posmap(int *posmap, kstring_t ref)
     return posmap;
 }
 
-int bam_pad2unpad(samFile *in, samFile *out,  bam_hdr_t *h, faidx_t *fai)
+int bam_pad2unpad(samFile *in, samFile *out,  bam_hdr_t *h, ref_cache_t *refs)
 {
     bam1_t *b = 0;
     kstring_t r, q;
@@ -218,9 +218,9 @@ int bam_pad2unpad(samFile *in, samFile *out,  bam_hdr_t *h, faidx_t *fai)
                 fprintf(stderr, "[depad] ERROR: (Padded) length of '%s' is %u in BAM header, but %llu in embedded reference\n", bam_get_qname(b), h->target_len[r_tid], (unsigned long long)(r.l));
                 return -1;
             }
-            if (fai) {
+            if (refs) {
                 // Check the embedded reference matches the FASTA file
-                if (load_unpadded_ref(fai, h->target_name[b->core.tid], h->target_len[b->core.tid], &q)) {
+                if (load_unpadded_ref(refs, h->target_name[b->core.tid], h->target_len[b->core.tid], &q)) {
                     fprintf(stderr, "[depad] ERROR: Failed to load embedded reference '%s' from FASTA\n", h->target_name[b->core.tid]);
                     return -1;
                 }
@@ -248,8 +248,8 @@ int bam_pad2unpad(samFile *in, samFile *out,  bam_hdr_t *h, faidx_t *fai)
             } else if (b->core.tid == r_tid) {
                 ; // good case, reference available
                 //fprintf(stderr, "[depad] Have ref '%s' for read '%s'\n", h->target_name[b->core.tid], bam_get_qname(b));
-            } else if (fai) {
-                if (load_unpadded_ref(fai, h->target_name[b->core.tid], h->target_len[b->core.tid], &r)) {
+            } else if (refs) {
+                if (load_unpadded_ref(refs, h->target_name[b->core.tid], h->target_len[b->core.tid], &r)) {
                     fprintf(stderr, "[depad] ERROR: Failed to load '%s' from reference FASTA\n", h->target_name[b->core.tid]);
                     return -1;
                 }
@@ -342,19 +342,19 @@ int bam_pad2unpad(samFile *in, samFile *out,  bam_hdr_t *h, faidx_t *fai)
         } else {
             /* Nasty case, Must load alternative posmap */
             // fprintf(stderr, "[depad] Loading reference '%s' temporarily\n", h->target_name[b->core.mtid]);
-            if (!fai) {
+            if (!refs) {
                 fprintf(stderr, "[depad] ERROR: Needed reference %s sequence for mate (and no FASTA file)\n", h->target_name[b->core.mtid]);
                 return -1;
             }
             /* Temporarily load the other reference sequence */
-            if (load_unpadded_ref(fai, h->target_name[b->core.mtid], h->target_len[b->core.mtid], &r)) {
+            if (load_unpadded_ref(refs, h->target_name[b->core.mtid], h->target_len[b->core.mtid], &r)) {
                 fprintf(stderr, "[depad] ERROR: Failed to load '%s' from reference FASTA\n", h->target_name[b->core.mtid]);
                 return -1;
             }
             posmap = update_posmap(posmap, r);
             b->core.mpos = posmap[b->core.mpos];
             /* Restore the reference and posmap*/
-            if (load_unpadded_ref(fai, h->target_name[b->core.tid], h->target_len[b->core.tid], &r)) {
+            if (load_unpadded_ref(refs, h->target_name[b->core.tid], h->target_len[b->core.tid], &r)) {
                 fprintf(stderr, "[depad] ERROR: Failed to load '%s' from reference FASTA\n", h->target_name[b->core.tid]);
                 return -1;
             }
@@ -378,14 +378,14 @@ int bam_pad2unpad(samFile *in, samFile *out,  bam_hdr_t *h, faidx_t *fai)
     return ret;
 }
 
-bam_hdr_t * fix_header(bam_hdr_t *old, faidx_t *fai)
+bam_hdr_t * fix_header(bam_hdr_t *old, ref_cache_t *refs)
 {
     int i = 0, unpadded_len = 0;
     bam_hdr_t *header = 0 ;
 
     header = bam_hdr_dup(old);
     for (i = 0; i < old->n_targets; ++i) {
-        unpadded_len = get_unpadded_len(fai, old->target_name[i], old->target_len[i]);
+        unpadded_len = get_unpadded_len(refs, old->target_name[i], old->target_len[i]);
         if (unpadded_len < 0) {
             fprintf(stderr, "[depad] ERROR getting unpadded length of '%s', padded length %i\n", old->target_name[i], old->target_len[i]);
         } else {
@@ -484,7 +484,7 @@ int main_pad2unpad(int argc, char *argv[])
 {
     samFile *in = 0, *out = 0;
     bam_hdr_t *h = 0, *h_fix = 0;
-    faidx_t *fai = 0;
+    ref_cache_t *refs = 0;
     int c, compress_level = -1, is_long_help = 0;
     char in_mode[5], out_mode[6], *fn_out = 0, *fn_list = 0;
     int ret=0;
@@ -531,7 +531,7 @@ int main_pad2unpad(int argc, char *argv[])
     // Load FASTA reference (also needed for SAM -> BAM if missing header)
     if (ga.reference) {
         fn_list = samfaipath(ga.reference);
-        fai = fai_load(ga.reference);
+        refs = ref_cache_open(ga.reference);
     }
     // open file handlers
     if ((in = sam_open_format(argv[optind], in_mode, &ga.in)) == 0) {
@@ -549,8 +549,8 @@ int main_pad2unpad(int argc, char *argv[])
         ret = 1;
         goto depad_end;
     }
-    if (fai) {
-        h_fix = fix_header(h, fai);
+    if (refs) {
+        h_fix = fix_header(h, refs);
     } else {
         fprintf(stderr, "[depad] Warning - reference lengths will not be corrected without FASTA reference\n");
         h_fix = h;
@@ -575,11 +575,11 @@ int main_pad2unpad(int argc, char *argv[])
     }
 
     // Do the depad
-    if (bam_pad2unpad(in, out, h, fai) != 0) ret = 1;
+    if (bam_pad2unpad(in, out, h, refs) != 0) ret = 1;
 
 depad_end:
     // close files, free and return
-    if (fai) fai_destroy(fai);
+    ref_cache_close(refs);
     if (h) bam_hdr_destroy(h);
     if (in) sam_close(in);
     if (out && sam_close(out) < 0) {
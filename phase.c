@@ -704,7 +704,10 @@ int main_phase(int argc, char *argv[])
             bases[k++] = q<<5 | (int)bam_is_rev(p->b)<<4 | b;
         }
         if (k == 0) continue;
-        errmod_cal(em, k, 4, bases, q); // compute genotype likelihood
+        if (errmod_cal(em, k, 4, bases, q) < 0) { // compute genotype likelihood
+            fprintf(stderr, "[%s] failed to allocate memory\n", __func__);
+            return 1;
+        }
         c = gl2cns(q); // get the consensus
         // tell if to proceed
         if (set && (g.flag&FLAG_LIST_EXCL) && !in_set) continue; // not in the list
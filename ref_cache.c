@@ -0,0 +1,312 @@
+/*  ref_cache.c -- reference sequences shared between threads and uses.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "htslib/hts.h"
+#include "htslib/faidx.h"
+#include "htslib/khash_str2int.h"
+#include "ref_cache.h"
+
+// Bytes of copied sequences kept after their last user releases them
+#define REF_CACHE_IDLE (512 << 20)
+
+enum { REF_UNLOADED, REF_LOADING, REF_LOADED };
+
+typedef struct {
+    char *name;
+    int64_t offset;         // of the first base in the file
+    int len, line_blen, line_len;
+    int state, n_users;
+    const char *seq;        // the bases, once loaded
+    int in_place;           // seq points into the mapped file
+    int prev, next;         // idle list links
+} ref_seq_t;
+
+struct ref_cache_t {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    int n_refs;
+    faidx_t *fai;           // for files that can't be mapped
+    pthread_mutex_t fai_lock;
+    char *map;
+    size_t map_len;
+    void *names;            // name -> index into seq
+    int n_seq;
+    ref_seq_t *seq;
+    int idle_head, idle_tail; // unused copies, least recently used first
+    int64_t idle_bytes;
+};
+
+// Reads the sequence locations from fn's .fai index
+static int ref_cache_index(ref_cache_t *rc, const char *fn)
+{
+    char *fai_fn = malloc(strlen(fn) + 5), **lines;
+    int i, n_lines;
+
+    if (fai_fn == NULL) return -1;
+    sprintf(fai_fn, "%s.fai", fn);
+    lines = hts_readlines(fai_fn, &n_lines);
+    free(fai_fn);
+    if (lines == NULL) return -1;
+    rc->seq = calloc(n_lines? n_lines : 1, sizeof(ref_seq_t));
+    rc->names = khash_str2int_init();
+    for (i = 0; i < n_lines; ++i) {
+        ref_seq_t *s = &rc->seq[rc->n_seq];
+        char *tab = strchr(lines[i], '\t');
+        long long offset;
+        if (tab == NULL) { free(lines[i]); continue; }
+        *tab = '\0';
+        if (sscanf(tab + 1, "%d\t%lld\t%d\t%d", &s->len, &offset, &s->line_blen, &s->line_len) != 4
+            || khash_str2int_has_key(rc->names, lines[i])) {
+            free(lines[i]);
+            continue;
+        }
+        s->name = lines[i];
+        s->offset = offset;
+        s->prev = s->next = -1;
+        khash_str2int_set(rc->names, s->name, rc->n_seq++);
+    }
+    free(lines);
+    return 0;
+}
+
+// Maps fn into memory, unless it is compressed
+static void ref_cache_map(ref_cache_t *rc, const char *fn)
+{
+#ifndef _WIN32
+    struct stat st;
+    unsigned char magic[2];
+    void *map;
+    int fd = open(fn, O_RDONLY);
+
+    if (fd < 0) return;
+    if (fstat(fd, &st) < 0 || st.st_size < 2 || (uint64_t)st.st_size > SIZE_MAX
+        || read(fd, magic, 2) != 2 || (magic[0] == 0x1f && magic[1] == 0x8b)) {
+        close(fd);
+        return;
+    }
+    // The mapping is private so that a terminating NUL can be written
+    // after a sequence without touching the file
+    map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    rc->map = map;
+    rc->map_len = st.st_size;
+#endif
+}
+
+ref_cache_t *ref_cache_open(const char *fn)
+{
+    ref_cache_t *rc = calloc(1, sizeof(ref_cache_t));
+
+    if (rc == NULL) return NULL;
+    // fai_load() builds the index if need be, and checks the file can be used
+    if ((rc->fai = fai_load(fn)) == NULL) goto fail;
+    if (ref_cache_index(rc, fn) < 0) goto fail;
+    ref_cache_map(rc, fn);
+    if (rc->map) {
+        fai_destroy(rc->fai);
+        rc->fai = NULL;
+    }
+    pthread_mutex_init(&rc->lock, NULL);
+    pthread_cond_init(&rc->loaded, NULL);
+    pthread_mutex_init(&rc->fai_lock, NULL);
+    rc->n_refs = 1;
+    rc->idle_head = rc->idle_tail = -1;
+    return rc;
+
+ fail:
+    if (rc->fai) fai_destroy(rc->fai);
+    free(rc);
+    return NULL;
+}
+
+ref_cache_t *ref_cache_dup(ref_cache_t *rc)
+{
+    pthread_mutex_lock(&rc->lock);
+    rc->n_refs++;
+    pthread_mutex_unlock(&rc->lock);
+    return rc;
+}
+
+void ref_cache_close(ref_cache_t *rc)
+{
+    int i, n_refs;
+
+    if (rc == NULL) return;
+    pthread_mutex_lock(&rc->lock);
+    n_refs = --rc->n_refs;
+    pthread_mutex_unlock(&rc->lock);
+    if (n_refs > 0) return;
+
+    for (i = 0; i < rc->n_seq; ++i) {
+        if (!rc->seq[i].in_place) free((char*)rc->seq[i].seq);
+        free(rc->seq[i].name);
+    }
+    free(rc->seq);
+    if (rc->names) khash_str2int_destroy(rc->names);
+#ifndef _WIN32
+    if (rc->map) munmap(rc->map, rc->map_len);
+#endif
+    if (rc->fai) fai_destroy(rc->fai);
+    pthread_mutex_destroy(&rc->fai_lock);
+    pthread_cond_destroy(&rc->loaded);
+    pthread_mutex_destroy(&rc->lock);
+    free(rc);
+}
+
+int ref_cache_seq_len(const ref_cache_t *rc, const char *name)
+{
+    int i;
+    if (khash_str2int_get(rc->names, name, &i) < 0) return -1;
+    return rc->seq[i].len;
+}
+
+/*
+ * Loads sequence s, which no other thread will touch until its state is
+ * changed, without holding the lock.  Returns 0 on success, -1 on failure.
+ */
+static int ref_cache_load(ref_cache_t *rc, ref_seq_t *s)
+{
+    int len;
+    char *seq;
+
+    if (rc->map) {
+        int64_t l, pos, end;
+        if (s->len < 0 || s->line_blen <= 0 || s->line_len < s->line_blen
+            || s->offset < 0 || s->offset > (int64_t)rc->map_len) return -1;
+        // A sequence on one line is used where it is, provided there is a
+        // line terminator after it to make way for the NUL
+        end = s->offset + s->len;
+        if (s->len <= s->line_blen && end < (int64_t)rc->map_len
+            && (rc->map[end] == '\n' || rc->map[end] == '\r')) {
+            rc->map[end] = '\0';
+            s->seq = rc->map + s->offset;
+            s->in_place = 1;
+            return 0;
+        }
+        if ((seq = malloc((size_t)s->len + 1)) == NULL) return -1;
+        for (l = 0, pos = s->offset; l < s->len; l += len, pos += s->line_len) {
+            len = s->len - l < s->line_blen? s->len - l : s->line_blen;
+            if (pos + len > (int64_t)rc->map_len) {
+                free(seq);
+                return -1;
+            }
+            memcpy(seq + l, rc->map + pos, len);
+        }
+        seq[s->len] = '\0';
+    } else {
+        pthread_mutex_lock(&rc->fai_lock);
+        seq = faidx_fetch_seq(rc->fai, s->name, 0, INT_MAX, &len);
+        pthread_mutex_unlock(&rc->fai_lock);
+        if (seq == NULL) return -1;
+        s->len = len;
+    }
+    s->seq = seq;
+    s->in_place = 0;
+    return 0;
+}
+
+static void idle_unlink(ref_cache_t *rc, int i)
+{
+    ref_seq_t *s = &rc->seq[i];
+    if (s->prev >= 0) rc->seq[s->prev].next = s->next;
+    else rc->idle_head = s->next;
+    if (s->next >= 0) rc->seq[s->next].prev = s->prev;
+    else rc->idle_tail = s->prev;
+    s->prev = s->next = -1;
+    rc->idle_bytes -= s->len + 1;
+}
+
+const char *ref_cache_get(ref_cache_t *rc, const char *name, int *len)
+{
+    ref_seq_t *s;
+    const char *seq;
+    int i;
+
+    if (khash_str2int_get(rc->names, name, &i) < 0) return NULL;
+    s = &rc->seq[i];
+    pthread_mutex_lock(&rc->lock);
+    while (s->state != REF_LOADED) {
+        if (s->state == REF_LOADING) {
+            pthread_cond_wait(&rc->loaded, &rc->lock);
+            continue;
+        }
+        s->state = REF_LOADING;
+        pthread_mutex_unlock(&rc->lock);
+        i = ref_cache_load(rc, s);
+        pthread_mutex_lock(&rc->lock);
+        s->state = i < 0? REF_UNLOADED : REF_LOADED;
+        pthread_cond_broadcast(&rc->loaded);
+        if (i < 0) {
+            pthread_mutex_unlock(&rc->lock);
+            return NULL;
+        }
+    }
+    if (s->n_users++ == 0 && !s->in_place && (s->prev >= 0 || rc->idle_head == s - rc->seq))
+        idle_unlink(rc, s - rc->seq);
+    seq = s->seq;
+    *len = s->len;
+    pthread_mutex_unlock(&rc->lock);
+    return seq;
+}
+
+void ref_cache_put(ref_cache_t *rc, const char *name)
+{
+    ref_seq_t *s;
+    int i;
+
+    if (khash_str2int_get(rc->names, name, &i) < 0) return;
+    s = &rc->seq[i];
+    pthread_mutex_lock(&rc->lock);
+    if (s->n_users > 0 && --s->n_users == 0 && !s->in_place) {
+        // Keep the copy, dropping the least recently used ones over the limit
+        s->prev = rc->idle_tail;
+        if (rc->idle_tail >= 0) rc->seq[rc->idle_tail].next = i;
+        else rc->idle_head = i;
+        rc->idle_tail = i;
+        rc->idle_bytes += s->len + 1;
+        while (rc->idle_bytes > REF_CACHE_IDLE) {
+            ref_seq_t *old = &rc->seq[rc->idle_head];
+            idle_unlink(rc, rc->idle_head);
+            free((char*)old->seq);
+            old->seq = NULL;
+            old->state = REF_UNLOADED;
+        }
+    }
+    pthread_mutex_unlock(&rc->lock);
+}
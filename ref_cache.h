@@ -0,0 +1,64 @@
+/*  ref_cache.h -- reference sequences shared between threads and uses.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef REF_CACHE_H
+#define REF_CACHE_H
+
+/*
+ * A reference cache loads each sequence of a faidx-indexed FASTA file
+ * once, however many threads or records want it, and hands out pointers
+ * into its own copy rather than a fresh one each time.  Uncompressed files
+ * are mapped into memory, and a sequence held on a single line is used in
+ * place; others are copied out of the mapping once.  bgzip-compressed
+ * files are read through faidx.  Sequences no longer in use are kept, up
+ * to a limit, in case they are wanted again.
+ *
+ * All functions may be called from several threads at once.
+ */
+typedef struct ref_cache_t ref_cache_t;
+
+/*
+ * Opens the FASTA file fn, building its index if there is none.  Returns
+ * NULL on failure.
+ */
+ref_cache_t *ref_cache_open(const char *fn);
+
+/*
+ * Returns rc with one more reference to it, for a user that will close
+ * it independently.  The cache is freed when the last reference is closed.
+ */
+ref_cache_t *ref_cache_dup(ref_cache_t *rc);
+void ref_cache_close(ref_cache_t *rc);
+
+// Returns the length of sequence name, or -1 if there is no such sequence
+int ref_cache_seq_len(const ref_cache_t *rc, const char *name);
+
+/*
+ * Returns sequence name as a NUL-terminated string, setting *len to its
+ * length, or NULL if it is absent or can't be read.  The string is shared
+ * and must not be changed.  It stays valid until released by a matching
+ * call to ref_cache_put().
+ */
+const char *ref_cache_get(ref_cache_t *rc, const char *name, int *len);
+void ref_cache_put(ref_cache_t *rc, const char *name);
+
+#endif
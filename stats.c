@@ -50,7 +50,6 @@ DEALINGS IN THE SOFTWARE.  */
 #include <errno.h>
 #include <assert.h>
 #include <zlib.h>   // for crc32
-#include <htslib/faidx.h>
 #include <htslib/sam.h>
 #include <htslib/hts.h>
 #include "sam_header.h"
@@ -60,6 +59,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/kstring.h>
 #include "stats_isize.h"
 #include "sam_opts.h"
+#include "ref_cache.h"
 
 #define BWA_MIN_RDLEN 35
 // From the spec
@@ -117,7 +117,7 @@ typedef struct
 {
     // Auxiliary data
     int flag_require, flag_filter;
-    faidx_t *fai;                   // Reference sequence for GC-depth graph
+    ref_cache_t *refs;              // Reference sequence for GC-depth graph
     int argc;                       // Command line arguments to be printed on the output
     char **argv;
     int gcd_bin_size;           // The size of GC-depth bin
@@ -199,6 +199,8 @@ typedef struct
     int mrseq_buf;                  // The size of the buffer
     int32_t rseq_pos;               // The coordinate of the first base in the buffer
     int32_t nrseq_buf;              // The used part of the buffer
+    const char *ref;                // The whole reference sequence held from info->refs
+    int32_t ref_tid, ref_len;
     uint64_t *mpc_buf;              // Mismatches per cycle
 
     // Target regions
@@ -476,8 +478,19 @@ void count_mismatches_per_cycle(stats_t *stats, bam1_t *bam_line, int read_len)
 void read_ref_seq(stats_t *stats, int32_t tid, int32_t pos)
 {
     int i, fai_ref_len;
-    char *fai_ref = faidx_fetch_seq(stats->info->fai, stats->info->sam_header->target_name[tid], pos, pos+stats->mrseq_buf-1, &fai_ref_len);
-    if ( fai_ref_len<0 ) error("Failed to fetch the sequence \"%s\"\n", stats->info->sam_header->target_name[tid]);
+    const char *fai_ref;
+    if ( stats->ref_tid!=tid )
+    {
+        char **names = stats->info->sam_header->target_name;
+        if ( stats->ref ) ref_cache_put(stats->info->refs, names[stats->ref_tid]);
+        stats->ref = ref_cache_get(stats->info->refs, names[tid], &stats->ref_len);
+        if ( !stats->ref ) error("Failed to fetch the sequence \"%s\"\n", names[tid]);
+        stats->ref_tid = tid;
+    }
+    fai_ref = stats->ref + pos;
+    fai_ref_len = stats->ref_len - pos;
+    if ( fai_ref_len > stats->mrseq_buf ) fai_ref_len = stats->mrseq_buf;
+    if ( fai_ref_len < 0 ) fai_ref_len = 0;
 
     uint8_t *ptr = stats->rseq_buf;
     for (i=0; i<fai_ref_len; i++)
@@ -499,7 +512,6 @@ void read_ref_seq(stats_t *stats, int32_t tid, int32_t pos)
         }
         ptr++;
     }
-    free(fai_ref);
 
     if ( fai_ref_len < stats->mrseq_buf ) memset(ptr,0, stats->mrseq_buf - fai_ref_len);
     stats->nrseq_buf = fai_ref_len;
@@ -915,7 +927,7 @@ void collect_stats(bam1_t *bam_line, stats_t *stats)
         // Mismatches per cycle and GC-depth graph. For simplicity, reads overlapping GCD bins
         //  are not splitted which results in up to seq_len-1 overlaps. The default bin size is
         //  20kbp, so the effect is negligible.
-        if ( stats->info->fai )
+        if ( stats->info->refs )
         {
             int inc_ref = 0, inc_gcd = 0;
             // First pass or new chromosome
@@ -953,7 +965,7 @@ void collect_stats(bam1_t *bam_line, stats_t *stats)
         }
         stats->gcd[ stats->igcd ].depth++;
         // When no reference sequence is given, approximate the GC from the read (much shorter window, but otherwise OK)
-        if ( !stats->info->fai )
+        if ( !stats->info->refs )
             stats->gcd[ stats->igcd ].gc += (float) gc_count / seq_len;
 
         // Coverage distribution graph
@@ -1190,7 +1202,7 @@ void output_stats(FILE *to, stats_t *stats, int sparse)
     uint32_t igcd;
     for (igcd=0; igcd<stats->igcd; igcd++)
     {
-        if ( stats->info->fai )
+        if ( stats->info->refs )
             stats->gcd[igcd].gc = rint(100. * stats->gcd[igcd].gc);
         else
             if ( stats->gcd[igcd].depth )
@@ -1389,7 +1401,7 @@ static void error(const char *format, ...)
 }
 
 void cleanup_stats_info(stats_info_t* info){
-    if (info->fai) fai_destroy(info->fai);
+    ref_cache_close(info->refs);
     sam_close(info->sam);
     free(info);
 }
@@ -1403,6 +1415,7 @@ void cleanup_stats(stats_t* stats)
     free(stats->isize);
     free(stats->gcd);
     free(stats->rseq_buf);
+    if ( stats->ref ) ref_cache_put(stats->info->refs, stats->info->sam_header->target_name[stats->ref_tid]);
     free(stats->mpc_buf);
     free(stats->acgtno_cycles);
     free(stats->read_lengths);
@@ -1502,6 +1515,7 @@ stats_t* stats_init()
     stats->max_len   = 30;
     stats->max_qual  = 40;
     stats->rseq_pos     = -1;
+    stats->ref_tid      = -1;
     stats->tid = stats->gcd_pos = -1;
     stats->igcd = 0;
     stats->is_sorted = 1;
@@ -1539,7 +1553,7 @@ static void init_stat_structs(stats_t* stats, stats_info_t* info, const char* gr
     stats->gc_2nd         = calloc(stats->ngc,sizeof(uint64_t));
     stats->isize          = init_isize_t(info->nisize);
     stats->gcd            = calloc(stats->ngcd,sizeof(gc_depth_t));
-    stats->mpc_buf        = info->fai ? calloc(stats->nquals*stats->nbases,sizeof(uint64_t)) : NULL;
+    stats->mpc_buf        = info->refs ? calloc(stats->nquals*stats->nbases,sizeof(uint64_t)) : NULL;
     stats->acgtno_cycles  = calloc(stats->nbases,sizeof(acgtno_count_t));
     stats->read_lengths   = calloc(stats->nbases,sizeof(uint64_t));
     stats->insertions     = calloc(stats->nbases,sizeof(uint64_t));
@@ -1626,8 +1640,8 @@ int main_stats(int argc, char *argv[])
             case 'F': info->flag_filter = bam_str2flag(optarg); break;
             case 'd': info->flag_filter |= BAM_FDUP; break;
             case 's': break;
-            case 'r': info->fai = fai_load(optarg);
-                      if (info->fai==NULL)
+            case 'r': info->refs = ref_cache_open(optarg);
+                      if (info->refs==NULL)
                           error("Could not load faidx: %s\n", optarg);
                       break;
             case  1 : info->gcd_bin_size = atof(optarg); break;
@@ -1719,12 +1733,12 @@ int main_stats(int argc, char *argv[])
         output_split_stats(split_hash, bam_fname, sparse);
 
     bam_destroy1(bam_line);
-    bam_hdr_destroy(info->sam_header);
     sam_global_args_free(&ga);
 
     cleanup_stats(all_stats);
-    cleanup_stats_info(info);
     destroy_split_stats(split_hash);
+    bam_hdr_destroy(info->sam_header);
+    cleanup_stats_info(info);
 
     return 0;
 }
@@ -48,7 +48,9 @@ test_merge($opts);
 test_sort($opts);
 test_fixmate($opts);
 test_calmd($opts);
+test_flagstat($opts);
 test_idxstat($opts);
+test_bedcov($opts);
 test_quickcheck($opts);
 test_reheader($opts);
 test_addrprg($opts);
@@ -496,6 +498,32 @@ sub test_index
     test_cmd($opts,out=>'dat/large_chrom.out',cmd=>"$$opts{bin}/samtools view $$opts{tmp}/large_chrom.bam ref2");
     test_cmd($opts,out=>'dat/large_chrom.out',cmd=>"$$opts{bin}/samtools view $$opts{tmp}/large_chrom.bam ref2:1-541556283");
     test_cmd($opts,out=>'dat/test_input_1_a.bam.bai.expected',cmd=>"$$opts{bin}/samtools index $$opts{path}/dat/test_input_1_a.bam && cat $$opts{path}/dat/test_input_1_a.bam.bai");
+
+    # Multi-threaded indexing must give exactly the same index
+    test_cmd($opts,out=>'dat/test_input_1_a.bam.bai.expected',cmd=>"$$opts{bin}/samtools index -@ 2 $$opts{path}/dat/test_input_1_a.bam $$opts{tmp}/test_input_1_a.bam.bai && cat $$opts{tmp}/test_input_1_a.bam.bai");
+    cmd("$$opts{bin}/samtools index -@ 2 -c $$opts{tmp}/large_chrom.bam");
+    test_cmd($opts,out=>'dat/large_chrom.out',cmd=>"$$opts{bin}/samtools view $$opts{tmp}/large_chrom.bam ref2");
+    cmd("cp $$opts{path}/dat/test_input_1_a.bam $$opts{tmp}/index_M_1.bam && cp $$opts{path}/dat/test_input_1_a.bam $$opts{tmp}/index_M_2.bam");
+    test_cmd($opts,out=>'dat/test_input_1_a.bam.bai.expected',cmd=>"$$opts{bin}/samtools index -M -@ 1 $$opts{tmp}/index_M_1.bam $$opts{tmp}/index_M_2.bam && cat $$opts{tmp}/index_M_2.bam.bai");
+
+    # --tee copies the stream unchanged and indexes it on the way through
+    test_cmd($opts,out=>'dat/test_input_1_a.bam.bai.expected',cmd=>"cat $$opts{path}/dat/test_input_1_a.bam | $$opts{bin}/samtools index --tee -o $$opts{tmp}/index_tee.bam && cmp $$opts{path}/dat/test_input_1_a.bam $$opts{tmp}/index_tee.bam && cat $$opts{tmp}/index_tee.bam.bai");
+    test_cmd($opts,out=>'dat/test_input_1_a.bam.bai.expected',cmd=>"$$opts{bin}/samtools index --tee -@ 2 -o $$opts{tmp}/index_tee2.bam $$opts{path}/dat/test_input_1_a.bam $$opts{tmp}/index_tee2.bai && cmp $$opts{path}/dat/test_input_1_a.bam $$opts{tmp}/index_tee2.bam && cat $$opts{tmp}/index_tee2.bai");
+
+    # The last record is placed, so the index records where the file ends.
+    # The doubled file has an EOF block part way through, where reading stops.
+    cmd("$$opts{bin}/samtools view -b $$opts{path}/dat/mpileup.1.sam > $$opts{tmp}/index_placed.bam");
+    cmd("cat $$opts{tmp}/index_placed.bam $$opts{tmp}/index_placed.bam > $$opts{tmp}/index_twice.bam");
+    my $scan = gen_scan_files($opts);
+    for my $bam ("$$opts{tmp}/index_placed.bam", "$$opts{tmp}/index_twice.bam", "$scan.bam")
+    {
+        for my $csi ('', '-c')
+        {
+            cmd("$$opts{bin}/samtools index $csi $bam $bam.st$csi.idx");
+            test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools index $csi -@ 2 $bam $bam.mt$csi.idx && cmp $bam.st$csi.idx $bam.mt$csi.idx");
+        }
+    }
+    test_cmd($opts,out=>'dat/empty.expected',cmd=>"$$opts{bin}/samtools index --tee -@ 2 -o $$opts{tmp}/index_tee3.bam $$opts{tmp}/index_twice.bam $$opts{tmp}/index_tee3.bai && cmp $$opts{tmp}/index_twice.bam $$opts{tmp}/index_tee3.bam && cmp $$opts{tmp}/index_twice.bam.st.idx $$opts{tmp}/index_tee3.bai");
 }
 
 sub test_mpileup
@@ -533,6 +561,84 @@ sub test_mpileup
     # test that filter mask replaces (not just adds to) default mask
     test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.bam | grep -v mpileup");
     test_cmd($opts,out=>'dat/mpileup.out.3',cmd=>"$$opts{bin}/samtools mpileup -B --ff 0x14 -f $$opts{tmp}/mpileup.ref.fa.gz -r17:1050-1060 $$opts{tmp}/mpileup.1.cram | grep -v mpileup");
+
+    # With -@, chunk boundaries in a region deeper than -d, with an indel
+    # crossing them, must not change which reads the pileup drops
+    my $deep = gen_deep_files($opts);
+    for my $fmt ('bam','cram')
+    {
+        cmd("$$opts{bin}/samtools index $deep.$fmt");
+    }
+    for my $args ('', '-B -Q0', "-l $deep.bed", '-r d1:1000-2500', "-uv -f $deep.fa")
+    {
+        cmd("$$opts{bin}/samtools mpileup $args $deep.bam 2>/dev/null | grep -v ^## > $deep.mpileup");
+        for my $fmt ('bam','cram')
+        {
+            test_cmd($opts,out=>'dat/empty.expected', cmd=>"SAMTOOLS_MPILEUP_CHUNK=100 $$opts{bin}/samtools mpileup -@ 3 $args $deep.$fmt 2>/dev/null | grep -v ^## | diff $deep.mpileup -");
+        }
+    }
+}
+
+# A reference with 40 samples, each of whose depth limit is the default
+# 250, and more than 250 reads over d1:800-1300, which has a deletion at
+# 1000.  There is an insertion at 2400 where the depth is low.
+sub gen_deep_files
+{
+    my ($opts) = @_;
+    my $fn = "$$opts{tmp}/deep";
+
+    srand(7);
+    my @bases = ('A','C','G','T');
+    my $ref = join('', map { $bases[int(rand(4))] } 1..3000);
+    open(my $fa,'>',"$fn.fa") or error("$fn.fa: $!");
+    print $fa ">d1\n";
+    for (my $i=0; $i<length($ref); $i+=60) { print $fa substr($ref,$i,60), "\n"; }
+    close($fa);
+    cmd("$$opts{bin}/samtools faidx $fn.fa");
+
+    open(my $bed,'>',"$fn.bed") or error("$fn.bed: $!");
+    print $bed "d1\t850\t1020\nd1\t1100\t1200\nd1\t1950\t2450\n";
+    close($bed);
+
+    open(my $fh,'>',"$fn.sam") or error("$fn.sam: $!");
+    print $fh "\@HD\tVN:1.4\tSO:coordinate\n\@SQ\tSN:d1\tLN:3000\tUR:$fn.fa\n";
+    for (my $i=0; $i<40; $i++) { print $fh "\@RG\tID:g$i\tSM:s$i\n"; }
+    my $n = 0;
+    for (my $pos=100; $pos<2800; $pos++)
+    {
+        my $k = ($pos>=800 && $pos<1300) ? 6+int(rand(5)) : (rand() < 0.4 ? 1 : 0);
+        for (my $j=0; $j<$k; $j++)
+        {
+            my ($cigar, $seq);
+            if ( $pos>960 && $pos<995 && rand() < 0.5 )
+            {
+                my $m = 1000 - $pos;
+                $cigar = "${m}M3D".(50-$m)."M";
+                $seq = substr($ref,$pos,$m).substr($ref,1003,50-$m);
+            }
+            elsif ( $pos>2360 && $pos<2395 && rand() < 0.5 )
+            {
+                my $m = 2400 - $pos;
+                $cigar = "${m}M2I".(48-$m)."M";
+                $seq = substr($ref,$pos,$m).'TT'.substr($ref,2400,48-$m);
+            }
+            else
+            {
+                $cigar = '50M';
+                $seq = substr($ref,$pos,50);
+                if ( rand() < 0.1 ) { substr($seq,25,1) = $bases[int(rand(4))]; }
+            }
+            my $qual = join('', map { chr(43+int(rand(30))) } 1..50);
+            my $flag = rand() < 0.5 ? 0 : 16;
+            $n++;
+            print $fh "r$n\t$flag\td1\t".($pos+1)."\t60\t$cigar\t*\t0\t0\t$seq\t$qual\tRG:Z:g".int(rand(40))."\n";
+        }
+    }
+    close($fh);
+
+    cmd("$$opts{bin}/samtools view -b $fn.sam > $fn.bam");
+    cmd("$$opts{bin}/samtools view -C -T $fn.fa $fn.sam > $fn.cram");
+    return $fn;
 }
 
 sub test_usage
@@ -2360,6 +2466,87 @@ sub test_calmd
     my $out = cmd($test);
     if (substr($out, 0, 2) eq "\x1f\x8b") { passed($opts,msg=>$test); }
     else { failed($opts,msg=>$test,reason=>"Expected BGZF-compressed output"); }
+
+    # BAQ, recomputed after dropping the BQ tags the input already has
+    my $sam = "perl -pe 's/\\tBQ:Z:\\S+//' $$opts{path}/dat/mpileup.1.sam";
+    my $tag = "perl -ne 'print \"\$1\\t\$2\\n\" if /^(\\S+)\\t.*\\t([BZ]Q:Z:\\S+)/'";
+    test_cmd($opts,out=>'dat/calmd.BQ.out',cmd=>"$sam | $$opts{bin}/samtools calmd -r - $$opts{path}/dat/mpileup.ref.fa 2>/dev/null | $tag");
+    test_cmd($opts,out=>'dat/calmd.ZQ.out',cmd=>"$sam | $$opts{bin}/samtools calmd -AEr - $$opts{path}/dat/mpileup.ref.fa 2>/dev/null | $tag");
+}
+
+# Writes a sorted SAM file large enough to span many BGZF blocks and CRAM
+# containers, and makes BAM and CRAM copies of it.  With a small
+# SAMTOOLS_SCAN_MIN_CHUNK, commands that split their input then use several
+# chunks.  One read is longer than a BGZF block, so some blocks hold no
+# record start.
+sub gen_scan_files
+{
+    my ($opts) = @_;
+    my $fn = "$$opts{tmp}/scan";
+    if ( $$opts{scan_files} ) { return $fn; }
+
+    srand(15);
+    my @bases = ('A','C','G','T');
+    my $ref = join('', map { $bases[int(rand(4))] } 1..200000);
+    open(my $fa,'>',"$fn.fa") or error("$fn.fa: $!");
+    for my $chr ('c1','c2')
+    {
+        print $fa ">$chr\n";
+        for (my $i=0; $i<length($ref); $i+=60) { print $fa substr($ref,$i,60), "\n"; }
+    }
+    close($fa);
+
+    open(my $fh,'>',"$fn.sam") or error("$fn.sam: $!");
+    print $fh "\@HD\tVN:1.4\tSO:coordinate\n\@SQ\tSN:c1\tLN:200000\tUR:$fn.fa\n\@SQ\tSN:c2\tLN:200000\tUR:$fn.fa\n";
+    for my $chr ('c1','c2')
+    {
+        for (my $i=0; $i<2000; $i++)
+        {
+            my $pos  = 1 + $i*90;
+            my $flag = ($i%2 ? 16 : 0) | ($i%11==3 ? 1024 : 0) | ($i%13==5 ? 512 : 0);
+            my $qual = join('', map { chr(35+int(rand(40))) } 1..100);
+            print $fh "$chr.$i\t$flag\t$chr\t$pos\t".($i%7*9)."\t100M\t*\t0\t0\t".substr($ref,$pos-1,100)."\t$qual\n";
+            if ( $chr eq 'c1' && $i==1000 )
+            {
+                print $fh "$chr.long\t0\t$chr\t$pos\t60\t100000M\t*\t0\t0\t".substr($ref,$pos-1,100000)."\t*\n";
+            }
+        }
+    }
+    for (my $i=0; $i<300; $i++)
+    {
+        my $seq  = join('', map { $bases[int(rand(4))] } 1..100);
+        my $qual = join('', map { chr(35+int(rand(40))) } 1..100);
+        print $fh "u.$i\t4\t*\t0\t0\t*\t*\t0\t0\t$seq\t$qual\n";
+    }
+    close($fh);
+
+    cmd("$$opts{bin}/samtools view -b $fn.sam > $fn.bam");
+    cmd("$$opts{bin}/samtools view -C -T $fn.fa --output-fmt-option seqs_per_slice=100 $fn.sam > $fn.cram");
+    $$opts{scan_files} = 1;
+    return $fn;
+}
+
+sub test_flagstat
+{
+    my ($opts,%args) = @_;
+
+    test_cmd($opts,out=>'flagstat/test_input_1_a.bam.expected', cmd=>"$$opts{bin}/samtools flagstat $$opts{path}/dat/test_input_1_a.bam");
+    test_cmd($opts,out=>'flagstat/test_input_1_a.bam.expected', cmd=>"$$opts{bin}/samtools flagstat -@ 2 $$opts{path}/dat/test_input_1_a.bam");
+    test_cmd($opts,out=>'flagstat/test_input_1_a.bam.expected', cmd=>"$$opts{bin}/samtools flagstat -@ 2 $$opts{path}/dat/test_input_1_a.sam");
+
+    # Several files, one given on the command line and one in a list
+    my ($fofn_fh, $fofn) = tempfile(UNLINK => 1);
+    print $fofn_fh "$$opts{path}/dat/test_input_1_a.bam\n";
+    close($fofn_fh);
+    test_cmd($opts,out=>'flagstat/1_ab.tsv.expected', cmd=>"$$opts{bin}/samtools flagstat -@ 2 -b $fofn $$opts{path}/dat/test_input_1_b.bam | sed 's,.*/dat/,,'");
+
+    # Force many small chunks, which must add up to what a serial scan gives
+    my $scan = gen_scan_files($opts);
+    for my $fmt ('bam','cram')
+    {
+        cmd("$$opts{bin}/samtools flagstat $scan.$fmt > $scan.$fmt.flagstat");
+        test_cmd($opts,out=>'dat/empty.expected', cmd=>"SAMTOOLS_SCAN_MIN_CHUNK=4096 $$opts{bin}/samtools flagstat -@ 4 $scan.$fmt | diff $scan.$fmt.flagstat -");
+    }
 }
 
 sub test_idxstat
@@ -2367,6 +2554,78 @@ sub test_idxstat
     my ($opts,%args) = @_;
 
     test_cmd($opts,out=>'idxstats/test_input_1_a.bam.expected', err=>'idxstats/test_input_1_a.bam.expected.err', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/dat/test_input_1_a.bam", expect_fail=>0);
+    test_cmd($opts,out=>'idxstats/test_input_1_a.tsv.expected', cmd=>"$$opts{bin}/samtools idxstats -@ 2 $$opts{path}/dat/test_input_1_a.bam $$opts{path}/dat/test_input_1_a.bam | sed 's,.*/dat/,,'");
+    test_cmd($opts,out=>'idxstats/test_input_1_a.sum.expected', cmd=>"$$opts{bin}/samtools idxstats -s -@ 2 $$opts{path}/dat/test_input_1_a.bam $$opts{path}/dat/test_input_1_a.bam");
+
+    # CRAM counts come from the containers listed in the .crai, and must agree with BAM
+    test_cmd($opts,out=>'idxstats/ce#5b.expected', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/mpileup/ce#5b.bam");
+    test_cmd($opts,out=>'idxstats/ce#5b.expected', cmd=>"$$opts{bin}/samtools idxstats $$opts{path}/mpileup/ce#5b.cram");
+
+    # Unmapped reads placed next to their mates are counted as unmapped, as
+    # for BAM, unless --fast counts them from the container headers.  The
+    # files are those made by test_mpileup.
+    for my $i (1,2)
+    {
+        my $in = "$$opts{tmp}/mpileup.$i";
+        cmd("$$opts{bin}/samtools idxstats $in.bam > $in.idxstats");
+        cmd("awk '{print \$1,\$2,\$3+\$4}' $in.idxstats > $in.idxstats.all");
+        test_cmd($opts,out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools idxstats $in.cram | diff $in.idxstats -");
+        test_cmd($opts,out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools idxstats --fast $in.cram | awk '{print \$1,\$2,\$3+\$4}' | diff $in.idxstats.all -");
+    }
+}
+
+sub test_bedcov
+{
+    my ($opts,%args) = @_;
+
+    # The expected outputs come from the pileup-based bedcov of 1.3.1.  The
+    # BED file is unsorted, has overlapping and adjacent lines and a line on
+    # an unknown contig, and the counts must be printed in input order.  The
+    # BAMs and CRAMs are those made by test_mpileup.
+    my $bedfn = "$$opts{path}/bedcov/bedcov.bed";
+    my $ref = "$$opts{path}/dat/mpileup.ref.fa";
+    for my $fmt ('bam','cram')
+    {
+        my @in = map { "$$opts{tmp}/mpileup.$_.$fmt" } (1..3);
+        my $opt = $fmt eq 'cram' ? "--reference $ref" : '';
+        test_cmd($opts,out=>'bedcov/1.expected', cmd=>"$$opts{bin}/samtools bedcov $opt $bedfn $in[0]");
+        test_cmd($opts,out=>'bedcov/123.expected', cmd=>"$$opts{bin}/samtools bedcov $opt $bedfn @in");
+        test_cmd($opts,out=>'bedcov/123.Q30.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -Q 30 $bedfn @in");
+        test_cmd($opts,out=>'bedcov/123.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -@ 2 $bedfn @in");
+        test_cmd($opts,out=>'bedcov/123.Q30.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -@ 2 -Q 30 $bedfn @in");
+
+        # -c and -d add columns counted from the alignments, leaving the
+        # pileup's depth sums as they are
+        test_cmd($opts,out=>'bedcov/123.c.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -c $bedfn @in");
+        test_cmd($opts,out=>'bedcov/123.d10.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -d 10 $bedfn @in");
+        test_cmd($opts,out=>'bedcov/123.cd3.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -c -d 3 $bedfn @in");
+        test_cmd($opts,out=>'bedcov/123.cd3.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -@ 2 -c -d 3 $bedfn @in");
+    }
+
+    # Reads with deletions and reference skips, which count towards the depth
+    # sums as in a pileup but do not cover those bases for -d
+    cmd("$$opts{bin}/samtools view -b $$opts{path}/bedcov/spliced.sam > $$opts{tmp}/bedcov_spliced.bam");
+    cmd("$$opts{bin}/samtools index $$opts{tmp}/bedcov_spliced.bam");
+    test_cmd($opts,out=>'bedcov/spliced.expected', cmd=>"$$opts{bin}/samtools bedcov $$opts{path}/bedcov/spliced.bed $$opts{tmp}/bedcov_spliced.bam");
+    test_cmd($opts,out=>'bedcov/spliced.cd1.expected', cmd=>"$$opts{bin}/samtools bedcov -c -d 1 $$opts{path}/bedcov/spliced.bed $$opts{tmp}/bedcov_spliced.bam");
+
+    # Regions more than 64kb apart are split between threads, each of which
+    # must use its own index
+    my $scan = gen_scan_files($opts);
+    open(my $bed,'>',"$scan.bed") or error("$scan.bed: $!");
+    print $bed "c1\t1000\t1500\nc1\t100000\t100050\nc2\t50\t2000\nc1\t199000\t199990\nc2\t150000\t150100\nc1\t0\t200000\n";
+    close($bed);
+    cmd("$$opts{bin}/samtools index $scan.bam");
+    cmd("$$opts{bin}/samtools index $scan.cram");
+    for my $opt ('', '-c -d 2')
+    {
+        cmd("$$opts{bin}/samtools bedcov $opt $scan.bed $scan.bam > $scan.bedcov");
+        for my $fmt ('bam','cram')
+        {
+            test_cmd($opts,out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools bedcov $opt -@ 3 $scan.bed $scan.$fmt | diff $scan.bedcov -");
+        }
+        test_cmd($opts,out=>'dat/empty.expected', cmd=>"$$opts{bin}/samtools bedcov $opt $scan.bed $scan.cram | diff $scan.bedcov -");
+    }
 }
 
 sub test_quickcheck
@@ -2394,6 +2653,43 @@ sub test_quickcheck
     test_cmd($opts, out => 'quickcheck/all.expected', want_fail => 1,
         expect_fail => 1, # due to 5.quickcheck.truncated.cram
         cmd => "$$opts{bin}/samtools quickcheck -v $all_testfiles | sed 's,.*/quickcheck/,,'");
+
+    test_cmd($opts, out => 'quickcheck/all.tsv.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck -@ 2 -O tsv $$opts{path}/quickcheck/1.quickcheck.badeof.bam $$opts{path}/quickcheck/3.quickcheck.ok.bam $$opts{path}/quickcheck/4.quickcheck.ok.bam | sed 's,.*/quickcheck/,,'");
+
+    # 6.quickcheck.badcrc.bam has a damaged CRC32 in its second block, which
+    # only --deep notices
+    test_cmd($opts, out => 'dat/empty.expected',
+        cmd => "$$opts{bin}/samtools quickcheck $$opts{path}/quickcheck/6.quickcheck.badcrc.bam");
+    foreach my $fn ('quickcheck/3.quickcheck.ok.bam', 'quickcheck/4.quickcheck.ok.bam') {
+        test_cmd($opts, out => 'dat/empty.expected',
+            cmd => "$$opts{bin}/samtools quickcheck --deep -@ 2 $$opts{path}/$fn");
+    }
+    test_cmd($opts, out => 'quickcheck/deep.tsv.expected', want_fail => 1,
+        cmd => "$$opts{bin}/samtools quickcheck --deep -O tsv $$opts{path}/quickcheck/6.quickcheck.badcrc.bam $$opts{path}/quickcheck/5.quickcheck.truncated.cram | sed 's,.*/quickcheck/,,'");
+
+    # Verify in many small chunks, with a damaged CRC32 well past the first
+    my $scan = gen_scan_files($opts);
+    foreach my $fmt ('bam', 'cram') {
+        test_cmd($opts, out => 'dat/empty.expected',
+            cmd => "SAMTOOLS_SCAN_MIN_CHUNK=4096 $$opts{bin}/samtools quickcheck --deep -@ 4 $scan.$fmt");
+    }
+    open(my $in, '<:raw', "$scan.bam") or error("$scan.bam: $!");
+    my $dat = do { local $/; <$in> };
+    close($in);
+    my $off = 0;
+    for (my $i = 0; $i < 8; $i++) { $off += unpack('v', substr($dat, $off + 16, 2)) + 1; }
+    my $crc = $off + unpack('v', substr($dat, $off + 16, 2)) + 1 - 8;
+    substr($dat, $crc, 1) = chr(ord(substr($dat, $crc, 1)) ^ 0xff);
+    open(my $out, '>:raw', "$scan.badcrc.bam") or error("$scan.badcrc.bam: $!");
+    print $out $dat;
+    close($out);
+    test_cmd($opts, out => 'quickcheck/scan.badcrc.tsv.expected', want_fail => 1,
+        cmd => "SAMTOOLS_SCAN_MIN_CHUNK=4096 $$opts{bin}/samtools quickcheck --deep -@ 4 -O tsv $scan.badcrc.bam | sed 's,.*/,,'");
+    # ... and it is reported at the same offset as a serial check gives
+    _cmd("$$opts{bin}/samtools quickcheck --deep -vv $scan.badcrc.bam > $scan.badcrc.err 2>&1");
+    test_cmd($opts, out => 'dat/empty.expected',
+        cmd => "SAMTOOLS_SCAN_MIN_CHUNK=4096 $$opts{bin}/samtools quickcheck --deep -vv -@ 4 $scan.badcrc.bam 2>&1 | diff $scan.badcrc.err -");
 }
 
 sub test_reheader
@@ -0,0 +1,84 @@
+/*  thread_pool.c -- run independent jobs on a fixed set of threads.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    int next, n_jobs, ret;
+    tpool_func_t func;
+    void *data;
+} tpool_t;
+
+static void *tpool_worker(void *arg)
+{
+    tpool_t *p = (tpool_t*)arg;
+    for (;;) {
+        int job, ret;
+        pthread_mutex_lock(&p->lock);
+        job = (p->ret < 0)? p->n_jobs : p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (job >= p->n_jobs) break;
+        ret = p->func(p->data, job);
+        if (ret < 0) {
+            pthread_mutex_lock(&p->lock);
+            if (p->ret == 0) p->ret = ret;
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    return NULL;
+}
+
+int tpool_run(int n_jobs, int n_threads, tpool_func_t func, void *data)
+{
+    tpool_t p;
+    pthread_t *tid;
+    int i, n_started = 0;
+
+    if (n_threads > n_jobs) n_threads = n_jobs;
+    if (n_threads <= 1) {
+        for (i = 0; i < n_jobs; ++i) {
+            int ret = func(data, i);
+            if (ret < 0) return ret;
+        }
+        return 0;
+    }
+
+    pthread_mutex_init(&p.lock, NULL);
+    p.next = 0; p.n_jobs = n_jobs; p.ret = 0;
+    p.func = func; p.data = data;
+    tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    if (tid != NULL)
+        for (n_started = 0; n_started < n_threads; ++n_started)
+            if (pthread_create(&tid[n_started], NULL, tpool_worker, &p) != 0) break;
+    // If no thread could be started, do the work ourselves
+    if (n_started == 0) tpool_worker(&p);
+    for (i = 0; i < n_started; ++i) pthread_join(tid[i], NULL);
+    free(tid);
+    pthread_mutex_destroy(&p.lock);
+    return p.ret;
+}
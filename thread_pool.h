@@ -0,0 +1,42 @@
+/*  thread_pool.h -- run independent jobs on a fixed set of threads.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/*
+ * A job function is called once for each job index in [0, n_jobs).
+ * Jobs are handed out in increasing index order, but may complete in
+ * any order; callers wanting ordered output must store per-job results
+ * and combine them afterwards.  A negative return value stops further
+ * jobs from being started.
+ */
+typedef int (*tpool_func_t)(void *data, int job);
+
+/*
+ * Runs n_jobs jobs on up to n_threads threads and waits for them all to
+ * finish.  With n_threads <= 1 the jobs are run in the calling thread.
+ * Returns 0 on success, or the first negative job return value.
+ */
+int tpool_run(int n_jobs, int n_threads, tpool_func_t func, void *data);
+
+#endif
@@ -0,0 +1,83 @@
+/*  tsv_out.c -- buffered writer for tab-separated text output.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "tsv_out.h"
+
+const char tsv_digits[200] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+void tsv_out_init(tsv_out_t *o, FILE *fp)
+{
+    o->fp = fp;
+    o->l = o->err = 0;
+    o->buf = malloc(TSV_OUT_BUFSIZE);
+    o->m = o->buf? TSV_OUT_BUFSIZE : 0;
+}
+
+int tsv_out_flush(tsv_out_t *o)
+{
+    if (o->fp == NULL) return o->err? -1 : 0;
+    if (o->l && fwrite(o->buf, 1, o->l, o->fp) != o->l) o->err = 1;
+    o->l = 0;
+    if (fflush(o->fp) != 0) o->err = 1;
+    return o->err? -1 : 0;
+}
+
+void tsv_out_grow(tsv_out_t *o, size_t n)
+{
+    if (o->fp == NULL) {
+        n += o->l;
+    } else {
+        if (o->l && fwrite(o->buf, 1, o->l, o->fp) != o->l) o->err = 1;
+        o->l = 0;
+    }
+    if (n > o->m) {
+        size_t m = o->m? o->m : TSV_OUT_BUFSIZE;
+        char *buf;
+        while (m < n) m *= 2;
+        if ((buf = realloc(o->buf, m)) == NULL) {
+            fprintf(stderr, "[tsv_out] out of memory\n");
+            abort();
+        }
+        o->buf = buf;
+        o->m = m;
+    }
+}
+
+int tsv_out_destroy(tsv_out_t *o)
+{
+    int ret = tsv_out_flush(o);
+    free(o->buf);
+    o->buf = NULL;
+    o->m = 0;
+    return ret;
+}
@@ -0,0 +1,118 @@
+/*  tsv_out.h -- buffered writer for tab-separated text output.
+
+    Copyright (C) 2016 Genome Research Ltd.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#ifndef TSV_OUT_H
+#define TSV_OUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Output is gathered in a large buffer and written to fp with fwrite()
+ * whenever it fills, so that callers can build lines a character or a
+ * number at a time without going through stdio for each one.  If fp is
+ * NULL, the buffer simply grows to hold everything written to it.
+ */
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t l, m;
+    int err;        // set once any write has failed
+} tsv_out_t;
+
+#define TSV_OUT_BUFSIZE (1 << 20)
+
+// Pairs of digits "00" to "99", for formatting integers two at a time
+extern const char tsv_digits[200];
+
+void tsv_out_init(tsv_out_t *o, FILE *fp);
+
+/*
+ * Writes out the buffered text.  Returns 0 on success, or -1 if this or
+ * any earlier write failed.
+ */
+int tsv_out_flush(tsv_out_t *o);
+
+/*
+ * Flushes and frees the buffer; fp itself is left open.  Returns as for
+ * tsv_out_flush().
+ */
+int tsv_out_destroy(tsv_out_t *o);
+
+// Makes room for at least n more characters, returning where they go
+void tsv_out_grow(tsv_out_t *o, size_t n);
+static inline char *tsv_out_reserve(tsv_out_t *o, size_t n)
+{
+    if (o->m - o->l < n) tsv_out_grow(o, n);
+    return o->buf + o->l;
+}
+
+static inline void tsv_putc(tsv_out_t *o, int c)
+{
+    if (o->l == o->m) tsv_out_grow(o, 1);
+    o->buf[o->l++] = c;
+}
+
+static inline void tsv_putsn(tsv_out_t *o, const char *s, size_t l)
+{
+    memcpy(tsv_out_reserve(o, l), s, l);
+    o->l += l;
+}
+
+static inline void tsv_puts(tsv_out_t *o, const char *s)
+{
+    tsv_putsn(o, s, strlen(s));
+}
+
+// Formats x at s, which needs room for 20 characters, returning the end
+static inline char *tsv_fmtul(char *s, uint64_t x)
+{
+    char tmp[20], *p = tmp + sizeof tmp;
+    while (x >= 100) {
+        const char *d = tsv_digits + 2 * (x % 100);
+        x /= 100;
+        *--p = d[1]; *--p = d[0];
+    }
+    if (x >= 10) { *--p = tsv_digits[2*x+1]; *--p = tsv_digits[2*x]; }
+    else *--p = '0' + x;
+    memcpy(s, p, tmp + sizeof tmp - p);
+    return s + (tmp + sizeof tmp - p);
+}
+
+static inline void tsv_putul(tsv_out_t *o, uint64_t x)
+{
+    o->l = tsv_fmtul(tsv_out_reserve(o, 20), x) - o->buf;
+}
+
+static inline void tsv_putl(tsv_out_t *o, int64_t x)
+{
+    if (x < 0) { tsv_putc(o, '-'); tsv_putul(o, -(uint64_t)x); }
+    else tsv_putul(o, x);
+}
+
+static inline void tsv_putw(tsv_out_t *o, int x)
+{
+    tsv_putl(o, x);
+}
+
+#endif